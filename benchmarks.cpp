@@ -0,0 +1,481 @@
+// Benchmarks for mkcurl hot paths. We run requests against a loopback
+// HTTP/1.1 server (see loopback-server.hpp), or against --url, for example
+// to measure HTTPS, using a Client, a ClientPool and a MultiClient, and we
+// also measure the setup and callback code paths in isolation.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+#define MKCURL_INLINE_IMPL  // We want to benchmark internal functions
+#include "mkcurl.hpp"
+
+#include "loopback-server.hpp"
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif  // __clang__
+#include "argh.h"
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif  // __clang__
+
+// Allocation counting
+// -------------------
+//
+// We count the C++ allocations by replacing the global operator new and the
+// cURL allocations using curl_global_init_mem(). Allocations performed by
+// the loopback server threads are not counted.
+
+static std::atomic<uint64_t> mkbench_allocs{0};
+
+static thread_local bool mkbench_uncounted = false;
+
+static void *mkbench_malloc(size_t size) noexcept {
+  if (!mkbench_uncounted) {
+    mkbench_allocs.fetch_add(1, std::memory_order_relaxed);
+  }
+  return malloc(size);
+}
+
+void *operator new(size_t size) {
+  void *ptr = mkbench_malloc(size > 0 ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return ptr;
+}
+
+// GCC >= 11 does not know that we have also replaced operator new when it
+// inlines operator delete and therefore believes we are mismatching them.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *ptr) noexcept { free(ptr); }
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+extern "C" {
+
+static void *mkbench_curl_malloc_cb_(size_t size) {
+  return mkbench_malloc(size);
+}
+
+static void mkbench_curl_free_cb_(void *ptr) { free(ptr); }
+
+static void *mkbench_curl_realloc_cb_(void *ptr, size_t size) {
+  if (!mkbench_uncounted) {
+    mkbench_allocs.fetch_add(1, std::memory_order_relaxed);
+  }
+  return realloc(ptr, size);
+}
+
+static char *mkbench_curl_strdup_cb_(const char *str) {
+  size_t size = strlen(str) + 1;
+  auto ptr = static_cast<char *>(mkbench_malloc(size));
+  if (ptr != nullptr) {
+    memcpy(ptr, str, size);
+  }
+  return ptr;
+}
+
+static void *mkbench_curl_calloc_cb_(size_t nmemb, size_t size) {
+  if (!mkbench_uncounted) {
+    mkbench_allocs.fetch_add(1, std::memory_order_relaxed);
+  }
+  return calloc(nmemb, size);
+}
+
+}  // extern "C"
+
+// Measurements
+// ------------
+
+static int64_t mkbench_now_us() noexcept {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// mkbench_stats accumulates the measurements of a benchmark.
+struct mkbench_stats {
+  uint64_t requests = 0;
+  uint64_t failures = 0;
+  uint64_t bytes = 0;
+  int64_t wall_us = 0;
+  int64_t setup_us = 0;
+  uint64_t allocs = 0;
+  std::vector<int64_t> latencies_us;
+
+  void add(const mk::curl::Response &res, int64_t elapsed_us) {
+    requests += 1;
+    if (res.error != CURLE_OK || res.status_code != 200) {
+      failures += 1;
+    }
+    bytes += res.body.size();
+    // The time not accounted for by cURL is spent by us preparing the
+    // handle and collecting the results, or by cURL in setting it up.
+    setup_us += std::max<int64_t>(0, elapsed_us - res.timings.total);
+    latencies_us.push_back(elapsed_us);
+  }
+};
+
+static double mkbench_percentile(std::vector<int64_t> &v, double p) {
+  if (v.empty()) {
+    return 0.0;
+  }
+  std::sort(v.begin(), v.end());
+  auto idx = static_cast<size_t>(p * static_cast<double>(v.size() - 1));
+  return static_cast<double>(v[idx]) / 1000.0;
+}
+
+static bool mkbench_report(const char *name, mkbench_stats &stats) {
+  double n = static_cast<double>(std::max<uint64_t>(stats.requests, 1));
+  double secs = static_cast<double>(std::max<int64_t>(stats.wall_us, 1)) / 1e6;
+  double p50 = mkbench_percentile(stats.latencies_us, 0.50);
+  double p99 = mkbench_percentile(stats.latencies_us, 0.99);
+  printf("%-10s %8llu %10.1f %10.1f %10.2f %10.1f %9.3f %9.3f %8llu\n", name,
+         static_cast<unsigned long long>(stats.requests),
+         static_cast<double>(stats.requests) / secs,
+         static_cast<double>(stats.setup_us) / n,
+         static_cast<double>(stats.bytes) / secs / 1e6,
+         static_cast<double>(stats.allocs) / n, p50, p99,
+         static_cast<unsigned long long>(stats.failures));
+  fflush(stdout);
+  return stats.failures == 0;
+}
+
+static void mkbench_header() {
+  printf("%-10s %8s %10s %10s %10s %10s %9s %9s %8s\n", "mode", "reqs",
+         "req/s", "setup_us", "MB/s", "allocs", "p50_ms", "p99_ms", "fails");
+}
+
+// Benchmarks
+// ----------
+
+static mkbench_stats mkbench_serial(
+    const mk::curl::Request &req, size_t requests) {
+  mkbench_stats stats;
+  mk::curl::Client client;
+  mk::curl::Response res;
+  uint64_t allocs = mkbench_allocs;
+  int64_t start = mkbench_now_us();
+  for (size_t i = 0; i < requests; ++i) {
+    int64_t begin = mkbench_now_us();
+    client.perform(req, res);
+    stats.add(res, mkbench_now_us() - begin);
+  }
+  stats.wall_us = mkbench_now_us() - start;
+  stats.allocs = mkbench_allocs - allocs;
+  return stats;
+}
+
+static mkbench_stats mkbench_prepared(
+    const mk::curl::Request &req, size_t requests) {
+  mkbench_stats stats;
+  mk::curl::Client client;
+  mk::curl::PreparedRequest prepared{req};
+  uint64_t allocs = mkbench_allocs;
+  int64_t start = mkbench_now_us();
+  for (size_t i = 0; i < requests; ++i) {
+    int64_t begin = mkbench_now_us();
+    mk::curl::Response res = client.perform(prepared);
+    stats.add(res, mkbench_now_us() - begin);
+  }
+  stats.wall_us = mkbench_now_us() - start;
+  stats.allocs = mkbench_allocs - allocs;
+  return stats;
+}
+
+static mkbench_stats mkbench_pooled(
+    const mk::curl::Request &req, size_t requests, size_t concurrency) {
+  mkbench_stats stats;
+  mk::curl::ClientPool pool{concurrency};
+  std::mutex mutex;
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> threads;
+  uint64_t allocs = mkbench_allocs;
+  int64_t start = mkbench_now_us();
+  for (size_t t = 0; t < concurrency; ++t) {
+    threads.emplace_back([&]() {
+      mkbench_stats local;
+      while (next.fetch_add(1) < requests) {
+        int64_t begin = mkbench_now_us();
+        mk::curl::Response res = pool.perform(req);
+        local.add(res, mkbench_now_us() - begin);
+      }
+      std::unique_lock<std::mutex> _{mutex};
+      stats.requests += local.requests;
+      stats.failures += local.failures;
+      stats.bytes += local.bytes;
+      stats.setup_us += local.setup_us;
+      stats.latencies_us.insert(stats.latencies_us.end(),
+                                local.latencies_us.begin(),
+                                local.latencies_us.end());
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  stats.wall_us = mkbench_now_us() - start;
+  stats.allocs = mkbench_allocs - allocs;
+  return stats;
+}
+
+static mkbench_stats mkbench_multi(
+    const mk::curl::Request &req, size_t requests, size_t concurrency) {
+  mkbench_stats stats;
+  mk::curl::MultiSettings settings;
+  settings.concurrency = concurrency;
+  mk::curl::MultiClient client{std::move(settings)};
+  std::vector<mk::curl::Request> reqs(requests, req);
+  uint64_t allocs = mkbench_allocs;
+  int64_t start = mkbench_now_us();
+  std::vector<mk::curl::Response> responses = client.perform(reqs);
+  stats.wall_us = mkbench_now_us() - start;
+  stats.allocs = mkbench_allocs - allocs;
+  for (auto &res : responses) {
+    // Transfers run concurrently, so the latency is what cURL measured.
+    stats.add(res, res.timings.total);
+  }
+  return stats;
+}
+
+// mkbench_setup measures mkcurl_setup() alone on a reused handle.
+static mkbench_stats mkbench_setup(
+    const mk::curl::Request &req, size_t iterations) {
+  mkbench_stats stats;
+  mk::curl::mkcurl_uptr handle{curl_easy_init()};
+  uint64_t allocs = mkbench_allocs;
+  int64_t start = mkbench_now_us();
+  for (size_t i = 0; i < iterations; ++i) {
+    mk::curl::Response res;
+    mk::curl::mkcurl_xfer xfer;
+    int64_t begin = mkbench_now_us();
+    mk::curl::mkcurl_setup(handle, req, xfer, res);
+    int64_t elapsed = mkbench_now_us() - begin;
+    res.status_code = (res.error == CURLE_OK) ? 200 : 0;
+    stats.add(res, elapsed);
+  }
+  stats.wall_us = mkbench_now_us() - start;
+  stats.allocs = mkbench_allocs - allocs;
+  return stats;
+}
+
+// mkbench_body_cb measures mkcurl_body_cb_() appending @p total bytes
+// in chunks of CURL_MAX_WRITE_SIZE bytes, like cURL does.
+static mkbench_stats mkbench_body_cb(size_t total) {
+  mkbench_stats stats;
+  std::vector<char> chunk(CURL_MAX_WRITE_SIZE, 'x');
+  mk::curl::Response res;
+  res.status_code = 200;
+  uint64_t allocs = mkbench_allocs;
+  int64_t start = mkbench_now_us();
+  for (size_t off = 0; off < total; off += chunk.size()) {
+    (void)mkcurl_body_cb_(chunk.data(), 1, chunk.size(), &res);
+  }
+  stats.wall_us = mkbench_now_us() - start;
+  stats.allocs = mkbench_allocs - allocs;
+  stats.add(res, stats.wall_us);
+  stats.setup_us = 0;
+  return stats;
+}
+
+// mkbench_debug_cb measures mkcurl_debug_cb_() processing the headers and
+// the body of @p transfers transfers with @p size bytes bodies.
+static mkbench_stats mkbench_debug_cb(
+    mk::curl::LogLevel level, size_t transfers, size_t size) {
+  mkbench_stats stats;
+  std::string reqhdrs = "GET /1024 HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                        "User-Agent: mkcurl\r\nAccept: */*\r\n\r\n";
+  std::string info = "  Trying 127.0.0.1:80...\n";
+  std::string status = "HTTP/1.1 200 OK\r\n";
+  std::string header = "Content-Type: application/octet-stream\r\n";
+  std::vector<char> chunk(CURL_MAX_WRITE_SIZE, 'x');
+  uint64_t allocs = mkbench_allocs;
+  int64_t start = mkbench_now_us();
+  for (size_t i = 0; i < transfers; ++i) {
+    mk::curl::Response res;
+    mk::curl::mkcurl_xfer xfer;
+    xfer.res = &res;
+    xfer.log_level = level;
+    int64_t begin = mkbench_now_us();
+    (void)mkcurl_debug_cb_(
+        nullptr, CURLINFO_TEXT, &info[0], info.size(), &xfer);
+    (void)mkcurl_debug_cb_(
+        nullptr, CURLINFO_HEADER_OUT, &reqhdrs[0], reqhdrs.size(), &xfer);
+    (void)mkcurl_debug_cb_(
+        nullptr, CURLINFO_HEADER_IN, &status[0], status.size(), &xfer);
+    (void)mkcurl_debug_cb_(
+        nullptr, CURLINFO_HEADER_IN, &header[0], header.size(), &xfer);
+    for (size_t off = 0; off < size; off += chunk.size()) {
+      size_t count = std::min(chunk.size(), size - off);
+      (void)mkcurl_debug_cb_(
+          nullptr, CURLINFO_DATA_IN, chunk.data(), count, &xfer);
+    }
+    mk::curl::mkcurl_flush_data_log(xfer);
+    res.status_code = 200;
+    stats.add(res, mkbench_now_us() - begin);
+    stats.bytes += size;
+  }
+  stats.wall_us = mkbench_now_us() - start;
+  stats.allocs = mkbench_allocs - allocs;
+  stats.setup_us = 0;
+  return stats;
+}
+
+// LCOV_EXCL_START
+static void usage() {
+  // clang-format off
+  std::clog << "\n";
+  std::clog << "Usage: benchmarks [options]\n";
+  std::clog << "\n";
+  std::clog << "Options can start with either a single dash (i.e. -option) or\n";
+  std::clog << "a double dash (i.e. --option). Available options:\n";
+  std::clog << "\n";
+  std::clog << "  --ca-bundle-path <path> : path to OpenSSL CA bundle\n";
+  std::clog << "  --concurrency <n>       : number of concurrent requests\n";
+  std::clog << "                            in pooled and multi mode (8)\n";
+  std::clog << "  --enable-http2          : attempt to use HTTP/2\n";
+  std::clog << "  --log-level <level>     : none, summary or full (summary)\n";
+  std::clog << "  --requests <n>          : number of requests per mode (1000)\n";
+  std::clog << "  --size <bytes>          : size of the response body (1024)\n";
+  std::clog << "  --url <url>             : use <url> rather than the loopback\n";
+  std::clog << "                            server, e.g., to measure HTTPS\n";
+  std::clog << "\n";
+  std::clog << "The allocs column counts both C++ and cURL allocations. The\n";
+  std::clog << "setup_us column is the time not spent by cURL in the transfer.\n";
+  std::clog << std::endl;
+  // clang-format on
+}
+// LCOV_EXCL_STOP
+
+int main(int, char **argv) {
+  if (curl_global_init_mem(CURL_GLOBAL_ALL, mkbench_curl_malloc_cb_,
+                           mkbench_curl_free_cb_, mkbench_curl_realloc_cb_,
+                           mkbench_curl_strdup_cb_,
+                           mkbench_curl_calloc_cb_) != CURLE_OK) {
+    std::clog << "fatal: curl_global_init_mem failed" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  mk::curl::Request req;
+  req.log_level = mk::curl::LogLevel::summary;
+  size_t requests = 1000, size = 1024, concurrency = 8;
+  {
+    argh::parser cmdline;
+    cmdline.add_param("ca-bundle-path");
+    cmdline.add_param("concurrency");
+    cmdline.add_param("log-level");
+    cmdline.add_param("requests");
+    cmdline.add_param("size");
+    cmdline.add_param("url");
+    cmdline.parse(argv);
+    for (auto &flag : cmdline.flags()) {
+      if (flag == "enable-http2") {
+        req.enable_http2 = true;
+      } else {
+        std::clog << "fatal: unrecognized flag: " << flag << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+    for (auto &param : cmdline.params()) {
+      if (param.first == "ca-bundle-path") {
+        req.ca_path = param.second;
+      } else if (param.first == "concurrency") {
+        concurrency = std::max<size_t>(1, strtoull(
+            param.second.c_str(), nullptr, 10));
+      } else if (param.first == "log-level") {
+        if (param.second == "none") {
+          req.log_level = mk::curl::LogLevel::none;
+        } else if (param.second == "summary") {
+          req.log_level = mk::curl::LogLevel::summary;
+        } else if (param.second == "full") {
+          req.log_level = mk::curl::LogLevel::full;
+        } else {
+          std::clog << "fatal: invalid log level: " << param.second
+                    << std::endl;
+          usage();
+          exit(EXIT_FAILURE);
+        }
+      } else if (param.first == "requests") {
+        requests = strtoull(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "size") {
+        size = strtoull(param.second.c_str(), nullptr, 10);
+      } else if (param.first == "url") {
+        req.url = param.second;
+      } else {
+        std::clog << "fatal: unrecognized param: " << param.first << std::endl;
+        usage();
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (cmdline.pos_args().size() > 1) {
+      usage();
+      exit(EXIT_FAILURE);
+    }
+  }
+  mk::curl::loopback::Settings settings;
+  settings.thread_init = []() { mkbench_uncounted = true; };
+  mk::curl::loopback::Server server{std::move(settings)};
+  if (req.url.empty()) {
+    if (!server.start()) {
+      std::clog << "fatal: cannot start the loopback server" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    req.url = server.url("/?size=" + std::to_string(size));
+  }
+  std::clog << "benchmarking " << req.url << " with " << requests
+            << " requests per mode and concurrency " << concurrency
+            << std::endl;
+  bool okay = true;
+  mkbench_header();
+  {
+    auto stats = mkbench_serial(req, requests);
+    okay = mkbench_report("serial", stats) && okay;
+  }
+  {
+    auto stats = mkbench_prepared(req, requests);
+    okay = mkbench_report("prepared", stats) && okay;
+  }
+  {
+    auto stats = mkbench_pooled(req, requests, concurrency);
+    okay = mkbench_report("pooled", stats) && okay;
+  }
+  {
+    auto stats = mkbench_multi(req, requests, concurrency);
+    okay = mkbench_report("multi", stats) && okay;
+  }
+  {
+    auto stats = mkbench_setup(req, requests);
+    okay = mkbench_report("setup", stats) && okay;
+  }
+  {
+    auto stats = mkbench_body_cb(size_t{64} << 20);
+    okay = mkbench_report("body_cb", stats) && okay;
+  }
+  {
+    auto stats = mkbench_debug_cb(req.log_level, requests, size);
+    okay = mkbench_report("debug_cb", stats) && okay;
+  }
+  server.stop();
+  curl_global_cleanup();
+  exit(okay ? EXIT_SUCCESS : EXIT_FAILURE);
+}
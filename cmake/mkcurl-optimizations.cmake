@@ -0,0 +1,76 @@
+# Optional optimizations of the mkcurl build.
+#
+# CMakeLists.txt is generated by `mkbuild`, which has no knobs for these, so
+# they live here and are pulled in at configure time using
+#
+#     cmake -DCMAKE_PROJECT_INCLUDE=$PWD/cmake/mkcurl-optimizations.cmake ...
+#
+# from the source directory (CMake wants an absolute path here). See also the
+# "Optimized builds" section of README.md.
+#
+# CMake includes this file right after `project()`, before the targets
+# exist, hence we defer touching them until the end of the configuration.
+
+if(("${CMAKE_VERSION}" VERSION_LESS "3.19"))
+  message(FATAL_ERROR "mkcurl-optimizations.cmake requires CMake >= 3.19")
+endif()
+
+option(MKCURL_ENABLE_LTO "Build with link time optimization" OFF)
+
+# MKCURL_PGO is either empty, `generate` or `use`. Build with `generate`,
+# run the `pgo-train` target, which exercises the library using the loopback
+# server of the benchmarks and of the integration tests, then reconfigure the
+# same build directory with `use` and rebuild.
+set(MKCURL_PGO "" CACHE STRING "Profile guided optimization phase")
+set(MKCURL_PGO_DIR "${CMAKE_BINARY_DIR}/pgo" CACHE PATH "Profiles directory")
+
+function(mkcurl_optimize)
+  set(MKCURL_TARGETS mkcurl benchmarks integration-tests mkcurl-client)
+  if(("${MKCURL_ENABLE_LTO}"))
+    include(CheckIPOSupported)
+    check_ipo_supported(RESULT MKCURL_IPO_SUPPORTED OUTPUT MKCURL_IPO_OUTPUT)
+    if(NOT ("${MKCURL_IPO_SUPPORTED}"))
+      message(FATAL_ERROR "LTO not supported: ${MKCURL_IPO_OUTPUT}")
+    endif()
+    set_property(TARGET ${MKCURL_TARGETS}
+      PROPERTY INTERPROCEDURAL_OPTIMIZATION TRUE)
+  endif()
+  if(("${MKCURL_PGO}" STREQUAL "generate"))
+    set(MKCURL_PGO_FLAGS "-fprofile-generate=${MKCURL_PGO_DIR}")
+    add_custom_target(pgo-train
+      COMMAND benchmarks --requests 2000
+      COMMAND integration-tests "The loopback server works"
+      DEPENDS benchmarks integration-tests
+    )
+  elseif(("${MKCURL_PGO}" STREQUAL "use"))
+    if("${CMAKE_CXX_COMPILER_ID}" MATCHES "Clang")
+      find_program(MKCURL_LLVM_PROFDATA llvm-profdata)
+      if(NOT ("${MKCURL_LLVM_PROFDATA}"))
+        message(FATAL_ERROR "llvm-profdata not found")
+      endif()
+      execute_process(COMMAND ${MKCURL_LLVM_PROFDATA} merge
+        -output=${MKCURL_PGO_DIR}/default.profdata ${MKCURL_PGO_DIR}
+        RESULT_VARIABLE MKCURL_PGO_FAILURE)
+      if("${MKCURL_PGO_FAILURE}")
+        message(FATAL_ERROR "${MKCURL_PGO_FAILURE}")
+      endif()
+      set(MKCURL_PGO_FLAGS "-fprofile-use=${MKCURL_PGO_DIR}/default.profdata")
+    else()
+      set(MKCURL_PGO_FLAGS "-fprofile-use=${MKCURL_PGO_DIR} -fprofile-correction -Wno-missing-profile")
+    endif()
+  elseif(NOT ("${MKCURL_PGO}" STREQUAL ""))
+    message(FATAL_ERROR "MKCURL_PGO must be empty, generate or use")
+  endif()
+  if(NOT ("${MKCURL_PGO}" STREQUAL ""))
+    if("${CMAKE_CXX_COMPILER_ID}" STREQUAL "MSVC")
+      message(FATAL_ERROR "MKCURL_PGO is not supported with MSVC")
+    endif()
+    separate_arguments(MKCURL_PGO_FLAGS)
+    foreach(MKCURL_TARGET ${MKCURL_TARGETS})
+      target_compile_options(${MKCURL_TARGET} PRIVATE ${MKCURL_PGO_FLAGS})
+      target_link_options(${MKCURL_TARGET} PRIVATE ${MKCURL_PGO_FLAGS})
+    endforeach()
+  endif()
+endfunction()
+
+cmake_language(DEFER CALL mkcurl_optimize)
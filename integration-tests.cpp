@@ -1,7 +1,9 @@
 #include <string.h>
 
+#include <chrono>
 #include <exception>
 #include <mutex>
+#include <thread>
 
 #include <curl/curl.h>
 
@@ -10,6 +12,8 @@
 
 #include "mkcurl.hpp"
 
+#include "loopback-server.hpp"
+
 static void run(mk::curl::Response res, bool tolerate_failure) {
   std::clog << "=== BEGIN SUMMARY ==="
             << std::endl << "CURL error code: " << res.error << std::endl
@@ -71,6 +75,35 @@ TEST_CASE("HTTP2 works") {
   run(mk::curl::perform(req), tolerate_failure);
 }
 
+TEST_CASE("We can collect the certificate chain") {
+  mk::curl::Request req;
+  req.url = "https://www.kernel.org";
+  SECTION("when enable_certinfo is true") {
+    req.enable_certinfo = true;
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.certs.find("-----BEGIN CERTIFICATE-----") == 0);
+    run(std::move(res), false);
+  }
+  SECTION("when enable_certinfo is false") {
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.certs.empty());
+    run(std::move(res), false);
+  }
+}
+
+TEST_CASE("Timings are monotonic") {
+  mk::curl::Request req;
+  req.url = "https://www.google.com/humans.txt";
+  auto res = mk::curl::perform(req);
+  run(res, false);
+  REQUIRE(res.timings.namelookup > 0);
+  REQUIRE(res.timings.connect >= res.timings.namelookup);
+  REQUIRE(res.timings.appconnect >= res.timings.connect);
+  REQUIRE(res.timings.pretransfer >= res.timings.appconnect);
+  REQUIRE(res.timings.starttransfer >= res.timings.pretransfer);
+  REQUIRE(res.timings.total >= res.timings.starttransfer);
+}
+
 TEST_CASE("We retry a request") {
   mk::curl::Request req;
   SECTION("when the DNS is failing") {
@@ -89,3 +122,655 @@ TEST_CASE("We retry a request") {
     REQUIRE(resp.error != CURLE_OK);
   }
 }
+
+TEST_CASE("MultiClient works") {
+  mk::curl::MultiSettings settings;
+  settings.concurrency = 2;
+  mk::curl::MultiClient client{settings};
+  std::vector<mk::curl::Request> reqs(3);
+  reqs[0].url = "https://www.google.com";
+  reqs[1].url = "https://www.google.com/robots.txt";
+  reqs[2].url = "https://www.google.com/humans.txt";
+  for (auto &resp : client.perform(reqs)) {
+    run(std::move(resp), false);
+  }
+}
+
+TEST_CASE("MultiClient multiplexes HTTP2 streams") {
+  // We should recompile CURL for Windows with HTTP2 support
+#ifdef _WIN32
+  bool tolerate_failure = true;
+#else
+  bool tolerate_failure = false;
+#endif
+  mk::curl::MultiSettings settings;
+  settings.max_host_connections = 1;
+  mk::curl::MultiClient client{settings};
+  std::vector<mk::curl::Request> reqs(3);
+  for (auto &req : reqs) {
+    req.enable_http2 = true;
+  }
+  reqs[0].url = "https://www.google.com";
+  reqs[1].url = "https://www.google.com/robots.txt";
+  reqs[2].url = "https://www.google.com/humans.txt";
+  size_t connections = 0;
+  for (auto &resp : client.perform(reqs)) {
+    for (auto &log : resp.logs) {
+      if (log.line.find("Connected to ") == 0) {
+        connections += 1;
+      }
+    }
+    run(std::move(resp), tolerate_failure);
+  }
+  if (!tolerate_failure) {
+    REQUIRE(connections == 1);
+  }
+}
+
+TEST_CASE("AsyncClient works") {
+  mk::curl::AsyncClient client;
+  std::vector<std::future<mk::curl::Response>> futures;
+  for (auto &url : {"https://www.google.com",
+                    "https://www.google.com/robots.txt",
+                    "https://www.google.com/humans.txt"}) {
+    mk::curl::Request req;
+    req.url = url;
+    futures.push_back(client.perform(std::move(req)));
+  }
+  for (auto &future : futures) {
+    run(future.get(), false);
+  }
+}
+
+TEST_CASE("Clients can use the same Share") {
+  std::shared_ptr<mk::curl::Share> share{new mk::curl::Share};
+  mk::curl::Request req;
+  req.url = "https://www.google.com/robots.txt";
+  for (size_t i = 0; i < 2; ++i) {
+    mk::curl::Client client{share};
+    run(client.perform(req), false);
+  }
+}
+
+TEST_CASE("PreparedRequest works") {
+  mk::curl::Request req;
+  req.method = "POST";
+  req.url = "https://httpbin.org/post";
+  mk::curl::PreparedRequest prepared{req};
+  mk::curl::Client client;
+  for (auto &body : {"abc", "defgh"}) {
+    prepared.set_body(body);
+    auto res = client.perform(prepared);
+    run(res, false);
+    REQUIRE(res.body.find(body) != std::string::npos);
+  }
+  prepared.set_url("https://httpbin.org/anything");
+  run(client.perform(prepared), false);
+}
+
+TEST_CASE("DNSCache learns the addresses") {
+  mk::curl::Request req;
+  req.url = "https://www.google.com/humans.txt";
+  req.dns_cache = std::make_shared<mk::curl::DNSCache>(60000);
+  run(mk::curl::perform(req), false);
+  REQUIRE(req.dns_cache->lookup("www.google.com", 443).size() == 1);
+  auto res = mk::curl::perform(req);
+  run(res, false);
+  bool pinned = false;
+  for (auto &log : res.logs) {
+    pinned = pinned || log.line.find("Added mkcurl-") == 0;
+  }
+  REQUIRE(pinned);
+}
+
+TEST_CASE("DNS over HTTPS works") {
+  mk::curl::Request req;
+  req.url = "https://www.google.com/humans.txt";
+  req.doh_url = "https://dns.google/dns-query";
+  run(mk::curl::perform(req), false);
+}
+
+TEST_CASE("We can take throughput samples") {
+  mk::curl::Request req;
+  req.url = "https://httpbin.org/bytes/65536";
+  req.sample_interval_us = 250000;
+  req.max_recv_speed = 32768;
+  auto res = mk::curl::perform(req);
+  run(res, false);
+  REQUIRE(res.samples.size() >= 4);
+  for (size_t i = 1; i < res.samples.size(); ++i) {
+    REQUIRE(res.samples[i].elapsed_us >= res.samples[i - 1].elapsed_us);
+    REQUIRE(res.samples[i].bytes_recv >= res.samples[i - 1].bytes_recv);
+  }
+}
+
+TEST_CASE("ClientPool works") {
+  std::shared_ptr<mk::curl::Share> share{new mk::curl::Share};
+  mk::curl::ClientPool pool{2, share};
+  std::vector<std::future<mk::curl::Response>> futures;
+  for (size_t i = 0; i < 4; ++i) {
+    futures.push_back(std::async(std::launch::async, [&]() {
+      mk::curl::Request req;
+      req.url = "https://www.google.com/robots.txt";
+      return pool.perform(req);
+    }));
+  }
+  for (auto &future : futures) {
+    run(future.get(), false);
+  }
+}
+
+TEST_CASE("The body sink receives the body") {
+  mk::curl::Request req;
+  size_t count = 0;
+  req.body_sink = [&](const char *, size_t size) {
+    count += size;
+    return true;
+  };
+  req.url = "https://www.kernel.org";
+  mk::curl::Response res = mk::curl::perform(req);
+  REQUIRE(res.body.empty());
+  REQUIRE(count > 0);
+  run(std::move(res), false);
+}
+
+TEST_CASE("The body source provides the body") {
+  mk::curl::Request req;
+  std::string body = "{\"net-tests\":[]}";
+  auto source = [&](char *buffer, size_t size) {
+    size_t count = (std::min)(size, body.size());
+    memcpy(buffer, body.data(), count);
+    body = body.substr(count);
+    return count;
+  };
+  req.method = "POST";
+  req.url = "https://httpbin.org/post";
+  SECTION("when the size is known") {
+    req.body_source_size = (int64_t)body.size();
+    req.body_source = source;
+    run(mk::curl::perform(req), false);
+  }
+  SECTION("when the size is not known") {
+    req.body_source = source;
+    run(mk::curl::perform(req), false);
+  }
+}
+
+TEST_CASE("The loopback server works") {
+  mk::curl::loopback::Server server;
+  REQUIRE(server.start());
+  mk::curl::Request req;
+  req.retries = 0;
+
+  SECTION("when sending a body with a Content-Length") {
+    req.url = server.url("/?size=100000");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.status_code == 200);
+    REQUIRE(res.body == std::string(100000, 'x'));
+  }
+
+  SECTION("when sending a chunked body") {
+    req.url = server.url("/?size=10000&chunked=1&chunk_size=100");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.body == std::string(10000, 'x'));
+    REQUIRE(res.response_headers.find("chunked") != std::string::npos);
+  }
+
+  SECTION("when echoing a body with a Content-Length") {
+    req.method = "POST";
+    req.body = std::string(1 << 20, 'y');  // Large enough for Expect
+    req.url = server.url("/?echo=1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.body == req.body);
+  }
+
+  SECTION("when echoing a chunked body") {
+    std::string body(100000, 'z');
+    size_t off = 0;
+    req.method = "POST";
+    req.body_source = [&](char *buffer, size_t size) {
+      size_t count = (std::min)(size, body.size() - off);
+      memcpy(buffer, body.data() + off, count);
+      off += count;
+      return count;
+    };
+    req.url = server.url("/?echo=1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.body == body);
+  }
+
+  SECTION("when using a body sink") {
+    size_t count = 0;
+    req.body_sink = [&](const char *, size_t size) {
+      count += size;
+      return true;
+    };
+    req.url = server.url("/?size=100000");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.body.empty());
+    REQUIRE(count == 100000);
+    REQUIRE(res.body_bytes_recv == 100000);
+    REQUIRE(res.body_bytes_decoded == 100000);
+  }
+
+  SECTION("when the body is compressed") {
+    // This is the gzip encoding of 10000 times 'x', which the server echoes
+    // back pretending the response body is compressed.
+    static const unsigned char gzipped[] = {
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xed,
+        0xc1, 0x01, 0x0d, 0x00, 0x00, 0x00, 0xc2, 0xa0, 0xda, 0x8f, 0x6f,
+        0x0e, 0x37, 0xa0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0xe0, 0xdf, 0x00, 0xa3, 0xa4, 0x55, 0x0d, 0x10, 0x27, 0x00,
+        0x00};
+    req.method = "POST";
+    req.body.assign((const char *)gzipped, sizeof(gzipped));
+    req.enable_compression = true;
+    req.url = server.url("/?echo=1&header=Content-Encoding:gzip");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.request_headers.find("Accept-Encoding:") != std::string::npos);
+    REQUIRE(res.body == std::string(10000, 'x'));
+    REQUIRE(res.body_bytes_recv == (int64_t)sizeof(gzipped));
+    REQUIRE(res.body_bytes_decoded == 10000);
+  }
+
+  SECTION("when using a custom status and headers") {
+    req.url = server.url("/?status=503&header=Retry-After:1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.status_code == 503);
+    REQUIRE(res.response_headers.find("Retry-After:1") != std::string::npos);
+  }
+
+  SECTION("when not retrying a status by default") {
+    req.retries = 2;
+    req.url = server.url("/?status=503&header=Retry-After:1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.status_code == 503);
+    REQUIRE(res.attempts.size() == 1);
+  }
+
+  SECTION("when logging the data of each attempt") {
+    req.retries = 1;
+    req.retry_policy.retriable_statuses = {503};
+    req.retry_policy.initial_backoff_ms = 1;
+    req.url = server.url("/?status=503&size=10");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.attempts.size() == 2);
+    size_t data = res.logs.size(), retry = res.logs.size();
+    for (size_t i = 0; i < res.logs.size(); ++i) {
+      if (data == res.logs.size() && res.logs[i].line == "<data: 10") {
+        data = i;
+      }
+      if (retry == res.logs.size() &&
+          res.logs[i].line.find("Transient failure") == 0) {
+        retry = i;
+      }
+    }
+    REQUIRE(data < retry);
+    REQUIRE(retry < res.logs.size());
+  }
+
+  SECTION("when honouring Retry-After") {
+    req.retries = 1;
+    req.retry_policy.retriable_statuses = {503};
+    req.url = server.url("/?status=503&header=Retry-After:1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.status_code == 503);
+    REQUIRE(res.attempts.size() == 2);
+    REQUIRE(res.attempts[0].delay_ms >= 1000);
+  }
+
+  SECTION("when honouring Retry-After with a body sink") {
+    req.retries = 1;
+    req.retry_policy.retriable_statuses = {503};
+    req.retry_policy.retry_non_idempotent = true;
+    req.body_sink = [](const char *, size_t) { return true; };
+    req.url = server.url("/?status=503&header=Retry-After:1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.status_code == 503);
+    REQUIRE(res.attempts.size() == 2);
+    REQUIRE(res.attempts[0].delay_ms >= 1000);
+    std::string value;
+    REQUIRE(mk::curl::find_header(res, "Retry-After", value));
+  }
+
+  SECTION("when Retry-After exceeds max_retry_after_ms") {
+    req.retries = 3;
+    req.retry_policy.retriable_statuses = {503};
+    req.retry_policy.max_retry_after_ms = 500;
+    req.url = server.url("/?status=503&header=Retry-After:1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.status_code == 503);
+    REQUIRE(res.attempts.size() == 1);
+  }
+
+  SECTION("when following redirects") {
+    req.follow_redir = true;
+    req.url = server.url("/?status=302&header=Location:/%3Fsize=5");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.body == "xxxxx");
+    REQUIRE(res.header_hops == 2);
+    std::string value;
+    REQUIRE(!mk::curl::find_header(res, "Location", value));
+    REQUIRE(mk::curl::find_header(res, "Content-Length", value));
+    REQUIRE(value == "5");
+    REQUIRE(res.header_entries.front().hop == 0);
+  }
+
+  SECTION("when rewinding the body source to follow a 307 redirect") {
+    std::string body(100000, 'w');
+    size_t off = 0;
+    int rewinds = 0;
+    req.method = "POST";
+    req.follow_redir = true;
+    req.body_source_size = (int64_t)body.size();
+    req.body_source = [&](char *buffer, size_t size) {
+      size_t count = (std::min)(size, body.size() - off);
+      memcpy(buffer, body.data() + off, count);
+      off += count;
+      return count;
+    };
+    req.url = server.url("/?status=307&header=Location:/%3Fecho=1");
+    SECTION("and the body source can be rewound") {
+      req.body_source_rewind = [&](int64_t offset) {
+        rewinds += 1;
+        off = (size_t)offset;
+        return true;
+      };
+      auto res = mk::curl::perform(req);
+      REQUIRE(res.error == CURLE_OK);
+      REQUIRE(res.status_code == 200);
+      REQUIRE(res.body == body);
+      REQUIRE(rewinds > 0);
+    }
+    SECTION("and the body source cannot be rewound") {
+      auto res = mk::curl::perform(req);
+      REQUIRE(res.error == CURLE_SEND_FAIL_REWIND);
+    }
+  }
+
+  SECTION("when the delay exceeds the timeout") {
+    req.timeout = 1;
+    req.url = server.url("/?delay_ms=5000");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OPERATION_TIMEDOUT);
+  }
+
+  SECTION("when the delay exceeds the timeout in milliseconds") {
+    req.timeout = 10;
+    req.timeout_ms = 100;
+    req.url = server.url("/?delay_ms=5000");
+    auto start = std::chrono::steady_clock::now();
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OPERATION_TIMEDOUT);
+    REQUIRE(std::chrono::steady_clock::now() - start <
+            std::chrono::seconds(2));
+    REQUIRE(res.timings.connect > 0);
+    REQUIRE(res.timings.starttransfer == 0);
+    REQUIRE(res.timings.total >= 100000);
+  }
+
+  SECTION("when the transfer is too slow") {
+    req.low_speed_limit = 1 << 20;
+    req.low_speed_time = 1;
+    req.url = server.url(
+        "/?size=100000&chunked=1&chunk_size=100&chunk_delay_ms=100");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OPERATION_TIMEDOUT);
+  }
+
+  SECTION("when cancelling the transfer") {
+    req.retries = 2;
+    req.cancellation = std::make_shared<mk::curl::Cancellation>();
+    req.url = server.url("/?delay_ms=5000");
+    std::thread canceller{[&req]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      req.cancellation->cancel();
+    }};
+    auto start = std::chrono::steady_clock::now();
+    auto res = mk::curl::perform(req);
+    canceller.join();
+    REQUIRE(res.error == CURLE_ABORTED_BY_CALLBACK);
+    REQUIRE(res.attempts.size() == 1);
+    REQUIRE(std::chrono::steady_clock::now() - start <
+            std::chrono::seconds(3));
+    mk::curl::MultiClient client;
+    auto responses = client.perform({req});
+    REQUIRE(responses[0].error == CURLE_ABORTED_BY_CALLBACK);
+  }
+
+  SECTION("when closing the connection") {
+    req.url = server.url("/?fail=close");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_GOT_NOTHING);
+  }
+
+  SECTION("when resetting the connection") {
+    req.url = server.url("/?fail=reset");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error != CURLE_OK);
+  }
+
+  SECTION("when truncating the body") {
+    req.url = server.url("/?size=100000&fail=truncate");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_PARTIAL_FILE);
+  }
+
+  SECTION("when sending garbage") {
+    req.url = server.url("/?fail=garbage");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error != CURLE_OK);
+  }
+
+  SECTION("when failing just the first request") {
+    req.retries = 2;
+    req.retry_policy.initial_backoff_ms = 1;
+    req.url = server.url("/?size=10&fail=close&fail_first=1");
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.attempts.size() == 2);
+    REQUIRE(server.requests() == 2);
+  }
+
+  SECTION("when reusing the connection") {
+    mk::curl::Client client;
+    for (size_t i = 0; i < 3; ++i) {
+      req.url = server.url("/?size=" + std::to_string(i));
+      auto res = client.perform(req);
+      REQUIRE(res.error == CURLE_OK);
+      REQUIRE(res.body.size() == i);
+      REQUIRE(res.num_connects == (i == 0 ? 1 : 0));
+      REQUIRE(res.connection_reused == (i != 0));
+      REQUIRE(res.primary_ip == "127.0.0.1");
+      REQUIRE(res.primary_port == server.port());
+      REQUIRE(res.local_ip == "127.0.0.1");
+      REQUIRE(res.local_port > 0);
+    }
+    REQUIRE(server.connections() == 1);
+    REQUIRE(server.requests() == 3);
+    auto stats = client.stats();
+    REQUIRE(stats.requests == 3);
+    REQUIRE(stats.failures == 0);
+    REQUIRE(stats.connects == 1);
+    REQUIRE(stats.reused == 2);
+  }
+
+  SECTION("when following redirects with connect_addresses") {
+    mk::curl::loopback::Server other;
+    REQUIRE(other.start());
+    std::stringstream url;
+    url << "http://mkcurl.example:" << server.port()
+        << "/?status=302&header=Location:" << other.url("/%3Fsize=5");
+    req.follow_redir = true;
+    req.connect_addresses = {"127.0.0.1"};
+    req.url = url.str();
+    auto res = mk::curl::perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.status_code == 200);
+    REQUIRE(res.body == "xxxxx");
+    REQUIRE(server.requests() == 1);
+    REQUIRE(other.requests() == 1);
+  }
+
+  SECTION("when using a fresh cached response") {
+    mk::curl::Client client;
+    req.response_cache = std::make_shared<mk::curl::ResponseCache>();
+    req.url = server.url("/?size=10&header=Cache-Control:max-age%3D60");
+    REQUIRE(!client.perform(req).from_cache);
+    auto res = client.perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.from_cache);
+    REQUIRE(res.body == std::string(10, 'x'));
+    REQUIRE(server.requests() == 1);
+  }
+
+  SECTION("when caching without reserving the body") {
+    mk::curl::Client client;
+    req.body_reserve_max = 0;
+    req.response_cache = std::make_shared<mk::curl::ResponseCache>();
+    req.url = server.url("/?size=10&header=Cache-Control:max-age%3D60");
+    REQUIRE(!client.perform(req).from_cache);
+    auto res = client.perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.from_cache);
+    REQUIRE(server.requests() == 1);
+  }
+
+  SECTION("when revalidating a cached response") {
+    mk::curl::Client client;
+    req.response_cache = std::make_shared<mk::curl::ResponseCache>();
+    req.url = server.url("/?size=10&etag=v1");
+    REQUIRE(!client.perform(req).from_cache);
+    auto res = client.perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.status_code == 200);
+    REQUIRE(res.from_cache);
+    REQUIRE(res.revalidated);
+    REQUIRE(res.body == std::string(10, 'x'));
+    std::string value;
+    REQUIRE(mk::curl::find_header(res, "etag", value));
+    REQUIRE(value == "\"v1\"");
+    REQUIRE(server.requests() == 2);
+  }
+
+  SECTION("when coalescing identical requests") {
+    mk::curl::Coalescer coalescer;
+    mk::curl::ClientPool pool{4};
+    req.url = server.url("/?size=1000&delay_ms=200");
+    std::vector<std::shared_ptr<const mk::curl::Response>> responses(4);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < responses.size(); ++i) {
+      threads.emplace_back([&, i]() {
+        responses[i] = coalescer.perform(pool, req);
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    for (auto &res : responses) {
+      REQUIRE(res->error == CURLE_OK);
+      REQUIRE(res->body.size() == 1000);
+    }
+    REQUIRE(server.requests() + coalescer.coalesced() == 4);
+    REQUIRE(server.requests() < 4);
+    mk::curl::MultiClient client;
+    std::vector<mk::curl::Request> reqs(10, req);
+    reqs.back().url = server.url("/?size=10");
+    auto batch = coalescer.perform(client, reqs);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      REQUIRE(batch[i]->error == CURLE_OK);
+      REQUIRE(batch[i]->body.size() == (i < 9 ? 1000 : 10));
+      REQUIRE((batch[i] == batch[0]) == (i < 9));
+    }
+    REQUIRE(server.requests() + coalescer.coalesced() == 14);
+  }
+
+  SECTION("when recycling the response") {
+    mk::curl::Client client;
+    mk::curl::Response res;
+    req.url = server.url("/?size=65536");
+    client.perform(req, res);
+    REQUIRE(res.error == CURLE_OK);
+    const char *data = res.body.data();
+    req.url = server.url("/?size=1024");
+    client.perform(req, res);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.body == std::string(1024, 'x'));
+    REQUIRE(res.body.data() == data);
+  }
+
+  SECTION("when using a connection policy") {
+    mk::curl::ConnectionPolicy policy;
+    policy.max_connections = 1;
+    policy.idle_timeout = 60;
+    policy.keepalive_interval = 10;
+    mk::curl::Client client{nullptr, policy};
+    REQUIRE(client.prewarm(req, {server.url("/")}) == 1);
+    req.url = server.url("/?size=10");
+    auto res = client.perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.connection_reused);
+    client.close_connections();
+    res = client.perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(!res.connection_reused);
+    REQUIRE(server.connections() == 2);
+  }
+
+  SECTION("when prewarming with the settings of the request") {
+    mk::curl::Client client;
+    std::stringstream url;
+    url << "http://mkcurl.example:" << server.port() << "/";
+    req.connect_addresses = {"127.0.0.1"};
+    REQUIRE(client.prewarm(req, {url.str()}) == 1);
+    url << "?size=10";
+    req.url = url.str();
+    auto res = client.perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    REQUIRE(res.connection_reused);
+    REQUIRE(server.connections() == 1);
+  }
+
+  SECTION("when alternating the clients of a ClientPool") {
+    mk::curl::ClientPool pool{2};
+    mk::curl::ClientPool::Lease a = pool.checkout();
+    mk::curl::ClientPool::Lease b = pool.checkout();
+    req.headers = {"X-Alternating: 1"};
+    req.url = server.url("/?size=5");
+    mk::curl::PreparedRequest prepared{req};
+    for (auto client : {&a.client(), &b.client(), &a.client()}) {
+      auto res = client->perform(prepared);
+      REQUIRE(res.error == CURLE_OK);
+      REQUIRE(res.body == "xxxxx");
+    }
+    prepared.set_url(server.url("/?size=10"));
+    for (auto client : {&b.client(), &a.client()}) {
+      auto res = client->perform(prepared);
+      REQUIRE(res.error == CURLE_OK);
+      REQUIRE(res.body.size() == 10);
+    }
+  }
+
+  SECTION("when using a MultiClient") {
+    mk::curl::MultiSettings settings;
+    settings.concurrency = 8;
+    mk::curl::MultiClient client{std::move(settings)};
+    req.url = server.url("/?size=1000&delay_ms=10");
+    std::vector<mk::curl::Request> reqs(100, req);
+    for (auto &res : client.perform(reqs)) {
+      REQUIRE(res.error == CURLE_OK);
+      REQUIRE(res.body.size() == 1000);
+    }
+    REQUIRE(server.connections() <= 8);
+    REQUIRE(server.requests() == 100);
+  }
+}
@@ -0,0 +1,601 @@
+// Part of Measurement Kit <https://measurement-kit.github.io/>.
+// Measurement Kit is free software under the BSD license. See AUTHORS
+// and LICENSE for more information on the copying conditions.
+#ifndef MEASUREMENT_KIT_MKCURL_LOOPBACK_SERVER_HPP
+#define MEASUREMENT_KIT_MKCURL_LOOPBACK_SERVER_HPP
+
+// This header contains an in-process HTTP/1.1 server listening on the
+// loopback interface, which tests and benchmarks use to measure mkcurl
+// without depending on the network. It is not part of the library.
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace mk {
+namespace curl {
+namespace loopback {
+
+/// Settings contains the settings of a Server.
+struct Settings {
+  /// thread_init is an optional function called at the beginning of each
+  /// thread created by the server, e.g., to exclude the server threads
+  /// from the allocations counted by a benchmark.
+  std::function<void()> thread_init;
+};
+
+/// Server is an HTTP/1.1 server listening on a random port of the loopback
+/// interface. It supports keep-alive, `Expect: 100-continue` as well as
+/// request bodies with a Content-Length or using chunked encoding. Each
+/// connection is served by its own thread. The query string of the request
+/// controls the response, using the following parameters:
+///
+/// - `size=<n>`: send a body of <n> bytes (default: zero);
+/// - `echo=1`: send the request body back as the response body;
+/// - `status=<n>`: use <n> as the status code (default: 200);
+/// - `header=<name>:<value>`: add a response header (repeatable);
+/// - `etag=<tag>`: send the `"<tag>"` ETag and reply with 304 to requests
+///   whose If-None-Match contains it;
+/// - `delay_ms=<n>`: wait <n> milliseconds before responding;
+/// - `chunked=1`: send the body using chunked encoding;
+/// - `chunk_size=<n>`: send chunks of <n> bytes (default: 1024);
+/// - `chunk_delay_ms=<n>`: wait <n> milliseconds between chunks;
+/// - `fail=<how>`: fail rather than responding, where <how> is `close` to
+///   close the connection, `reset` to reset it, `truncate` to close it
+///   after sending half of the body, or `garbage` to send an invalid
+///   response and close the connection;
+/// - `fail_first=<n>`: only fail the first <n> requests for the same
+///   path and query, which is useful to test retries.
+///
+/// Values may be percent-encoded, e.g., to include `?` and `&` in a header.
+///
+/// On Windows, Winsock must be initialized before starting a server, which
+/// happens when cURL is initialized with CURL_GLOBAL_ALL.
+class Server {
+ public:
+  /// Server creates a server with default settings.
+  Server() noexcept : Server{Settings{}} {}
+
+  /// Server creates a server using @p settings.
+  explicit Server(Settings settings) noexcept
+      : settings_{std::move(settings)} {}
+
+  /// Server is the deleted copy constructor.
+  Server(const Server &) = delete;
+
+  /// Server is the deleted copy assignment.
+  Server &operator=(const Server &) = delete;
+
+  /// Server is the deleted move constructor.
+  Server(Server &&) = delete;
+
+  /// Server is the deleted move assignment.
+  Server &operator=(Server &&) = delete;
+
+  /// ~Server stops the server.
+  ~Server() noexcept { stop(); }
+
+  /// start starts the server. @return whether it succeeded.
+  bool start() noexcept;
+
+  /// stop stops the server, interrupting delays and closing connections,
+  /// and waits for all its threads to terminate.
+  void stop() noexcept;
+
+  /// port returns the port where the server is listening.
+  uint16_t port() const noexcept { return port_; }
+
+  /// url returns the URL of the resource at @p path, which should begin
+  /// with a slash and may contain a query string.
+  std::string url(const std::string &path) const {
+    std::stringstream ss;
+    ss << "http://127.0.0.1:" << port_ << path;
+    return ss.str();
+  }
+
+  /// connections returns the number of accepted connections.
+  uint64_t connections() const noexcept { return connections_; }
+
+  /// requests returns the number of received requests.
+  uint64_t requests() const noexcept { return requests_; }
+
+ private:
+#ifdef _WIN32
+  using socket_t = SOCKET;
+  static constexpr socket_t invalid_socket = INVALID_SOCKET;
+  static void closesocket_(socket_t fd) noexcept { (void)closesocket(fd); }
+#else
+  using socket_t = int;
+  static constexpr socket_t invalid_socket = -1;
+  static void closesocket_(socket_t fd) noexcept { (void)close(fd); }
+#endif
+
+  // request is a parsed request.
+  struct request {
+    std::string target;
+    std::string path;
+    std::multimap<std::string, std::string> query;
+    std::string headers;
+    std::string body;
+    bool keepalive = true;
+  };
+
+  void accept_loop() noexcept;
+  void serve(socket_t conn) noexcept;
+  bool read_more(socket_t conn, std::string &buffer) noexcept;
+  bool read_request(socket_t conn, std::string &buffer, request &req) noexcept;
+  bool respond(socket_t conn, const request &req) noexcept;
+  bool sendall(socket_t conn, const char *data, size_t size) noexcept;
+  bool sleep_ms(int64_t ms) noexcept;
+
+  static bool find_header(const std::string &headers, const char *name,
+                          std::string &value) noexcept;
+  static int64_t query_int(const request &req, const char *name,
+                           int64_t defval) noexcept;
+  static std::string unescape(const std::string &s);
+  static std::string lower_(std::string s);
+
+  Settings settings_;
+  socket_t fd_ = invalid_socket;
+  uint16_t port_ = 0;
+  std::atomic<bool> stopped_{false};
+  std::atomic<uint64_t> connections_{0};
+  std::atomic<uint64_t> requests_{0};
+  std::thread acceptor_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<socket_t> conns_;
+  std::vector<std::thread> workers_;
+  // finished_ contains the IDs of the workers that are exiting, which the
+  // accept loop joins, so that threads do not pile up with many connections.
+  std::vector<std::thread::id> finished_;
+  std::map<std::string, int64_t> failures_;
+};
+
+inline bool Server::start() noexcept {
+  fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd_ == invalid_socket) {
+    return false;
+  }
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  if (bind(fd_, reinterpret_cast<sockaddr *>(&sin), len) != 0 ||
+      listen(fd_, 1024) != 0 ||
+      getsockname(fd_, reinterpret_cast<sockaddr *>(&sin), &len) != 0) {
+    closesocket_(fd_);
+    fd_ = invalid_socket;
+    return false;
+  }
+  port_ = ntohs(sin.sin_port);
+  acceptor_ = std::thread{[this]() { accept_loop(); }};
+  return true;
+}
+
+inline void Server::stop() noexcept {
+  if (fd_ == invalid_socket) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    stopped_ = true;
+  }
+  cond_.notify_all();
+  // Shutting down the listening socket unblocks accept() on Linux, while
+  // on other systems we connect to ourselves to achieve the same effect.
+  (void)shutdown(fd_, 2);
+  {
+    socket_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != invalid_socket) {
+      sockaddr_in sin{};
+      sin.sin_family = AF_INET;
+      sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      sin.sin_port = htons(port_);
+      (void)connect(fd, reinterpret_cast<sockaddr *>(&sin), sizeof(sin));
+      closesocket_(fd);
+    }
+  }
+  acceptor_.join();
+  closesocket_(fd_);
+  fd_ = invalid_socket;
+  std::vector<std::thread> workers;
+  {
+    std::unique_lock<std::mutex> _{mutex_};
+    for (auto fd : conns_) {
+      (void)shutdown(fd, 2);
+    }
+    std::swap(workers, workers_);
+    finished_.clear();
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+inline void Server::accept_loop() noexcept {
+  if (settings_.thread_init) {
+    settings_.thread_init();
+  }
+  for (;;) {
+    socket_t conn = accept(fd_, nullptr, nullptr);
+    if (stopped_) {
+      if (conn != invalid_socket) {
+        closesocket_(conn);
+      }
+      return;
+    }
+    if (conn == invalid_socket) {
+      continue;
+    }
+    connections_ += 1;
+    int on = 1;
+    (void)setsockopt(conn, IPPROTO_TCP, TCP_NODELAY,
+                     reinterpret_cast<const char *>(&on), sizeof(on));
+    std::vector<std::thread> finished;
+    {
+      std::unique_lock<std::mutex> _{mutex_};
+      conns_.push_back(conn);
+      workers_.emplace_back([this, conn]() { serve(conn); });
+      for (auto id : finished_) {
+        auto it = std::find_if(
+            workers_.begin(), workers_.end(),
+            [id](const std::thread &t) { return t.get_id() == id; });
+        if (it != workers_.end()) {
+          finished.push_back(std::move(*it));
+          *it = std::move(workers_.back());
+          workers_.pop_back();
+        }
+      }
+      finished_.clear();
+    }
+    // Joining does not block for long, since these threads are exiting.
+    for (auto &t : finished) {
+      t.join();
+    }
+  }
+}
+
+inline void Server::serve(socket_t conn) noexcept {
+  if (settings_.thread_init) {
+    settings_.thread_init();
+  }
+  std::string buffer;
+  for (;;) {
+    request req;
+    if (!read_request(conn, buffer, req)) {
+      break;
+    }
+    requests_ += 1;
+    if (!respond(conn, req) || !req.keepalive) {
+      break;
+    }
+  }
+  std::unique_lock<std::mutex> _{mutex_};
+  conns_.erase(std::remove(conns_.begin(), conns_.end(), conn), conns_.end());
+  closesocket_(conn);
+  finished_.push_back(std::this_thread::get_id());
+}
+
+inline bool Server::read_more(socket_t conn, std::string &buffer) noexcept {
+  char chunk[65536];
+  auto n = recv(conn, chunk, sizeof(chunk), 0);
+  if (n <= 0) {
+    return false;
+  }
+  buffer.append(chunk, static_cast<size_t>(n));
+  return true;
+}
+
+inline bool Server::read_request(
+    socket_t conn, std::string &buffer, request &req) noexcept {
+  size_t pos = 0;
+  while ((pos = buffer.find("\r\n\r\n")) == std::string::npos) {
+    if (!read_more(conn, buffer)) {
+      return false;
+    }
+  }
+  req.headers = buffer.substr(0, pos + 2);
+  buffer.erase(0, pos + 4);
+  {
+    auto sp1 = req.headers.find(' ');
+    auto sp2 = req.headers.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) {
+      return false;
+    }
+    req.target = req.headers.substr(sp1 + 1, sp2 - sp1 - 1);
+    auto qmark = req.target.find('?');
+    req.path = req.target.substr(0, qmark);
+    if (qmark != std::string::npos) {
+      std::stringstream ss{req.target.substr(qmark + 1)};
+      std::string param;
+      while (std::getline(ss, param, '&')) {
+        auto eq = param.find('=');
+        req.query.insert({param.substr(0, eq),
+                          (eq != std::string::npos)
+                              ? unescape(param.substr(eq + 1))
+                              : std::string{}});
+      }
+    }
+  }
+  std::string value;
+  if (find_header(req.headers, "connection", value) && value == "close") {
+    req.keepalive = false;
+  }
+  if (find_header(req.headers, "expect", value) && value == "100-continue") {
+    static const char continue_[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (!sendall(conn, continue_, sizeof(continue_) - 1)) {
+      return false;
+    }
+  }
+  if (find_header(req.headers, "transfer-encoding", value) &&
+      value == "chunked") {
+    for (;;) {
+      while ((pos = buffer.find("\r\n")) == std::string::npos) {
+        if (!read_more(conn, buffer)) {
+          return false;
+        }
+      }
+      auto size = static_cast<size_t>(strtoull(buffer.c_str(), nullptr, 16));
+      size_t end = pos + 2 + size + 2;
+      while (buffer.size() < end) {
+        if (!read_more(conn, buffer)) {
+          return false;
+        }
+      }
+      req.body.append(buffer, pos + 2, size);
+      buffer.erase(0, end);
+      if (size == 0) {
+        return true;  // We don't support trailers
+      }
+    }
+  }
+  size_t length = 0;
+  if (find_header(req.headers, "content-length", value)) {
+    length = static_cast<size_t>(strtoull(value.c_str(), nullptr, 10));
+  }
+  while (buffer.size() < length) {
+    if (!read_more(conn, buffer)) {
+      return false;
+    }
+  }
+  req.body = buffer.substr(0, length);
+  buffer.erase(0, length);
+  return true;
+}
+
+inline bool Server::respond(socket_t conn, const request &req) noexcept {
+  std::string fail;
+  {
+    auto it = req.query.find("fail");
+    if (it != req.query.end()) {
+      int64_t first = query_int(req, "fail_first", -1);
+      std::unique_lock<std::mutex> _{mutex_};
+      if (first < 0 || failures_[req.target]++ < first) {
+        fail = it->second;
+      }
+    }
+  }
+  if (!sleep_ms(query_int(req, "delay_ms", 0))) {
+    return false;
+  }
+  if (fail == "close") {
+    return false;
+  }
+  if (fail == "reset") {
+    linger l{};
+    l.l_onoff = 1;
+    l.l_linger = 0;
+    (void)setsockopt(conn, SOL_SOCKET, SO_LINGER,
+                     reinterpret_cast<const char *>(&l), sizeof(l));
+    return false;
+  }
+  if (fail == "garbage") {
+    static const char garbage[] = "This is not HTTP\r\n\r\n";
+    (void)sendall(conn, garbage, sizeof(garbage) - 1);
+    return false;
+  }
+  std::string etag;
+  {
+    auto it = req.query.find("etag");
+    if (it != req.query.end()) {
+      etag = "\"" + it->second + "\"";
+      // Note: find_header returns lowercase values.
+      std::string value;
+      if (find_header(req.headers, "if-none-match", value) &&
+          value.find(lower_(etag)) != std::string::npos) {
+        std::string reply = "HTTP/1.1 304 Not Modified\r\nETag: " + etag +
+                            "\r\n\r\n";
+        return sendall(conn, reply.data(), reply.size());
+      }
+    }
+  }
+  std::string body;
+  if (query_int(req, "echo", 0) != 0) {
+    body = req.body;
+  } else {
+    body.assign(static_cast<size_t>(query_int(req, "size", 0)), 'x');
+  }
+  bool chunked = query_int(req, "chunked", 0) != 0;
+  std::stringstream ss;
+  ss << "HTTP/1.1 " << query_int(req, "status", 200) << " Loopback\r\n"
+     << "Content-Type: application/octet-stream\r\n";
+  if (!etag.empty()) {
+    ss << "ETag: " << etag << "\r\n";
+  }
+  auto range = req.query.equal_range("header");
+  for (auto it = range.first; it != range.second; ++it) {
+    ss << it->second << "\r\n";
+  }
+  if (chunked) {
+    ss << "Transfer-Encoding: chunked\r\n";
+  } else {
+    ss << "Content-Length: " << body.size() << "\r\n";
+  }
+  if (!req.keepalive) {
+    ss << "Connection: close\r\n";
+  }
+  ss << "\r\n";
+  std::string headers = ss.str();
+  if (!chunked) {
+    if (fail == "truncate") {
+      (void)sendall(conn, headers.data(), headers.size());
+      (void)sendall(conn, body.data(), body.size() / 2);
+      return false;
+    }
+    headers.append(body);
+    return sendall(conn, headers.data(), headers.size());
+  }
+  if (!sendall(conn, headers.data(), headers.size())) {
+    return false;
+  }
+  auto chunk_size = static_cast<size_t>(
+      std::max<int64_t>(1, query_int(req, "chunk_size", 1024)));
+  int64_t chunk_delay = query_int(req, "chunk_delay_ms", 0);
+  for (size_t off = 0; off < body.size(); off += chunk_size) {
+    if (off > 0 && !sleep_ms(chunk_delay)) {
+      return false;
+    }
+    size_t count = std::min(chunk_size, body.size() - off);
+    if (fail == "truncate" && off >= body.size() / 2) {
+      return false;
+    }
+    std::stringstream chunk;
+    chunk << std::hex << count << "\r\n";
+    std::string data = chunk.str();
+    data.append(body, off, count);
+    data.append("\r\n");
+    if (!sendall(conn, data.data(), data.size())) {
+      return false;
+    }
+  }
+  if (fail == "truncate") {
+    return false;
+  }
+  static const char last[] = "0\r\n\r\n";
+  return sendall(conn, last, sizeof(last) - 1);
+}
+
+inline bool Server::sendall(
+    socket_t conn, const char *data, size_t size) noexcept {
+  while (size > 0) {
+#ifdef _WIN32
+    auto n = send(
+        conn, data, static_cast<int>(std::min<size_t>(size, INT_MAX)), 0);
+#elif defined(MSG_NOSIGNAL)
+    auto n = send(conn, data, size, MSG_NOSIGNAL);
+#else
+    auto n = send(conn, data, size, 0);
+#endif
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+inline bool Server::sleep_ms(int64_t ms) noexcept {
+  if (ms <= 0) {
+    return !stopped_;
+  }
+  std::unique_lock<std::mutex> lock{mutex_};
+  return !cond_.wait_for(lock, std::chrono::milliseconds(ms),
+                         [this]() -> bool { return stopped_; });
+}
+
+inline bool Server::find_header(const std::string &headers, const char *name,
+                                std::string &value) noexcept {
+  size_t namesiz = strlen(name);
+  for (size_t pos = headers.find("\r\n"); pos != std::string::npos;
+       pos = headers.find("\r\n", pos + 2)) {
+    size_t begin = pos + 2;
+    size_t end = headers.find("\r\n", begin);
+    if (end == std::string::npos) {
+      break;
+    }
+    if (end - begin > namesiz && headers[begin + namesiz] == ':') {
+      bool match = true;
+      for (size_t i = 0; i < namesiz && match; ++i) {
+        match = tolower(static_cast<unsigned char>(headers[begin + i])) ==
+                static_cast<unsigned char>(name[i]);
+      }
+      if (match) {
+        begin += namesiz + 1;
+        while (begin < end && (headers[begin] == ' ' ||
+                               headers[begin] == '\t')) {
+          ++begin;
+        }
+        value = headers.substr(begin, end - begin);
+        for (auto &c : value) {
+          c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        }
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+inline int64_t Server::query_int(
+    const request &req, const char *name, int64_t defval) noexcept {
+  auto it = req.query.find(name);
+  if (it == req.query.end()) {
+    return defval;
+  }
+  return static_cast<int64_t>(strtoll(it->second.c_str(), nullptr, 10));
+}
+
+inline std::string Server::lower_(std::string s) {
+  for (auto &c : s) {
+    c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+  }
+  return s;
+}
+
+inline std::string Server::unescape(const std::string &s) {
+  std::string out;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() &&
+        isxdigit(static_cast<unsigned char>(s[i + 1])) &&
+        isxdigit(static_cast<unsigned char>(s[i + 2]))) {
+      out += static_cast<char>(strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+      i += 2;
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+}  // namespace loopback
+}  // namespace curl
+}  // namespace mk
+#endif  // MEASUREMENT_KIT_MKCURL_LOOPBACK_SERVER_HPP
@@ -1,9 +1,16 @@
 #include <iostream>
 
+#include <stdio.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 #include "mkcurl.hpp"
 
@@ -21,23 +28,62 @@ static void usage() {
   // clang-format off
   std::clog << "\n";
   std::clog << "Usage: mkcurl-client [options] <url>...\n";
+  std::clog << "       mkcurl-client [options] --input-file <path>\n";
   std::clog << "\n";
   std::clog << "Options can start with either a single dash (i.e. -option) or\n";
   std::clog << "a double dash (i.e. --option). Available options:\n";
   std::clog << "\n";
+  std::clog << "  --accept-encoding <list>: comma separated encodings to\n";
+  std::clog << "                            advertise with --compressed\n";
   std::clog << "  --ca-bundle-path <path> : path to OpenSSL CA bundle\n";
+  std::clog << "  --connect-address <ip>  : connects to <ip> rather than\n";
+  std::clog << "                            resolving the host in the URL;\n";
+  std::clog << "                            repeat to race connections to\n";
+  std::clog << "                            several addresses. IPv6 addresses\n";
+  std::clog << "                            may be quoted using [ and ]\n";
+  std::clog << "  --connect-timeout-ms <ms> : stop trying to connect after\n";
+  std::clog << "                            <ms> milliseconds\n";
   std::clog << "  --connect-to <ip>       : connects to <ip> while using the\n";
   std::clog << "                            host in the URL for TLS SNI, if\n";
   std::clog << "                            using https. Note that IPv6 must\n";
   std::clog << "                            be quoted using [ and ]\n";
+  std::clog << "  --compact-logs          : store logs into a single buffer\n";
+  std::clog << "  --compressed            : ask for a compressed response\n";
   std::clog << "  --data <data>           : send <data> as body\n";
+  std::clog << "  --data-file <path>      : stream the content of <path>\n";
+  std::clog << "                            as body\n";
+  std::clog << "  --doh-url <url>         : resolve names using the DoH\n";
+  std::clog << "                            server at <url>\n";
+  std::clog << "  --enable-certinfo       : collect the certificate chain\n";
   std::clog << "  --enable-http2          : enable HTTP2 support\n";
   std::clog << "  --enable-tcp-fastopen   : enable TCP fastopen support\n";
   std::clog << "  --follow-redirect       : enable following redirects\n";
+  std::clog << "  --happy-eyeballs-timeout <ms> : delay before trying the\n";
+  std::clog << "                            other address family\n";
   std::clog << "  --header <header>       : add <header> to headers\n";
+  std::clog << "  --input-file <path>     : read URLs from <path>, one per\n";
+  std::clog << "                            line, or from stdin if <path>\n";
+  std::clog << "                            is -. Empty lines and lines\n";
+  std::clog << "                            starting with # are skipped\n";
+  std::clog << "  --log-level <level>     : one of none, summary, full\n";
+  std::clog << "  --low-speed-limit <B/s> : abort if slower than <B/s> for the\n";
+  std::clog << "                            --low-speed-time <sec> seconds\n";
+  std::clog << "  --max-recv-speed <B/s>  : limit the download speed\n";
+  std::clog << "  --max-send-speed <B/s>  : limit the upload speed\n";
+  std::clog << "  --no-body               : discard the response bodies\n";
+  std::clog << "  --output <format>       : one of summary (the default),\n";
+  std::clog << "                            jsonl, csv. With jsonl and csv\n";
+  std::clog << "                            we print a line per request on\n";
+  std::clog << "                            stdout and the log level defaults\n";
+  std::clog << "                            to none\n";
+  std::clog << "  --parallel <n>          : perform <n> requests in parallel\n";
   std::clog << "  --post                  : use POST rather than GET\n";
   std::clog << "  --put                   : use PUT rather than GET\n";
+  std::clog << "  --repeat <n>            : perform each request <n> times\n";
+  std::clog << "  --sample-interval <us>  : take throughput samples every\n";
+  std::clog << "                            <us> microseconds\n";
   std::clog << "  --timeout <sec>         : set timeout of <sec> seconds\n";
+  std::clog << "  --timeout-ms <ms>       : set timeout of <ms> milliseconds\n";
   std::clog << std::endl;
   // clang-format on
 }
@@ -49,10 +95,39 @@ static void summary(mk::curl::Response &res) {
             << "HTTP status code: " << res.status_code << std::endl
             << "Bytes sent: " << res.bytes_sent << std::endl
             << "Bytes recv: " << res.bytes_recv << std::endl
+            << "Body bytes recv: " << res.body_bytes_recv << std::endl
+            << "Body bytes decoded: " << res.body_bytes_decoded << std::endl
             << "Redirect URL: " << res.redirect_url << std::endl
             << "Content Type: " << res.content_type << std::endl
             << "HTTP version: " << res.http_version << std::endl
+            << "New connections: " << res.num_connects << std::endl
+            << "Connection reused: " << res.connection_reused << std::endl
+            << "TLS session resumed: " << res.tls_session_resumed
+            << std::endl << "Local endpoint: " << res.local_ip << " "
+            << res.local_port << std::endl
+            << "Primary endpoint: " << res.primary_ip << " "
+            << res.primary_port << std::endl
             << "=== END SUMMARY ===" << std::endl << std::endl;
+  std::clog << "=== BEGIN TIMINGS ===" << std::endl
+            << "Name lookup: " << res.timings.namelookup << " us" << std::endl
+            << "Connect: " << res.timings.connect << " us" << std::endl
+            << "App connect: " << res.timings.appconnect << " us" << std::endl
+            << "Pretransfer: " << res.timings.pretransfer << " us" << std::endl
+            << "Start transfer: " << res.timings.starttransfer << " us"
+            << std::endl
+            << "Total: " << res.timings.total << " us" << std::endl
+            << "Redirect: " << res.timings.redirect << " us" << std::endl
+            << "Download speed: " << res.timings.download_speed << " B/s"
+            << std::endl
+            << "Upload speed: " << res.timings.upload_speed << " B/s"
+            << std::endl
+            << "=== END TIMINGS ===" << std::endl << std::endl;
+  std::clog << "=== BEGIN SAMPLES ===" << std::endl;
+  for (auto &sample : res.samples) {
+    std::clog << "[" << sample.elapsed_us << "] recv: " << sample.bytes_recv
+              << " sent: " << sample.bytes_sent << std::endl;
+  }
+  std::clog << "=== END SAMPLES ===" << std::endl << std::endl;
   std::clog << "=== BEGIN REQUEST HEADERS ==="
             << std::endl << res.request_headers
             << "=== END REQUEST HEADERS ==="
@@ -69,28 +144,203 @@ static void summary(mk::curl::Response &res) {
   for (auto &log : res.logs) {
     std::clog << "[" << log.msec << "] " << log.line << std::endl;
   }
+  for (auto &entry : res.log_entries) {
+    std::clog << "[" << entry.msec << "] ";
+    std::clog.write(res.log_arena.data() + entry.offset,
+                    (std::streamsize)entry.size);
+    std::clog << std::endl;
+  }
   std::clog << "=== END LOGS ===" << std::endl << std::endl;
   std::clog << "=== BEGIN BODY ===" << std::endl << res.body
             << "=== END BODY ===" << std::endl << std::endl;
 }
 
+// json_escape returns @p s escaped to be used as a JSON string.
+static std::string json_escape(const std::string &s) {
+  std::stringstream ss;
+  for (auto c : s) {
+    if (c == '"' || c == '\\') {
+      ss << '\\' << c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", (unsigned)c);
+      ss << buf;
+    } else {
+      ss << c;
+    }
+  }
+  return ss.str();
+}
+
+// csv_escape returns @p s quoted to be used as a CSV field, if needed.
+static std::string csv_escape(const std::string &s) {
+  if (s.find_first_of(",\"\r\n") == std::string::npos) {
+    return s;
+  }
+  std::string out = "\"";
+  for (auto c : s) {
+    out += c;
+    if (c == '"') out += c;
+  }
+  return out + "\"";
+}
+
+// Output is the output format.
+enum class Output { summary, jsonl, csv };
+
+// csv_header is the header of the CSV output.
+static const char *csv_header =
+    "url,error,status_code,bytes_sent,bytes_recv,body_bytes_recv,"
+    "body_bytes_decoded,num_connects,connection_reused,attempts,"
+    "namelookup_us,connect_us,appconnect_us,pretransfer_us,"
+    "starttransfer_us,total_us";
+
+// record writes a line describing @p res, the response to @p url, unless
+// @p output is Output::summary, in which case it calls summary().
+static void record(Output output, const std::string &url,
+                   mk::curl::Response &res) {
+  std::stringstream ss;
+  switch (output) {
+    case Output::summary:
+      summary(res);
+      return;
+    case Output::jsonl:
+      ss << "{\"url\":\"" << json_escape(url) << "\",\"error\":" << res.error
+         << ",\"status_code\":" << res.status_code
+         << ",\"bytes_sent\":" << res.bytes_sent
+         << ",\"bytes_recv\":" << res.bytes_recv
+         << ",\"body_bytes_recv\":" << res.body_bytes_recv
+         << ",\"body_bytes_decoded\":" << res.body_bytes_decoded
+         << ",\"num_connects\":" << res.num_connects
+         << ",\"connection_reused\":"
+         << (res.connection_reused ? "true" : "false")
+         << ",\"attempts\":" << res.attempts.size()
+         << ",\"namelookup_us\":" << res.timings.namelookup
+         << ",\"connect_us\":" << res.timings.connect
+         << ",\"appconnect_us\":" << res.timings.appconnect
+         << ",\"pretransfer_us\":" << res.timings.pretransfer
+         << ",\"starttransfer_us\":" << res.timings.starttransfer
+         << ",\"total_us\":" << res.timings.total << "}\n";
+      break;
+    case Output::csv:
+      ss << csv_escape(url) << "," << res.error << "," << res.status_code
+         << "," << res.bytes_sent << "," << res.bytes_recv << ","
+         << res.body_bytes_recv << "," << res.body_bytes_decoded << ","
+         << res.num_connects << "," << res.connection_reused << ","
+         << res.attempts.size() << "," << res.timings.namelookup << ","
+         << res.timings.connect << "," << res.timings.appconnect << ","
+         << res.timings.pretransfer << "," << res.timings.starttransfer
+         << "," << res.timings.total << "\n";
+      break;
+  }
+  std::cout << ss.str() << std::flush;
+}
+
+// Source yields the URLs to fetch, either from the command line or from a
+// stream read lazily, each repeated as many times as requested.
+class Source {
+ public:
+  // Source constructs a source of @p urls or, if not null, of the URLs
+  // read from @p input, each repeated @p repeat times.
+  Source(std::vector<std::string> urls, std::istream *input, size_t repeat)
+      : urls_{std::move(urls)}, input_{input}, repeat_{repeat} {}
+
+  // next stores the next URL into @p url and returns whether there is one.
+  bool next(std::string &url) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (remaining_ <= 0) {
+      if (!advance()) {
+        return false;
+      }
+      remaining_ = repeat_;
+    }
+    remaining_ -= 1;
+    url = current_;
+    return true;
+  }
+
+ private:
+  // advance makes current_ the next distinct URL, if any.
+  bool advance() {
+    if (input_ == nullptr) {
+      if (index_ >= urls_.size()) {
+        return false;
+      }
+      current_ = urls_[index_++];
+      return true;
+    }
+    std::string line;
+    while (std::getline(*input_, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (!line.empty() && line[0] != '#') {
+        current_ = std::move(line);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<std::string> urls_;
+  std::istream *input_ = nullptr;
+  size_t repeat_ = 1;
+  size_t index_ = 0;
+  size_t remaining_ = 0;
+  std::string current_;
+  std::mutex mutex_;
+};
+
 int main(int, char **argv) {
   mk::curl::Request req;
   argh::parser cmdline;
+  std::unique_ptr<FILE, decltype(&fclose)> data_file{nullptr, fclose};
+  std::ifstream input_file;
+  std::istream *input = nullptr;
+  Output output = Output::summary;
+  bool log_level_set = false;
+  bool no_body = false;
+  size_t parallel = 1;
+  size_t repeat = 1;
   {
+    cmdline.add_param("accept-encoding");
     cmdline.add_param("ca-bundle-path");
+    cmdline.add_param("connect-address");
+    cmdline.add_param("connect-timeout-ms");
     cmdline.add_param("connect-to");
     cmdline.add_param("data");
+    cmdline.add_param("data-file");
+    cmdline.add_param("doh-url");
+    cmdline.add_param("happy-eyeballs-timeout");
     cmdline.add_param("header");
+    cmdline.add_param("input-file");
+    cmdline.add_param("log-level");
+    cmdline.add_param("low-speed-limit");
+    cmdline.add_param("low-speed-time");
+    cmdline.add_param("max-recv-speed");
+    cmdline.add_param("max-send-speed");
+    cmdline.add_param("output");
+    cmdline.add_param("parallel");
+    cmdline.add_param("repeat");
+    cmdline.add_param("sample-interval");
     cmdline.add_param("timeout");
+    cmdline.add_param("timeout-ms");
     cmdline.parse(argv);
     for (auto &flag : cmdline.flags()) {
-      if (flag == "enable-http2") {
+      if (flag == "compact-logs") {
+        req.compact_logs = true;
+      } else if (flag == "compressed") {
+        req.enable_compression = true;
+      } else if (flag == "enable-certinfo") {
+        req.enable_certinfo = true;
+      } else if (flag == "enable-http2") {
         req.enable_http2 = true;
       } else if (flag == "enable-tcp-fastopen") {
         req.enable_fastopen = true;
       } else if (flag == "follow-redirect") {
         req.follow_redir = true;
+      } else if (flag == "no-body") {
+        no_body = true;
       } else if (flag == "post") {
         req.method = "POST";
       } else if (flag == "put") {
@@ -104,22 +354,104 @@ int main(int, char **argv) {
       }
     }
     for (auto &param : cmdline.params()) {
-      if (param.first == "ca-bundle-path") {
+      if (param.first == "accept-encoding") {
+        req.accept_encoding = param.second;
+      } else if (param.first == "ca-bundle-path") {
         req.ca_path = param.second;
+      } else if (param.first == "connect-address") {
+        req.connect_addresses.push_back(param.second);
+      } else if (param.first == "connect-timeout-ms") {
+        req.connect_timeout_ms = atoll(param.second.c_str());
       } else if (param.first == "connect-to") {
         std::stringstream ss;
         ss << "::" << param.second << ":";
         req.connect_to = ss.str();
       } else if (param.first == "data") {
         req.body = param.second;
+      } else if (param.first == "data-file") {
+        data_file.reset(fopen(param.second.c_str(), "rb"));
+        if (!data_file) {
+          // LCOV_EXCL_START
+          std::clog << "fatal: cannot open: " << param.second << std::endl;
+          exit(EXIT_FAILURE);
+          // LCOV_EXCL_STOP
+        }
+        FILE *filep = data_file.get();
+        req.body_source = [filep](char *buffer, size_t size) {
+          size_t count = fread(buffer, 1, size, filep);
+          return (count > 0 || !ferror(filep)) ? count : size + 1;
+        };
+      } else if (param.first == "doh-url") {
+        req.doh_url = param.second;
+      } else if (param.first == "happy-eyeballs-timeout") {
+        req.happy_eyeballs_timeout_ms = atoi(param.second.c_str());
       } else if (param.first == "header") {
         req.headers.push_back(param.second);
+      } else if (param.first == "input-file") {
+        if (param.second == "-") {
+          input = &std::cin;
+        } else {
+          input_file.open(param.second);
+          if (!input_file) {
+            // LCOV_EXCL_START
+            std::clog << "fatal: cannot open: " << param.second << std::endl;
+            exit(EXIT_FAILURE);
+            // LCOV_EXCL_STOP
+          }
+          input = &input_file;
+        }
+      } else if (param.first == "log-level") {
+        log_level_set = true;
+        if (param.second == "none") {
+          req.log_level = mk::curl::LogLevel::none;
+        } else if (param.second == "summary") {
+          req.log_level = mk::curl::LogLevel::summary;
+        } else if (param.second == "full") {
+          req.log_level = mk::curl::LogLevel::full;
+        } else {
+          // LCOV_EXCL_START
+          std::clog << "fatal: invalid log level: " << param.second
+                    << std::endl;
+          usage();
+          exit(EXIT_FAILURE);
+          // LCOV_EXCL_STOP
+        }
+      } else if (param.first == "low-speed-limit") {
+        req.low_speed_limit = atoll(param.second.c_str());
+      } else if (param.first == "low-speed-time") {
+        req.low_speed_time = atoll(param.second.c_str());
+      } else if (param.first == "max-recv-speed") {
+        req.max_recv_speed = atoll(param.second.c_str());
+      } else if (param.first == "max-send-speed") {
+        req.max_send_speed = atoll(param.second.c_str());
+      } else if (param.first == "output") {
+        if (param.second == "summary") {
+          output = Output::summary;
+        } else if (param.second == "jsonl") {
+          output = Output::jsonl;
+        } else if (param.second == "csv") {
+          output = Output::csv;
+        } else {
+          // LCOV_EXCL_START
+          std::clog << "fatal: invalid output: " << param.second << std::endl;
+          usage();
+          exit(EXIT_FAILURE);
+          // LCOV_EXCL_STOP
+        }
+      } else if (param.first == "parallel") {
+        parallel = (size_t)(std::max)(1, atoi(param.second.c_str()));
+      } else if (param.first == "repeat") {
+        repeat = (size_t)(std::max)(1, atoi(param.second.c_str()));
+      } else if (param.first == "sample-interval") {
+        req.sample_interval_us = atoll(param.second.c_str());
       } else if (param.first == "timeout") {
         // Implementation note: since this is meant to be just a testing
         // client, we don't bother with properly validating the number that
         // is passed here and we just use atoi(). A really robust client
         // SHOULD instead use strtonum().
         req.timeout = atoi(param.second.c_str());
+      } else if (param.first == "timeout-ms") {
+        req.timeout_ms = atoll(param.second.c_str());
       } else {
         // LCOV_EXCL_START
         std::clog << "fatal: unrecognized param: " << param.first << std::endl;
@@ -129,26 +461,59 @@ int main(int, char **argv) {
       }
     }
     auto sz = cmdline.pos_args().size();
-    if (sz < 2) {
+    if ((sz < 2) == (input == nullptr)) {
       // LCOV_EXCL_START
       usage();
       exit(EXIT_FAILURE);
       // LCOV_EXCL_STOP
     }
-  }
-  auto exitcode = EXIT_SUCCESS;
-  mk::curl::Client client;
-  for (size_t sz = 1; sz < cmdline.pos_args().size(); ++sz) {
-    mk::curl::Request real_request{req};
-    real_request.url = cmdline.pos_args()[sz];
-    mk::curl::Response res = client.perform(real_request);
-    summary(res);
-    if (res.error != 0 || res.status_code != 200) {
+    if (output != Output::summary && !log_level_set) {
+      req.log_level = mk::curl::LogLevel::none;
+    }
+    if (no_body) {
+      req.body_sink = [](const char *, size_t) { return true; };
+    }
+    if (req.body_source && (parallel > 1 || repeat > 1)) {
       // LCOV_EXCL_START
-      std::clog << "FATAL: the request did not succeed" << std::endl;
-      exitcode = EXIT_FAILURE;
+      std::clog << "fatal: cannot use --data-file with --parallel or --repeat"
+                << std::endl;
+      exit(EXIT_FAILURE);
       // LCOV_EXCL_STOP
     }
   }
+  Source source{std::vector<std::string>{cmdline.pos_args().begin() + 1,
+                                         cmdline.pos_args().end()},
+                input, repeat};
+  if (output == Output::csv) {
+    std::cout << csv_header << std::endl;
+  }
+  std::mutex mutex;
+  auto exitcode = EXIT_SUCCESS;
+  auto worker = [&]() {
+    mk::curl::Client client;
+    mk::curl::Request request = req;
+    mk::curl::Response res;
+    while (source.next(request.url)) {
+      client.perform(request, res);
+      std::unique_lock<std::mutex> lock{mutex};
+      record(output, request.url, res);
+      if (res.error != 0 || res.status_code != 200) {
+        // LCOV_EXCL_START
+        if (output == Output::summary) {
+          std::clog << "FATAL: the request did not succeed" << std::endl;
+        }
+        exitcode = EXIT_FAILURE;
+        // LCOV_EXCL_STOP
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < parallel; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
   exit(exitcode);
 }
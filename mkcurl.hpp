@@ -6,6 +6,9 @@
 
 #include <stdint.h>
 
+#include <atomic>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -14,12 +17,107 @@
 /// public symbols exported by this library are enclosed.
 ///
 /// See <https://github.com/measurement-kit/measurement-kit/issues/1867#issuecomment-514562622>.
-#define MKCURL_INLINE_NAMESPACE v0_11_2_or_greater
+#define MKCURL_INLINE_NAMESPACE v0_12_0_or_greater
 
 namespace mk {
 namespace curl {
 inline namespace MKCURL_INLINE_NAMESPACE {
 
+/// LogLevel controls how much we write into Response::logs.
+enum class LogLevel {
+  /// none means that we only log errors.
+  none,
+
+  /// summary means that we also log cURL messages and the headers.
+  summary,
+
+  /// full means that we also log the amount of data sent and received,
+  /// but, to reduce the overhead, consecutive data chunks flowing in the
+  /// same direction are logged as a single line.
+  full,
+};
+
+class DNSCache;
+class ResponseCache;
+
+/// Cancellation allows to interrupt the transfers of the requests using it
+/// from any thread. Once cancelled, it stays cancelled.
+class Cancellation {
+ public:
+  /// cancel cancels the transfers, which fail with CURLE_ABORTED_BY_CALLBACK
+  /// shortly after, without being retried.
+  void cancel() noexcept;
+
+  /// cancelled returns whether cancel was called.
+  bool cancelled() const noexcept;
+
+ private:
+  // cancelled_ indicates whether cancel was called.
+  std::atomic<bool> cancelled_{false};
+};
+
+/// Sample is a throughput sample taken during a transfer.
+struct Sample {
+  /// elapsed_us is the time since the beginning of the transfer in
+  /// microseconds, as measured by cURL.
+  int64_t elapsed_us = 0;
+
+  /// bytes_recv is the number of body bytes received so far.
+  int64_t bytes_recv = 0;
+
+  /// bytes_sent is the number of body bytes sent so far.
+  int64_t bytes_sent = 0;
+};
+
+/// RetryPolicy controls when and how we retry a failed request.
+struct RetryPolicy {
+  /// initial_backoff_ms is the delay before the first retry. Each of the
+  /// following delays is twice as long as the previous one.
+  int64_t initial_backoff_ms = 100;
+
+  /// max_backoff_ms is the maximum delay between two attempts.
+  int64_t max_backoff_ms = 5000;
+
+  /// jitter is the fraction, between zero and one, of each delay that is
+  /// chosen at random, so that clients failing together do not retry
+  /// together. For example, 0.5 means a delay between 50% and 100%.
+  double jitter = 0.5;
+
+  /// max_elapsed_ms is the time since the first attempt after which we
+  /// stop retrying. A value of zero means using the Request::timeout_ms or
+  /// the Request::timeout, if any, and otherwise that there is no limit.
+  int64_t max_elapsed_ms = 0;
+
+  /// retriable_errors are the cURL errors for which we retry. When empty,
+  /// we retry for DNS, connect, send and recv errors, for timeouts, and
+  /// when the server closes the connection without replying.
+  std::vector<int64_t> retriable_errors;
+
+  /// retriable_statuses are the HTTP status codes for which we retry. It is
+  /// empty by default, hence we only retry statuses, e.g. 429, 502, 503 and
+  /// 504, when you opt in by listing them.
+  std::vector<int64_t> retriable_statuses;
+
+  /// honour_retry_after indicates whether to wait, before retrying one of
+  /// the retriable_statuses, for at least the number of seconds in the
+  /// Retry-After header.
+  bool honour_retry_after = true;
+
+  /// max_retry_after_ms is the longest Retry-After delay in milliseconds
+  /// that we honour. When the server asks us to wait longer, we do not
+  /// retry, rather than blocking for, e.g., a whole day.
+  int64_t max_retry_after_ms = 60000;
+
+  /// retry_non_idempotent indicates whether we can retry POST requests and
+  /// requests using a body_sink or a body_source for any failure. Since
+  /// the server may have seen the request, or we may have passed part of
+  /// the body to the body_sink, by default we only retry them when we
+  /// could not resolve the host or connect to it. Before sending again the
+  /// body of a body_source, we rewind it using body_source_rewind, and we
+  /// do not retry when that is not possible.
+  bool retry_non_idempotent = false;
+};
+
 /// Request is an HTTP request.
 struct Request {
   /// ca_path is the path to the CA bundle to use.
@@ -41,9 +139,33 @@ struct Request {
   std::string body;
 
   /// timeout is the time after which the request is aborted (in seconds). A
-  /// value of zero means that no timeout is implemented.
+  /// value of zero means that no timeout is implemented. The timeout applies
+  /// to each attempt. Unless retry_policy sets max_elapsed_ms, we do not
+  /// start an attempt past the timeout since the first attempt, hence a
+  /// request lasts less than twice the timeout.
   int64_t timeout = 0;
 
+  /// timeout_ms is like timeout but in milliseconds. If positive, it takes
+  /// precedence over timeout.
+  int64_t timeout_ms = 0;
+
+  /// connect_timeout_ms is the time after which we stop trying to connect
+  /// (in milliseconds). A value of zero means using cURL's default.
+  int64_t connect_timeout_ms = 0;
+
+  /// low_speed_limit and low_speed_time abort the request when it transfers
+  /// less than low_speed_limit bytes per second for low_speed_time seconds.
+  /// Both must be positive to enable this check.
+  int64_t low_speed_limit = 0;
+
+  /// low_speed_time is described above together with low_speed_limit.
+  int64_t low_speed_time = 0;
+
+  /// cancellation is the optional Cancellation that interrupts this request.
+  /// We check it whenever cURL notifies us about progress, i.e., often while
+  /// data flows and at least once per second otherwise.
+  std::shared_ptr<Cancellation> cancellation;
+
   /// proxy_url is the optional URL of the proxy to use.
   std::string proxy_url;
 
@@ -53,15 +175,128 @@ struct Request {
   /// follow_redir indicates whether we should follow redirects.
   bool follow_redir = false;
 
+  /// enable_compression indicates whether we should ask the server to
+  /// compress the response body, which is then transparently decoded. See
+  /// also accept_encoding and Response::body_bytes_recv.
+  bool enable_compression = false;
+
+  /// accept_encoding is the comma separated list of encodings to advertise
+  /// when enable_compression is true, e.g., "gzip, br, zstd". When empty,
+  /// we advertise all the encodings that cURL has been built with.
+  std::string accept_encoding;
+
+  /// enable_certinfo indicates whether we should collect the certificate
+  /// chain of TLS connections into Response::certs. This is disabled by
+  /// default because it makes cURL dump each certificate.
+  bool enable_certinfo = false;
+
   /// connect_to is the string to pass to CURLOPT_CONNECT_TO. In the common
   /// case, you want to set this string to `::<IP>:`.
   std::string connect_to;
 
+  /// connect_addresses are the IPv4 and IPv6 addresses to connect to rather
+  /// than resolving the host in the URL, which is still used for TLS SNI.
+  /// IPv6 addresses may be quoted using [ and ]. cURL races connections
+  /// to IPv4 and IPv6 addresses and keeps the first one established. When
+  /// not empty, connect_to is ignored.
+  std::vector<std::string> connect_addresses;
+
+  /// dns_cache is the optional cache of DNS lookups to use. If it contains
+  /// the host and port in the URL, and connect_addresses is empty, we will
+  /// connect to the cached addresses without resolving the host.
+  std::shared_ptr<DNSCache> dns_cache;
+
+  /// response_cache is the optional cache of responses to use. It is only
+  /// used by Client, ClientPool and perform() for GET requests without a
+  /// body_sink. See ResponseCache for more information.
+  std::shared_ptr<ResponseCache> response_cache;
+
+  /// doh_url is the optional URL of the DNS-over-HTTPS server that cURL
+  /// should use, when not using connect_addresses or the dns_cache.
+  std::string doh_url;
+
+  /// happy_eyeballs_timeout_ms is how long cURL waits for a connection to
+  /// the preferred address family before also trying the other one. A
+  /// negative value means using cURL's default, i.e., 200 milliseconds.
+  int64_t happy_eyeballs_timeout_ms = -1;
+
   /// retries tells this library how many times it needs to retry if
-  /// a request fails because of a DNS error or a connect error. Note
+  /// a request fails for one of the reasons in retry_policy. Note
   /// that the number here is the number of times a request will be
-  /// _retried_, i.e., it does not count the initial request.
+  /// _retried_, i.e., it does not count the initial request. By default,
+  /// we retry DNS, connect, send and recv errors, timeouts and connections
+  /// closed without replying, for as long as the timeout allows, but no
+  /// HTTP status; see RetryPolicy::retriable_statuses. Set it to zero to
+  /// never retry.
   size_t retries = 2;
+
+  /// retry_policy controls when and how we retry.
+  RetryPolicy retry_policy;
+
+  /// body_sink is the optional function receiving the response body in
+  /// chunks as soon as they arrive. When it is set, the response body is
+  /// not accumulated into Response::body. The function should return
+  /// true to continue and false to abort the transfer, in which case the
+  /// request fails with CURLE_WRITE_ERROR. It MUST NOT throw.
+  std::function<bool(const char *data, size_t size)> body_sink;
+
+  /// body_reserve_max is the maximum number of bytes that we will reserve
+  /// in advance for Response::body when the response Content-Length is
+  /// known. Reserving avoids reallocating the body as it grows. A value
+  /// of zero means that we should never reserve memory in advance.
+  size_t body_reserve_max = 1 << 24;
+
+  /// body_source is the optional function providing the POST or PUT body in
+  /// chunks, such that we don't need to keep all of it in memory. When it is
+  /// set, body is ignored. It is called with a buffer and its size and
+  /// should return the number of bytes written into the buffer, zero at the
+  /// end of the body, or a value larger than the buffer size to abort the
+  /// transfer, which then fails with CURLE_ABORTED_BY_CALLBACK. It MUST NOT
+  /// throw.
+  std::function<size_t(char *buffer, size_t size)> body_source;
+
+  /// body_source_size is the size of the body provided by body_source. If
+  /// negative, the size is unknown and we'll use chunked encoding.
+  int64_t body_source_size = -1;
+
+  /// body_source_rewind is the optional function called to restart the body
+  /// provided by body_source from the specified offset, which cURL needs to
+  /// send the body again, e.g., when following a 307 or 308 redirect, when
+  /// doing HTTP authentication, or when a reused connection was dead. It
+  /// should return false when this is not possible. Without it, the above
+  /// cases fail with CURLE_SEND_FAIL_REWIND. It MUST NOT throw.
+  std::function<bool(int64_t offset)> body_source_rewind;
+
+  /// log_level controls how much we write into Response::logs.
+  LogLevel log_level = LogLevel::full;
+
+  /// sample_interval_us is the minimum interval in microseconds between
+  /// two throughput samples. A value of zero disables sampling. Note that
+  /// cURL may notify us about progress less often than this interval.
+  int64_t sample_interval_us = 0;
+
+  /// sample_sink is the optional function receiving the throughput samples
+  /// as soon as they are taken rather than in Response::samples. It is
+  /// called by the thread performing the transfer.
+  std::function<void(const Sample &sample)> sample_sink;
+
+  /// max_recv_speed is the maximum download speed in bytes per second. A
+  /// value of zero means that there is no limit.
+  int64_t max_recv_speed = 0;
+
+  /// max_send_speed is the maximum upload speed in bytes per second. A
+  /// value of zero means that there is no limit.
+  int64_t max_send_speed = 0;
+
+  /// compact_logs indicates whether to store all the log lines into the
+  /// single Response::log_arena buffer, indexed by Response::log_entries,
+  /// rather than into Response::logs. This saves one allocation per log
+  /// line and keeps the logs close in memory.
+  bool compact_logs = false;
+
+  /// log_arena_reserve is the number of bytes reserved in advance for
+  /// Response::log_arena when compact_logs is true.
+  size_t log_arena_reserve = 4096;
 };
 
 /// Log is a log entry.
@@ -74,6 +309,88 @@ struct Log {
   std::string line;
 };
 
+/// LogEntry is a log line stored into Response::log_arena.
+struct LogEntry {
+  /// msec is like Log::msec.
+  int64_t msec = 0;
+
+  /// offset is the offset of the line inside Response::log_arena.
+  size_t offset = 0;
+
+  /// size is the size of the line.
+  size_t size = 0;
+};
+
+/// HeaderEntry is a response header stored into Response::header_arena.
+struct HeaderEntry {
+  /// hop is the index of the response containing this header, since with
+  /// redirects and interim responses (e.g. `100 Continue`) there are the
+  /// headers of several responses. The first response has index zero.
+  size_t hop = 0;
+
+  /// name_offset is the offset of the lowercase header name.
+  size_t name_offset = 0;
+
+  /// name_size is the size of the header name.
+  size_t name_size = 0;
+
+  /// value_offset is the offset of the header value, without leading and
+  /// trailing whitespace.
+  size_t value_offset = 0;
+
+  /// value_size is the size of the header value.
+  size_t value_size = 0;
+};
+
+/// Timings contains the duration of each phase of a transfer, measured by
+/// cURL. Durations are in microseconds and are measured from the start of
+/// the transfer, hence, e.g., connect includes namelookup. When following
+/// redirects, all durations except redirect refer to the last transfer.
+struct Timings {
+  /// namelookup is the time until the name resolution was complete.
+  int64_t namelookup = 0;
+
+  /// connect is the time until the TCP connection was established.
+  int64_t connect = 0;
+
+  /// appconnect is the time until the TLS handshake was complete.
+  int64_t appconnect = 0;
+
+  /// pretransfer is the time until the transfer was about to begin.
+  int64_t pretransfer = 0;
+
+  /// starttransfer is the time until we received the first byte.
+  int64_t starttransfer = 0;
+
+  /// total is the total duration of the transfer.
+  int64_t total = 0;
+
+  /// redirect is the time spent following redirects.
+  int64_t redirect = 0;
+
+  /// download_speed is the average download speed in bytes per second.
+  int64_t download_speed = 0;
+
+  /// upload_speed is the average upload speed in bytes per second.
+  int64_t upload_speed = 0;
+};
+
+/// Attempt contains information on an attempt at performing a request.
+struct Attempt {
+  /// error is the CURL error of this attempt.
+  int64_t error = 0;
+
+  /// status_code is the HTTP status code of this attempt, if any.
+  int64_t status_code = 0;
+
+  /// elapsed_ms is the duration of this attempt in milliseconds.
+  int64_t elapsed_ms = 0;
+
+  /// delay_ms is how long we waited after this attempt before the next
+  /// one, in milliseconds, or zero if this was the last attempt.
+  int64_t delay_ms = 0;
+};
+
 /// Response is an HTTP response.
 struct Response {
   /// error is the CURL error that occurred. In CURL this is an enum hence it
@@ -97,16 +414,84 @@ struct Response {
   /// bytes_recv are the bytes recv when receiving the response.
   int64_t bytes_recv = 0;
 
+  /// body_bytes_recv is the number of body bytes we received, which may
+  /// be compressed when using Request::enable_compression.
+  int64_t body_bytes_recv = 0;
+
+  /// body_bytes_decoded is the number of body bytes after decoding, i.e.,
+  /// the bytes in body or passed to Request::body_sink.
+  int64_t body_bytes_decoded = 0;
+
+  /// num_connects is the number of new connections that cURL opened to
+  /// perform the last attempt at the request.
+  int64_t num_connects = 0;
+
+  /// connection_reused indicates whether the request reused a connection
+  /// previously opened by the same client or share.
+  bool connection_reused = false;
+
+  /// tls_session_resumed indicates whether the TLS handshake resumed a
+  /// previous session. We know this by looking at cURL logs, hence it
+  /// only works with TLS backends logging it, e.g., OpenSSL.
+  bool tls_session_resumed = false;
+
+  /// primary_ip is the IP address of the peer.
+  std::string primary_ip;
+
+  /// primary_port is the port of the peer.
+  int64_t primary_port = 0;
+
+  /// local_ip is the local IP address of the connection.
+  std::string local_ip;
+
+  /// local_port is the local port of the connection.
+  int64_t local_port = 0;
+
   // logs contains the (possibly non UTF-8) logs.
   std::vector<Log> logs;
 
+  /// compact_logs is copied from Request::compact_logs and indicates that
+  /// the logs are in log_arena and log_entries rather than in logs.
+  bool compact_logs = false;
+
+  /// log_arena contains the (possibly non UTF-8) log lines one after the
+  /// other, with no separator, when compact_logs is true.
+  std::string log_arena;
+
+  /// log_entries tells where each line is inside log_arena.
+  std::vector<LogEntry> log_entries;
+
   // request_headers contains the request line and the headers.
   std::string request_headers;
 
   // response_headers contains the response line and the headers.
   std::string response_headers;
 
-  // certs contains a sequence of newline separated PEM certificates.
+  /// header_arena contains the names and the values of the response headers
+  /// one after the other, with no separator. See header_entries.
+  std::string header_arena;
+
+  /// header_entries tells where each response header is inside header_arena,
+  /// in the order in which we received them. We fill it for every request,
+  /// regardless of Request::body_sink and Request::body_reserve_max. Use
+  /// find_header() to lookup the value of a header of the final response.
+  std::vector<HeaderEntry> header_entries;
+
+  /// header_hops is the number of responses whose headers we received. The
+  /// final response is the one with index header_hops - 1.
+  size_t header_hops = 0;
+
+  /// from_cache indicates that the body and the headers come from the
+  /// Request::response_cache rather than from the network.
+  bool from_cache = false;
+
+  /// revalidated indicates that, before using the cached response, we have
+  /// checked with the server that it was still valid. When from_cache
+  /// is true and this is false, we did not use the network at all.
+  bool revalidated = false;
+
+  // certs contains a sequence of newline separated PEM certificates, if
+  // Request::enable_certinfo is true.
   std::string certs;
 
   // content_type is the response content type.
@@ -114,6 +499,287 @@ struct Response {
 
   // http_version is the HTTP version.
   std::string http_version;
+
+  /// timings contains the duration of each phase of the transfer. They are
+  /// also filled when the transfer fails, e.g., because of a timeout, and
+  /// then tell which phase did not complete.
+  Timings timings;
+
+  /// samples contains the throughput samples of the last attempt, unless
+  /// Request::sample_sink was set.
+  std::vector<Sample> samples;
+
+  /// attempts contains information on each attempt at performing the
+  /// request, in order. The last attempt is the one that produced this
+  /// response. It is empty if we could not even start the first attempt.
+  std::vector<Attempt> attempts;
+};
+
+/// DNSCache is a cache of DNS lookups with TTLs that you can seed with the
+/// results of your own lookups and that several requests, including ones
+/// performed by different threads, can use through Request::dns_cache.
+/// Optionally, it also learns the address used by successful requests
+/// that cURL had to resolve. This class is neither copyable nor movable.
+class DNSCache {
+ public:
+  /// DNSCache creates an empty DNS cache that does not learn.
+  DNSCache() noexcept;
+
+  /// DNSCache creates an empty DNS cache that, if @p learn_ttl_ms is
+  /// positive, learns the address used by successful requests that did
+  /// not follow redirects and did not use a proxy, for @p learn_ttl_ms
+  /// milliseconds.
+  explicit DNSCache(int64_t learn_ttl_ms) noexcept;
+
+  /// DNSCache is the deleted copy constructor.
+  DNSCache(const DNSCache &) noexcept = delete;
+
+  /// DNSCache is the deleted copy assignment.
+  DNSCache &operator=(const DNSCache &) noexcept = delete;
+
+  /// DNSCache is the deleted move constructor.
+  DNSCache(DNSCache &&) noexcept = delete;
+
+  /// DNSCache is the deleted move assignment.
+  DNSCache &operator=(DNSCache &&) noexcept = delete;
+
+  /// ~DNSCache is the destructor.
+  ~DNSCache() noexcept;
+
+  /// add maps @p host and @p port to @p addresses for @p ttl_ms
+  /// milliseconds, replacing any previous mapping. A non positive
+  /// @p ttl_ms means that the mapping never expires.
+  void add(const std::string &host, int64_t port,
+           std::vector<std::string> addresses, int64_t ttl_ms) noexcept;
+
+  /// remove removes the mapping of @p host and @p port, if any.
+  void remove(const std::string &host, int64_t port) noexcept;
+
+  /// lookup returns the addresses of @p host and @p port, or an empty
+  /// vector if there is no such mapping or it has expired.
+  std::vector<std::string> lookup(
+      const std::string &host, int64_t port) const noexcept;
+
+  /// size returns the number of mappings that have not expired.
+  size_t size() const noexcept;
+
+  /// clear removes all the mappings.
+  void clear() noexcept;
+
+  /// learn_ttl_ms returns for how long we remember the learned addresses,
+  /// or a non positive value if we do not learn.
+  int64_t learn_ttl_ms() const noexcept;
+
+ private:
+  // Impl is the implementation of a DNS cache.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// ResponseCache is an in-memory cache of successful responses to GET
+/// requests that several requests, including ones performed by different
+/// threads, can use through Request::response_cache. Responses are keyed by
+/// method, URL and the request headers named by their Vary header. A cached
+/// response is fresh for the Cache-Control max-age. After that, if it has an
+/// ETag or a Last-Modified header, we revalidate it using a conditional
+/// request and use it again if the server replies with 304. We do not cache
+/// responses with Cache-Control no-store or Vary `*`, nor responses that we
+/// could not revalidate and that have no max-age. When the cached bodies
+/// exceed the maximum size, we evict the least recently used responses.
+class ResponseCache {
+ public:
+  /// ResponseCache creates an empty cache holding up to 16 MiB of bodies.
+  ResponseCache() noexcept;
+
+  /// ResponseCache creates an empty cache holding up to @p max_bytes bytes
+  /// of bodies. Larger bodies are not cached.
+  explicit ResponseCache(size_t max_bytes) noexcept;
+
+  /// ResponseCache is the deleted copy constructor.
+  ResponseCache(const ResponseCache &) noexcept = delete;
+
+  /// ResponseCache is the deleted copy assignment.
+  ResponseCache &operator=(const ResponseCache &) noexcept = delete;
+
+  /// ResponseCache is the deleted move constructor.
+  ResponseCache(ResponseCache &&) noexcept = delete;
+
+  /// ResponseCache is the deleted move assignment.
+  ResponseCache &operator=(ResponseCache &&) noexcept = delete;
+
+  /// ~ResponseCache is the destructor.
+  ~ResponseCache() noexcept;
+
+  /// get copies the cached response to @p request, if any, into @p response
+  /// and @return whether there is such response. We set @p fresh to indicate
+  /// whether the response is fresh or must be revalidated before use.
+  bool get(const Request &request, Response &response,
+           bool &fresh) const noexcept;
+
+  /// put stores @p response to @p request, if cacheable. If @p response is
+  /// a 304, it refreshes the cached response instead, using the max-age of
+  /// the cached response when the 304 has none. If @p response is not
+  /// cacheable, it removes the cached response, if any.
+  void put(const Request &request, const Response &response) noexcept;
+
+  /// size returns the number of cached responses.
+  size_t size() const noexcept;
+
+  /// bytes returns the total size of the cached bodies.
+  size_t bytes() const noexcept;
+
+  /// clear removes all the cached responses.
+  void clear() noexcept;
+
+ private:
+  // Impl is the implementation of a response cache.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// Share is a cache of DNS lookups, TLS sessions and, optionally, live
+/// connections that several clients can use, including clients that are
+/// used by different threads. This class is neither copyable nor movable,
+/// because clients keep a shared pointer to it. If cURL fails to create
+/// the share, the clients using it will work without sharing anything.
+class Share {
+ public:
+  /// Share creates a cache of DNS lookups and TLS sessions.
+  Share() noexcept;
+
+  /// Share creates a cache of DNS lookups and TLS sessions. In addition,
+  /// if @p share_connections is true, connections will also be shared.
+  /// Note that cURL does not support using the same connection from
+  /// several threads concurrently, hence this is better avoided when
+  /// the clients sharing connections are used by different threads.
+  explicit Share(bool share_connections) noexcept;
+
+  /// Share is the deleted copy constructor.
+  Share(const Share &) noexcept = delete;
+
+  /// Share is the deleted copy assignment.
+  Share &operator=(const Share &) noexcept = delete;
+
+  /// Share is the deleted move constructor.
+  Share(Share &&) noexcept = delete;
+
+  /// Share is the deleted move assignment.
+  Share &operator=(Share &&) noexcept = delete;
+
+  /// ~Share is the destructor.
+  ~Share() noexcept;
+
+ private:
+  // The clients need to access the cURL share handle.
+  friend class Client;
+  friend class MultiClient;
+  friend class AsyncClient;
+
+  // Impl is the implementation of a share.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// PreparedRequest is a Request whose cURL configuration is built once.
+/// When a Client performs the same PreparedRequest again, and no other Client
+/// performed it in the meanwhile, it skips resetting the handle and setting
+/// the options again and only updates what changed using set_url() and
+/// set_body(). We configure the handle from scratch anyway when the request
+/// uses a DNSCache, when set_url() moves it to another host or port, or when
+/// set_url() is used along with connect_addresses. A PreparedRequest is
+/// movable but not copyable and MUST NOT be used by several threads at the
+/// same time.
+class PreparedRequest {
+ public:
+  /// PreparedRequest prepares @p request.
+  explicit PreparedRequest(Request request) noexcept;
+
+  /// PreparedRequest is the deleted copy constructor.
+  PreparedRequest(const PreparedRequest &) noexcept = delete;
+
+  /// PreparedRequest is the deleted copy assignment.
+  PreparedRequest &operator=(const PreparedRequest &) noexcept = delete;
+
+  /// PreparedRequest is the move constructor.
+  PreparedRequest(PreparedRequest &&) noexcept;
+
+  /// PreparedRequest is the move assignment.
+  PreparedRequest &operator=(PreparedRequest &&) noexcept;
+
+  /// ~PreparedRequest is the destructor.
+  ~PreparedRequest() noexcept;
+
+  /// request returns the prepared request.
+  const Request &request() const noexcept;
+
+  /// set_url changes the URL to @p url.
+  void set_url(std::string url) noexcept;
+
+  /// set_body changes the body to @p body.
+  void set_body(std::string body) noexcept;
+
+ private:
+  // The client needs to access the cached configuration.
+  friend class Client;
+
+  // Impl is the implementation of a prepared request.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// ClientStats contains aggregate statistics on the requests performed
+/// by a Client since it was created.
+struct ClientStats {
+  /// requests is the number of performed requests.
+  uint64_t requests = 0;
+
+  /// failures is the number of requests that failed with a cURL error.
+  uint64_t failures = 0;
+
+  /// connects is the number of new connections opened.
+  uint64_t connects = 0;
+
+  /// reused is the number of requests that reused a connection.
+  uint64_t reused = 0;
+
+  /// tls_resumed is the number of requests that resumed a TLS session.
+  uint64_t tls_resumed = 0;
+
+  /// bytes_sent is the total number of bytes sent.
+  int64_t bytes_sent = 0;
+
+  /// bytes_recv is the total number of bytes received.
+  int64_t bytes_recv = 0;
+};
+
+/// ConnectionPolicy controls how a Client manages its cache of connections.
+/// Since a Client performs a single transfer at a time, it never opens more
+/// than one connection with a host at once; see MultiSettings for limiting
+/// concurrent connections with a host.
+struct ConnectionPolicy {
+  /// max_connections is the maximum number of idle connections that a
+  /// Client keeps open. When the cache is full, we close the oldest idle
+  /// connection. A value of zero means using cURL's default.
+  size_t max_connections = 0;
+
+  /// idle_timeout is the number of seconds after which we do not reuse an
+  /// idle connection but close it. A value of zero means using cURL's
+  /// default. This requires cURL >= 7.65.0 and is ignored otherwise.
+  int64_t idle_timeout = 0;
+
+  /// keepalive_interval is the number of seconds between TCP keepalive
+  /// probes, which also is the idle time before sending the first one. This
+  /// keeps idle connections alive through NATs. A value of zero means
+  /// that we do not enable TCP keepalive.
+  int64_t keepalive_interval = 0;
 };
 
 /// Client is an HTTP client. This class is movable but not copyable because
@@ -132,6 +798,14 @@ class Client {
   /// Client creates a new client.
   Client() noexcept;
 
+  /// Client creates a new client using the caches in @p share. Passing
+  /// an empty pointer is equivalent to using the default constructor.
+  explicit Client(std::shared_ptr<Share> share) noexcept;
+
+  /// Client creates a new client using the caches in @p share, which may
+  /// be empty, and managing its connections according to @p policy.
+  Client(std::shared_ptr<Share> share, ConnectionPolicy policy) noexcept;
+
   /// Client is the deleted copy constructor.
   Client(const Client &) noexcept = delete;
 
@@ -150,6 +824,37 @@ class Client {
   /// perform performs @p request and returns the Response.
   Response perform(const Request &request) noexcept;
 
+  /// perform performs @p request and stores the Response into @p response.
+  /// We reset @p response first but keep the capacity of its body, headers
+  /// and logs, hence reusing the same @p response for several requests
+  /// avoids reallocating such buffers every time.
+  void perform(const Request &request, Response &response) noexcept;
+
+  /// perform performs @p request and returns the Response. If this is the
+  /// same PreparedRequest this client performed last, we reuse the options
+  /// already set into the cURL handle.
+  Response perform(PreparedRequest &request) noexcept;
+
+  /// prewarm connects to each of the @p urls by fetching it, so that later
+  /// requests to the same origins reuse the connections. Since cURL only
+  /// reuses connections with the same settings, e.g. CA bundle, proxy and
+  /// connect_to, we use the settings of @p request, except that we GET each
+  /// URL without retrying, logging or keeping its body, and without using
+  /// the response cache. When @p request has no timeout, we use a timeout
+  /// of ten seconds. Choose URLs with small bodies, e.g., a health check
+  /// endpoint, since we discard them. @return the number of URLs that we
+  /// fetched successfully.
+  size_t prewarm(const Request &request,
+                 const std::vector<std::string> &urls) noexcept;
+
+  /// close_connections closes all the connections of this client, e.g.,
+  /// before a long idle period. Connections stored into a Share created
+  /// with share_connections are not affected.
+  void close_connections() noexcept;
+
+  /// stats returns the statistics on the requests performed so far.
+  ClientStats stats() const noexcept;
+
  private:
   // Impl is the implementation of a client.
   class Impl;
@@ -161,66 +866,602 @@ class Client {
 /// perform performs @p request and returns the Response.
 Response perform(const Request &request) noexcept;
 
-}  // inline namespace MKCURL_INLINE_NAMESPACE
-}  // namespace curl
-}  // namespace mk
+/// find_header finds the first header called @p name, which is compared
+/// case insensitively, among the headers of the final response in @p res
+/// and stores its value into @p value. @return whether we found it.
+bool find_header(const Response &res, const std::string &name,
+                 std::string &value) noexcept;
 
-// If you just want to know about the API, you can stop reading here. What
-// follows is the inline implementation of the library. By default it is not
-// included when you include the header, but you can change this.
-#ifdef MKCURL_INLINE_IMPL
+/// ClientPool is a pool of Clients that several threads can use at the same
+/// time. Each Client keeps its live connections when it is returned to the
+/// pool, hence subsequent checkouts get a warm Client. This class is neither
+/// copyable nor movable, because leases keep a pointer to it.
+class ClientPool {
+ public:
+  /// Lease is a Client checked out from a ClientPool. The Client goes back
+  /// to the pool when the lease is destroyed. This class is movable but not
+  /// copyable. A lease MUST NOT outlive the pool it comes from.
+  class Lease {
+   public:
+    /// Lease is the deleted copy constructor.
+    Lease(const Lease &) noexcept = delete;
 
-#include <assert.h>
+    /// Lease is the deleted copy assignment.
+    Lease &operator=(const Lease &) noexcept = delete;
 
-#include <algorithm>
-#include <chrono>
-#include <sstream>
+    /// Lease is the move constructor.
+    Lease(Lease &&) noexcept;
 
-#include <curl/curl.h>
+    /// Lease is the move assignment.
+    Lease &operator=(Lease &&) noexcept;
 
-#include "mkmock.hpp"
+    /// ~Lease is the destructor.
+    ~Lease() noexcept;
 
-// MKCURL_MOCK controls whether to enable mocking
-#ifdef MKCURL_MOCK
-#define MKCURL_HOOK MKMOCK_HOOK_ENABLED
-#define MKCURL_HOOK_ALLOC MKMOCK_HOOK_ALLOC_ENABLED
-#else
-#define MKCURL_HOOK MKMOCK_HOOK_DISABLED
-#define MKCURL_HOOK_ALLOC MKMOCK_HOOK_ALLOC_DISABLED
-#endif
+    /// client returns the leased Client.
+    Client &client() noexcept;
 
-#ifndef MKCURL_ABORT
-// MKCURL_ABORT allows to mock abort
-#define MKCURL_ABORT abort
-#endif
+   private:
+    // The pool needs to construct leases.
+    friend class ClientPool;
 
-namespace mk {
-namespace curl {
-inline namespace MKCURL_INLINE_NAMESPACE {
+    // Lease constructs a lease of @p client from @p pool.
+    Lease(ClientPool *pool, Client &&client) noexcept;
 
-// mkcurl_log appends @p line to @p logs. It adds information on the current
-// time in millisecond. It also appends a newline to the end of the line.
-static void mkcurl_log(std::vector<Log> &logs, std::string &&line) {
-  auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
-      std::chrono::steady_clock::now().time_since_epoch());
-  Log log;
-  log.msec = now.count();
-  std::swap(line, log.line);
-  logs.push_back(std::move(log));
-}
+    // pool_ is the pool, or null if this lease was moved.
+    ClientPool *pool_ = nullptr;
 
-// mkcurl_deleter is a custom deleter for a CURL handle.
-struct mkcurl_deleter {
-  void operator()(CURL *handle) { curl_easy_cleanup(handle); }
+    // client_ is the leased Client.
+    Client client_;
+  };
+
+  /// ClientPool creates a pool containing @p size Clients that use the
+  /// optional @p share and @p policy. A value of zero is treated like a
+  /// value of one.
+  explicit ClientPool(size_t size, std::shared_ptr<Share> share = nullptr,
+                      ConnectionPolicy policy = ConnectionPolicy{}) noexcept;
+
+  /// ClientPool is the deleted copy constructor.
+  ClientPool(const ClientPool &) noexcept = delete;
+
+  /// ClientPool is the deleted copy assignment.
+  ClientPool &operator=(const ClientPool &) noexcept = delete;
+
+  /// ClientPool is the deleted move constructor.
+  ClientPool(ClientPool &&) noexcept = delete;
+
+  /// ClientPool is the deleted move assignment.
+  ClientPool &operator=(ClientPool &&) noexcept = delete;
+
+  /// ~ClientPool is the destructor.
+  ~ClientPool() noexcept;
+
+  /// checkout checks out a Client from the pool, blocking until one
+  /// becomes available if all of them are currently leased.
+  Lease checkout() noexcept;
+
+  /// perform performs @p request using a Client from the pool and returns
+  /// the Response. This is equivalent to `checkout().client().perform()`.
+  Response perform(const Request &request) noexcept;
+
+ private:
+  // checkin returns @p client to the pool.
+  void checkin(Client &&client) noexcept;
+
+  // Impl is the implementation of a pool.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
 };
 
-// mkcurl_uptr is a unique pointer to a CURL handle.
-using mkcurl_uptr = std::unique_ptr<CURL, mkcurl_deleter>;
+/// MultiSettings contains the settings of a MultiClient.
+struct MultiSettings {
+  /// concurrency is the maximum number of transfers that a MultiClient
+  /// will run concurrently. A value of zero is treated like a value of one.
+  size_t concurrency = 16;
 
-// Client::Impl contains the implementation of a client.
-class Client::Impl {
+  /// share is the optional cache shared with other clients.
+  std::shared_ptr<Share> share;
+
+  /// enable_multiplex indicates whether concurrent requests to the same
+  /// host that use Request::enable_http2 should be multiplexed as streams
+  /// of a single HTTP/2 connection. In such case, a new request waits for
+  /// a connection being established to learn whether it can multiplex
+  /// rather than opening a new connection.
+  bool enable_multiplex = true;
+
+  /// max_host_connections is the maximum number of connections with any
+  /// given host. Transfers exceeding it wait for a connection to be free
+  /// or, with multiplexing, become streams of an existing connection. A
+  /// value of zero means no limit.
+  size_t max_host_connections = 0;
+};
+
+/// MultiClient is an HTTP client that performs many requests concurrently
+/// using cURL's multi interface. This class is movable but not copyable
+/// and, like Client, it MUST NOT be used by more than one thread at any
+/// given time, because it wraps several cURL handles.
+class MultiClient {
  public:
-  mkcurl_uptr handle;
+  /// MultiClient creates a new multi client with default settings.
+  MultiClient() noexcept;
+
+  /// MultiClient creates a new multi client using @p settings.
+  explicit MultiClient(MultiSettings settings) noexcept;
+
+  /// MultiClient is the deleted copy constructor.
+  MultiClient(const MultiClient &) noexcept = delete;
+
+  /// MultiClient is the deleted copy assignment.
+  MultiClient &operator=(const MultiClient &) noexcept = delete;
+
+  /// MultiClient is the move constructor.
+  MultiClient(MultiClient &&) noexcept;
+
+  /// MultiClient is the move assignment.
+  MultiClient &operator=(MultiClient &&) noexcept;
+
+  /// ~MultiClient is the destructor.
+  ~MultiClient() noexcept;
+
+  /// perform performs all the @p requests, running at most as many of them
+  /// concurrently as specified by the settings, and returns the Responses in
+  /// the same order of the corresponding @p requests.
+  std::vector<Response> perform(const std::vector<Request> &requests) noexcept;
+
+ private:
+  // Impl is the implementation of a multi client.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// AsyncClient is an HTTP client that performs requests asynchronously. It
+/// owns a background thread that uses cURL's multi interface to multiplex
+/// all the pending requests. Unlike Client and MultiClient, this class
+/// can be used by several threads at the same time. This class is movable
+/// but not copyable. When an AsyncClient is destroyed, the requests that
+/// are still pending fail with CURLE_ABORTED_BY_CALLBACK.
+class AsyncClient {
+ public:
+  /// AsyncClient creates a new async client with default settings.
+  AsyncClient() noexcept;
+
+  /// AsyncClient creates a new async client using @p settings. The
+  /// concurrency setting limits the number of transfers that are
+  /// running at any given time; other requests are queued.
+  explicit AsyncClient(MultiSettings settings) noexcept;
+
+  /// AsyncClient is the deleted copy constructor.
+  AsyncClient(const AsyncClient &) noexcept = delete;
+
+  /// AsyncClient is the deleted copy assignment.
+  AsyncClient &operator=(const AsyncClient &) noexcept = delete;
+
+  /// AsyncClient is the move constructor.
+  AsyncClient(AsyncClient &&) noexcept;
+
+  /// AsyncClient is the move assignment.
+  AsyncClient &operator=(AsyncClient &&) noexcept;
+
+  /// ~AsyncClient is the destructor.
+  ~AsyncClient() noexcept;
+
+  /// perform schedules @p request and calls @p callback with the Response
+  /// once it is complete. The @p callback is called from the background
+  /// thread, hence it MUST NOT block and MUST NOT throw.
+  void perform(
+      Request request, std::function<void(Response)> callback) noexcept;
+
+  /// perform schedules @p request and @return a future Response.
+  std::future<Response> perform(Request request) noexcept;
+
+ private:
+  // Impl is the implementation of an async client.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// Coalescer merges identical requests that are in flight at the same time into
+/// a single transfer, whose Response is shared by all the callers. It only
+/// coalesces GET requests without a Request::body_sink, a Request::body_source,
+/// a Request::sample_sink or a Request::cancellation. Two requests are
+/// identical when they have the same URL, headers, proxy, connect_to,
+/// connect_addresses, dns_cache, doh_url, ca_path and redirect, compression and
+/// certinfo settings; the other settings of the waiting requests, e.g. their
+/// timeout, are ignored. Unlike Client, this class can be used by several
+/// threads at the same time. This class is neither copyable nor movable,
+/// because waiters keep a pointer to it.
+class Coalescer {
+ public:
+  /// Coalescer creates a new coalescer.
+  Coalescer() noexcept;
+
+  /// Coalescer is the deleted copy constructor.
+  Coalescer(const Coalescer &) noexcept = delete;
+
+  /// Coalescer is the deleted copy assignment.
+  Coalescer &operator=(const Coalescer &) noexcept = delete;
+
+  /// Coalescer is the deleted move constructor.
+  Coalescer(Coalescer &&) noexcept = delete;
+
+  /// Coalescer is the deleted move assignment.
+  Coalescer &operator=(Coalescer &&) noexcept = delete;
+
+  /// ~Coalescer is the destructor.
+  ~Coalescer() noexcept;
+
+  /// perform performs @p request by calling @p perform, unless an identical
+  /// request is already in flight, in which case it waits for it to complete
+  /// and @return its Response. The @p perform function MUST NOT throw.
+  std::shared_ptr<const Response> perform(
+      const Request &request,
+      const std::function<Response(const Request &)> &perform) noexcept;
+
+  /// perform is like the above but performs @p request using @p client.
+  std::shared_ptr<const Response> perform(
+      Client &client, const Request &request) noexcept;
+
+  /// perform is like the above but performs @p request using @p pool.
+  std::shared_ptr<const Response> perform(
+      ClientPool &pool, const Request &request) noexcept;
+
+  /// perform performs @p requests using @p client. Identical requests among
+  /// @p requests are performed once, and requests identical to ones already
+  /// in flight wait for them. @return the Responses in the same order of the
+  /// corresponding @p requests.
+  std::vector<std::shared_ptr<const Response>> perform(
+      MultiClient &client, const std::vector<Request> &requests) noexcept;
+
+  /// coalesced returns the number of requests that did not cause a transfer
+  /// because they shared the Response of an identical request.
+  uint64_t coalesced() const noexcept;
+
+ private:
+  // Impl is the implementation of a coalescer.
+  class Impl;
+
+  // impl_ is a unique pointer to the opaque implementation.
+  std::unique_ptr<Impl> impl_;
+};
+
+/// Histogram is a snapshot of a histogram of durations in microseconds.
+struct Histogram {
+  /// bounds contains the inclusive upper bound of each bucket except the
+  /// last one, which has no upper bound.
+  std::vector<int64_t> bounds;
+
+  /// counts contains the number of observations falling into each bucket,
+  /// hence it contains one more element than bounds.
+  std::vector<uint64_t> counts;
+
+  /// count is the total number of observations.
+  uint64_t count = 0;
+
+  /// sum is the sum of all the observations.
+  int64_t sum = 0;
+};
+
+/// Metrics is a snapshot of the process-wide metrics collected by all the
+/// clients. We only collect metrics when the implementation is compiled with
+/// MKCURL_ENABLE_METRICS defined, in which case updating them costs a few
+/// atomic operations per transfer and per callback. Otherwise, all the
+/// metrics are always zero.
+struct Metrics {
+  /// transfers is the number of completed transfers, including failed ones.
+  uint64_t transfers = 0;
+
+  /// failures is the number of failed transfers.
+  uint64_t failures = 0;
+
+  /// retries is the number of times we retried a transfer.
+  uint64_t retries = 0;
+
+  /// connects is the number of new connections.
+  uint64_t connects = 0;
+
+  /// reused is the number of transfers that reused a connection.
+  uint64_t reused = 0;
+
+  /// bytes_sent is the number of bytes sent by successful transfers.
+  uint64_t bytes_sent = 0;
+
+  /// bytes_recv is the number of bytes received by successful transfers.
+  uint64_t bytes_recv = 0;
+
+  /// body_callbacks is the number of times cURL passed us body data.
+  uint64_t body_callbacks = 0;
+
+  /// debug_callbacks is the number of times cURL passed us debug data.
+  uint64_t debug_callbacks = 0;
+
+  /// live_handles is the number of cURL easy handles currently alive, each
+  /// of which owns a cache of live connections.
+  int64_t live_handles = 0;
+
+  /// setup_us is the time spent configuring handles to perform requests.
+  Histogram setup_us;
+
+  /// transfer_us is the total duration of the successful transfers.
+  Histogram transfer_us;
+};
+
+/// metrics returns a snapshot of the metrics.
+Metrics metrics() noexcept;
+
+/// metrics_prometheus formats @p metrics using the Prometheus text format.
+std::string metrics_prometheus(const Metrics &metrics) noexcept;
+
+/// metrics_statsd formats @p metrics as StatsD gauges, one per line, whose
+/// names start with @p prefix. For histograms, we only export the count and
+/// the sum of the observations.
+std::string metrics_statsd(
+    const Metrics &metrics, const std::string &prefix) noexcept;
+
+}  // inline namespace MKCURL_INLINE_NAMESPACE
+}  // namespace curl
+}  // namespace mk
+
+// If you just want to know about the API, you can stop reading here. What
+// follows is the inline implementation of the library. By default it is not
+// included when you include the header, but you can change this.
+#ifdef MKCURL_INLINE_IMPL
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <tuple>
+
+#include <curl/curl.h>
+
+// MKCURL_MOCK controls whether to enable mocking. When it is not defined,
+// the hooks compile to nothing and we do not depend on mkmock.
+#ifdef MKCURL_MOCK
+#include "mkmock.hpp"
+#define MKCURL_HOOK MKMOCK_HOOK_ENABLED
+#define MKCURL_HOOK_ALLOC MKMOCK_HOOK_ALLOC_ENABLED
+#else
+#define MKCURL_HOOK(Tag, Variable) /* Nothing */
+#define MKCURL_HOOK_ALLOC(Tag, Variable, Deleter) /* Nothing */
+#endif
+
+// MKCURL_COLD marks functions that only run on error paths, so that the
+// compiler keeps them, and the branches calling them, out of the hot path.
+#if defined(__GNUC__) || defined(__clang__)
+#define MKCURL_COLD __attribute__((cold, noinline))
+#elif defined(_MSC_VER)
+#define MKCURL_COLD __declspec(noinline)
+#else
+#define MKCURL_COLD
+#endif
+
+// MKCURL_HAVE_MULTI_WAKEUP indicates whether cURL is recent enough to have
+// curl_multi_poll() and curl_multi_wakeup(), added in v7.68.0.
+#if LIBCURL_VERSION_NUM >= 0x074400
+#define MKCURL_HAVE_MULTI_WAKEUP
+#endif
+
+#ifndef MKCURL_ABORT
+// MKCURL_ABORT allows to mock abort
+#define MKCURL_ABORT abort
+#endif
+
+// MKCURL_ENABLE_METRICS controls whether to collect metrics. When it is
+// not defined, the following macros compile to nothing.
+#ifdef MKCURL_ENABLE_METRICS
+// MKCURL_COUNT adds @p Value to the @p Name counter.
+#define MKCURL_COUNT(Name, Value) \
+  (void)(mk::curl::mkcurl_metrics_get().Name += (Value))
+// MKCURL_OBSERVE adds @p Value to the @p Name histogram.
+#define MKCURL_OBSERVE(Name, Value) \
+  mk::curl::mkcurl_metrics_get().Name.observe(Value)
+// MKCURL_STOPWATCH starts the @p Name stopwatch.
+#define MKCURL_STOPWATCH(Name) int64_t Name = mk::curl::mkcurl_now_us()
+// MKCURL_OBSERVE_SINCE adds the time since @p Stopwatch to @p Name.
+#define MKCURL_OBSERVE_SINCE(Name, Stopwatch) \
+  MKCURL_OBSERVE(Name, mk::curl::mkcurl_now_us() - Stopwatch)
+#else
+#define MKCURL_COUNT(Name, Value) (void)0
+#define MKCURL_OBSERVE(Name, Value) (void)0
+#define MKCURL_STOPWATCH(Name) (void)0
+#define MKCURL_OBSERVE_SINCE(Name, Stopwatch) (void)0
+#endif
+
+namespace mk {
+namespace curl {
+inline namespace MKCURL_INLINE_NAMESPACE {
+
+// mkcurl_now returns the current steady clock time in milliseconds.
+static int64_t mkcurl_now() noexcept {
+  auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch());
+  return now.count();
+}
+
+// mkcurl_histogram_bounds are the bounds of the buckets of histograms.
+static const int64_t mkcurl_histogram_bounds[] = {
+    10,     25,     50,      100,     250,     500,     1000,
+    2500,   5000,   10000,   25000,   50000,   100000,  250000,
+    500000, 1000000, 2500000, 5000000, 10000000};
+
+// mkcurl_histogram_size is the number of buckets of histograms.
+constexpr size_t mkcurl_histogram_size =
+    sizeof(mkcurl_histogram_bounds) / sizeof(mkcurl_histogram_bounds[0]) + 1;
+
+#ifdef MKCURL_ENABLE_METRICS
+// mkcurl_now_us returns the current steady clock time in microseconds.
+static int64_t mkcurl_now_us() noexcept {
+  auto now = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch());
+  return now.count();
+}
+
+// mkcurl_histogram is a histogram that can be updated concurrently.
+struct mkcurl_histogram {
+  std::atomic<uint64_t> counts[mkcurl_histogram_size];
+  std::atomic<uint64_t> count{0};
+  std::atomic<int64_t> sum{0};
+
+  mkcurl_histogram() noexcept {
+    for (auto &count : counts) {
+      count = 0;
+    }
+  }
+
+  void observe(int64_t value) noexcept {
+    size_t index = 0;
+    while (index < mkcurl_histogram_size - 1 &&
+           value > mkcurl_histogram_bounds[index]) {
+      ++index;
+    }
+    counts[index] += 1;
+    count += 1;
+    sum += value;
+  }
+};
+
+// mkcurl_metrics contains the metrics. See Metrics for more information.
+struct mkcurl_metrics {
+  std::atomic<uint64_t> transfers{0};
+  std::atomic<uint64_t> failures{0};
+  std::atomic<uint64_t> retries{0};
+  std::atomic<uint64_t> connects{0};
+  std::atomic<uint64_t> reused{0};
+  std::atomic<uint64_t> bytes_sent{0};
+  std::atomic<uint64_t> bytes_recv{0};
+  std::atomic<uint64_t> body_callbacks{0};
+  std::atomic<uint64_t> debug_callbacks{0};
+  std::atomic<int64_t> live_handles{0};
+  mkcurl_histogram setup_us;
+  mkcurl_histogram transfer_us;
+};
+
+// mkcurl_metrics_get returns the process-wide metrics.
+static mkcurl_metrics &mkcurl_metrics_get() noexcept {
+  static mkcurl_metrics metrics;
+  return metrics;
+}
+#endif  // MKCURL_ENABLE_METRICS
+
+// mkcurl_log_begin starts a new log line in the arena of @p res.
+static void mkcurl_log_begin(Response &res) {
+  LogEntry entry;
+  entry.msec = mkcurl_now();
+  entry.offset = res.log_arena.size();
+  res.log_entries.push_back(entry);
+}
+
+// mkcurl_log_end terminates the log line started by mkcurl_log_begin.
+static void mkcurl_log_end(Response &res) {
+  LogEntry &entry = res.log_entries.back();
+  entry.size = res.log_arena.size() - entry.offset;
+}
+
+// mkcurl_log appends @p line to the logs of @p res. It adds information on
+// the current time in millisecond.
+static void mkcurl_log(Response &res, std::string &&line) {
+  if (res.compact_logs) {
+    mkcurl_log_begin(res);
+    res.log_arena.append(line);
+    mkcurl_log_end(res);
+    return;
+  }
+  Log log;
+  log.msec = mkcurl_now();
+  std::swap(line, log.line);
+  res.logs.push_back(std::move(log));
+}
+
+// mkcurl_log_failure is like mkcurl_log but for error paths. Being cold and
+// out of line, it keeps constructing the log line out of the hot path.
+MKCURL_COLD static void mkcurl_log_failure(Response &res, const char *line) {
+  mkcurl_log(res, line);
+}
+
+// mkcurl_log_failure is like the above but logs @p what followed by the
+// description of the @p error that made it fail.
+MKCURL_COLD static void mkcurl_log_failure(
+    Response &res, const char *what, CURLcode error) {
+  std::stringstream ss;
+  ss << what << ": " << curl_easy_strerror(error);
+  mkcurl_log(res, ss.str());
+}
+
+// mkcurl_deleter is a custom deleter for a CURL handle.
+struct mkcurl_deleter {
+  void operator()(CURL *handle) {
+    curl_easy_cleanup(handle);
+    MKCURL_COUNT(live_handles, -1);
+  }
+};
+
+// mkcurl_uptr is a unique pointer to a CURL handle.
+using mkcurl_uptr = std::unique_ptr<CURL, mkcurl_deleter>;
+
+// mkcurl_multi_deleter is a custom deleter for a CURLM handle.
+struct mkcurl_multi_deleter {
+  void operator()(CURLM *handle) { curl_multi_cleanup(handle); }
+};
+
+// mkcurl_multi_uptr is a unique pointer to a CURLM handle.
+using mkcurl_multi_uptr = std::unique_ptr<CURLM, mkcurl_multi_deleter>;
+
+// mkcurl_share_deleter is a custom deleter for a CURLSH handle.
+struct mkcurl_share_deleter {
+  void operator()(CURLSH *handle) { curl_share_cleanup(handle); }
+};
+
+// mkcurl_share_uptr is a unique pointer to a CURLSH handle.
+using mkcurl_share_uptr = std::unique_ptr<CURLSH, mkcurl_share_deleter>;
+
+// Share::Impl contains the implementation of a share.
+class Share::Impl {
+ public:
+  // mutexes contains a mutex for each kind of shared data.
+  std::mutex mutexes[CURL_LOCK_DATA_LAST];
+  mkcurl_share_uptr handle;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+};
+Share::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
+
+// Client::Impl contains the implementation of a client.
+class Client::Impl {
+ public:
+  // Note: share must be declared before handle because the handle MUST
+  // be destroyed before the share it is using.
+  std::shared_ptr<Share> share;
+  CURLSH *shareh = nullptr;  // Owned by share
+  mkcurl_uptr handle;
+  // prepared is the ID of the PreparedRequest whose options are currently
+  // set into handle, or zero if there is no such PreparedRequest.
+  uint64_t prepared = 0;
+  // stats contains the statistics on the performed requests.
+  ClientStats stats;
+  // policy is the connection policy.
+  ConnectionPolicy policy;
   Impl() noexcept = default;
   Impl(const Impl &) noexcept = delete;
   Impl &operator=(const Impl &) noexcept = delete;
@@ -248,6 +1489,219 @@ struct mkcurl_slist {
   curl_slist *p = nullptr;
 };
 
+// mkcurl_xfer contains the state of a transfer that must outlive the
+// configuration of a handle, because cURL only keeps pointers to it.
+struct mkcurl_xfer {
+  // headers contains the request headers.
+  mkcurl_slist headers;
+  // connect_to_settings contains the CURLOPT_CONNECT_TO settings.
+  mkcurl_slist connect_to_settings;
+  // resolve_settings contains the CURLOPT_RESOLVE settings.
+  mkcurl_slist resolve_settings;
+  // dns_cache is the cache learning the address of host and port after
+  // a successful transfer, if any. The request keeps it alive.
+  DNSCache *dns_cache = nullptr;
+  // host is the host whose address dns_cache should learn.
+  std::string host;
+  // port is the port whose address dns_cache should learn.
+  long port = 0;
+  // res is the response of the transfer.
+  Response *res = nullptr;
+  // body_reserve_max is the maximum number of bytes to reserve for the
+  // body when we know its size in advance from the Content-Length.
+  size_t body_reserve_max = 0;
+  // log_level is the log level.
+  LogLevel log_level = LogLevel::full;
+  // data_type is the type of the data chunks we have not logged yet.
+  curl_infotype data_type = CURLINFO_END;
+  // data_size is the total size of the data chunks we have not logged yet.
+  size_t data_size = 0;
+  // handle is the handle performing the transfer.
+  CURL *handle = nullptr;
+  // sample_interval_us is the minimum interval between samples.
+  int64_t sample_interval_us = 0;
+  // sample_next is the elapsed time after which we take the next sample.
+  int64_t sample_next = 0;
+  // sample_sink is the optional sink of the samples.
+  const std::function<void(const Sample &)> *sample_sink = nullptr;
+  // certinfo indicates whether we asked cURL for the certificate chain.
+  bool certinfo = false;
+  // body_sink is the optional sink of the body. The request keeps it alive.
+  const std::function<bool(const char *, size_t)> *body_sink = nullptr;
+  // cancellation is the optional cancellation. The request keeps it alive.
+  const Cancellation *cancellation = nullptr;
+};
+
+// mkcurl_log_lines logs each line in the @p size bytes starting at @p data
+// into @p res, prefixing the line with @p prefix, if not empty.
+static void mkcurl_log_lines(Response &res, const char *prefix,
+                             const char *data, size_t size) {
+  size_t prefixsiz = strlen(prefix);
+  while (size > 0) {
+    auto nl = static_cast<const char *>(memchr(data, '\n', size));
+    size_t linesiz = (nl != nullptr) ? (size_t)(nl - data) : size;
+    if (res.compact_logs) {
+      // Write directly into the arena to avoid temporary strings.
+      mkcurl_log_begin(res);
+      if (prefixsiz > 0) {
+        res.log_arena.append(prefix, prefixsiz);
+        res.log_arena += ' ';
+      }
+      res.log_arena.append(data, linesiz);
+      mkcurl_log_end(res);
+    } else {
+      std::string line;
+      line.reserve(prefixsiz + 1 + linesiz);
+      if (prefixsiz > 0) {
+        line.append(prefix, prefixsiz);
+        line += ' ';
+      }
+      line.append(data, linesiz);
+      mkcurl_log(res, std::move(line));
+    }
+    linesiz += (nl != nullptr) ? 1 : 0;  // Also skip the newline
+    data += linesiz;
+    size -= linesiz;
+  }
+}
+
+// mkcurl_flush_data_log logs the data chunks of @p xfer not logged yet.
+static void mkcurl_flush_data_log(mkcurl_xfer &xfer) {
+  const char *prefix = nullptr;
+  switch (xfer.data_type) {
+    case CURLINFO_DATA_IN: prefix = "<data: "; break;
+    case CURLINFO_SSL_DATA_IN: prefix = "<tls_data: "; break;
+    case CURLINFO_DATA_OUT: prefix = ">data: "; break;
+    case CURLINFO_SSL_DATA_OUT: prefix = ">tls_data: "; break;
+    default: return;
+  }
+  mkcurl_log(*xfer.res, prefix + std::to_string(xfer.data_size));
+  xfer.data_type = CURLINFO_END;
+  xfer.data_size = 0;
+}
+
+// mkcurl_debug_log logs the @p size bytes at @p data of type @p type
+// received by the debug callback of @p xfer, honouring the log level.
+static void mkcurl_debug_log(mkcurl_xfer &xfer, curl_infotype type,
+                             const char *data, size_t size) {
+  switch (type) {
+    case CURLINFO_DATA_IN:
+    case CURLINFO_SSL_DATA_IN:
+    case CURLINFO_DATA_OUT:
+    case CURLINFO_SSL_DATA_OUT:
+      if (xfer.log_level == LogLevel::full) {
+        if (xfer.data_type != type) {
+          mkcurl_flush_data_log(xfer);
+          xfer.data_type = type;
+        }
+        // Implementation note: overflow is unlikely, so we don't care.
+        xfer.data_size += size;
+      }
+      return;
+    case CURLINFO_TEXT:
+    case CURLINFO_HEADER_IN:
+    case CURLINFO_HEADER_OUT:
+      if (xfer.log_level != LogLevel::none) {
+        mkcurl_flush_data_log(xfer);
+        const char *prefix = (type == CURLINFO_HEADER_IN)
+                                 ? "<"
+                                 : (type == CURLINFO_HEADER_OUT) ? ">" : "";
+        mkcurl_log_lines(*xfer.res, prefix, data, size);
+      }
+      return;
+    case CURLINFO_END:
+      return;
+  }
+}
+
+// mkcurl_parse_header adds the header @p line of @p size bytes, as passed
+// to the header callback, to the header entries of @p res. A status line
+// starts the headers of a new response. @return true if we added a new
+// entry at the end of the header entries, false otherwise.
+static bool mkcurl_parse_header(
+    Response &res, const char *line, size_t size) {
+  while (size > 0 && (line[size - 1] == '\r' || line[size - 1] == '\n' ||
+                      line[size - 1] == ' ' || line[size - 1] == '\t')) {
+    --size;
+  }
+  if (size <= 0) {
+    return false;  // The empty line after the headers
+  }
+  if (size >= 5 && memcmp(line, "HTTP/", 5) == 0) {
+    res.header_hops += 1;
+    return false;
+  }
+  if (res.header_hops <= 0) {
+    return false;  // We need a status line first
+  }
+  if (line[0] == ' ' || line[0] == '\t') {
+    // This is an obsolete continuation of the previous header value, which
+    // is the last thing in the arena, hence we can extend it.
+    if (!res.header_entries.empty() &&
+        res.header_entries.back().hop == res.header_hops - 1) {
+      size_t i = 0;
+      while (i < size && (line[i] == ' ' || line[i] == '\t')) ++i;
+      res.header_arena += ' ';
+      res.header_arena.append(line + i, size - i);
+      res.header_entries.back().value_size += size - i + 1;
+    }
+    return false;
+  }
+  auto colon = (const char *)memchr(line, ':', size);
+  if (colon == nullptr || colon == line) {
+    return false;  // Not a valid header
+  }
+  HeaderEntry entry;
+  entry.hop = res.header_hops - 1;
+  entry.name_offset = res.header_arena.size();
+  entry.name_size = (size_t)(colon - line);
+  for (size_t i = 0; i < entry.name_size; ++i) {
+    res.header_arena += (char)tolower((unsigned char)line[i]);
+  }
+  size_t i = entry.name_size + 1;
+  while (i < size && (line[i] == ' ' || line[i] == '\t')) ++i;
+  entry.value_offset = res.header_arena.size();
+  entry.value_size = size - i;
+  res.header_arena.append(line + i, size - i);
+  res.header_entries.push_back(entry);
+  return true;
+}
+
+// mkcurl_parse_decimal parses the @p size bytes starting at @p data, which
+// must all be decimal digits, into @p value. @return false if they are not
+// or if the value does not fit into an int64_t, true otherwise.
+static bool mkcurl_parse_decimal(
+    const char *data, size_t size, int64_t &value) noexcept {
+  if (size <= 0) {
+    return false;
+  }
+  int64_t result = 0;
+  for (size_t i = 0; i < size; ++i) {
+    if (data[i] < '0' || data[i] > '9') {
+      return false;
+    }
+    int64_t digit = data[i] - '0';
+    if (result > (INT64_MAX - digit) / 10) {
+      return false;
+    }
+    result = result * 10 + digit;
+  }
+  value = result;
+  return true;
+}
+
+// mkcurl_content_length returns whether the header @p entry of @p res is
+// a valid Content-Length header and, if so, sets @p length.
+static bool mkcurl_content_length(const Response &res, const HeaderEntry &entry,
+                                  int64_t &length) noexcept {
+  static const char name[] = "content-length";
+  return entry.name_size == sizeof(name) - 1 &&
+         res.header_arena.compare(entry.name_offset, entry.name_size,
+                                  name) == 0 &&
+         mkcurl_parse_decimal(res.header_arena.data() + entry.value_offset,
+                              entry.value_size, length);
+}
+
 }  // inline namespace MKCURL_INLINE_NAMESPACE
 }  // namespace curl
 }  // namespace mk
@@ -268,72 +1722,184 @@ static size_t mkcurl_body_cb_(
   }
   auto realsiz = size * nmemb;  // Overflow or zero not possible (see above)
   auto res = static_cast<mk::curl::Response *>(userdata);
-  res->body += std::string{ptr, realsiz};
+  MKCURL_COUNT(body_callbacks, 1);
+  res->body.append(ptr, realsiz);
+  res->body_bytes_decoded += (int64_t)realsiz;
   // From fwrite(3): "[the return value] equals the number of bytes
   // written _only_ when `size` equals `1`". See also
   // https://sourceware.org/git/?p=glibc.git;a=blob;f=libio/iofwrite.c;h=800341b7da546e5b7fd2005c5536f4c90037f50d;hb=HEAD#l29
   return nmemb;
 }
 
-static int mkcurl_debug_cb_(CURL *handle,
-                            curl_infotype type,
-                            char *data,
-                            size_t size,
-                            void *userptr) {
-  (void)handle;
-  if (data == nullptr || userptr == nullptr) {
+static size_t mkcurl_body_sink_cb_(
+    char *ptr, size_t size, size_t nmemb, void *userdata) {
+  if (nmemb <= 0) {
+    return 0;  // This means "no body"
+  }
+  if (size > SIZE_MAX / nmemb) {
+    // If size is zero we end up into this branch.
+    return 0;
+  }
+  if (ptr == nullptr || userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto realsiz = size * nmemb;  // Overflow or zero not possible (see above)
+  auto xfer = static_cast<mk::curl::mkcurl_xfer *>(userdata);
+  if (xfer->body_sink == nullptr || xfer->res == nullptr) {
     MKCURL_ABORT();
   }
-  auto res = static_cast<mk::curl::Response *>(userptr);
+  MKCURL_COUNT(body_callbacks, 1);
+  xfer->res->body_bytes_decoded += (int64_t)realsiz;
+  if (!(*xfer->body_sink)(ptr, realsiz)) {
+    return 0;  // Causes cURL to fail with CURLE_WRITE_ERROR
+  }
+  return nmemb;  // See above comment in mkcurl_body_cb_
+}
 
-  auto log_many_lines = [&](std::string prefix, const std::string &str) {
-    std::stringstream ss;
-    ss << str;
-    std::string line;
-    while (std::getline(ss, line, '\n')) {
-      std::stringstream logline;
-      if (!prefix.empty()) {
-        logline << prefix << " ";
-      }
-      logline << line;
-      mkcurl_log(res->logs, logline.str());
-    }
-  };
+static size_t mkcurl_body_source_cb_(
+    char *ptr, size_t size, size_t nitems, void *userdata) {
+  if (nitems <= 0) {
+    return 0;  // This means "end of body"
+  }
+  if (size > SIZE_MAX / nitems) {
+    // If size is zero we end up into this branch.
+    return CURL_READFUNC_ABORT;
+  }
+  if (ptr == nullptr || userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto realsiz = size * nitems;  // Overflow or zero not possible (see above)
+  using body_source = decltype(mk::curl::Request::body_source);
+  auto source = static_cast<const body_source *>(userdata);
+  size_t count = (*source)(ptr, realsiz);
+  if (count > realsiz) {
+    return CURL_READFUNC_ABORT;
+  }
+  // Unlike the write callback, the read callback returns bytes.
+  return count;
+}
 
-  switch (type) {
-    case CURLINFO_TEXT:
-      log_many_lines("", std::string{(const char *)data, size});
-      break;
-    case CURLINFO_HEADER_IN:
-      {
-        std::string s{(const char *)data, size};
-        log_many_lines("<", s);
-        res->response_headers += s;
-      }
-      break;
-    case CURLINFO_DATA_IN:
-      log_many_lines("<data:", std::to_string(size));
-      break;
-    case CURLINFO_SSL_DATA_IN:
-      log_many_lines("<tls_data:", std::to_string(size));
+static int mkcurl_body_source_seek_cb_(
+    void *userdata, curl_off_t offset, int origin) {
+  if (userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  if (origin != SEEK_SET || offset < 0) {
+    return CURL_SEEKFUNC_CANTSEEK;  // cURL only rewinds from the start
+  }
+  using body_source_rewind = decltype(mk::curl::Request::body_source_rewind);
+  auto rewind = static_cast<const body_source_rewind *>(userdata);
+  return (*rewind)((int64_t)offset) ? CURL_SEEKFUNC_OK
+                                    : CURL_SEEKFUNC_CANTSEEK;
+}
+
+static size_t mkcurl_header_cb_(
+    char *ptr, size_t size, size_t nmemb, void *userdata) {
+  if (nmemb <= 0) {
+    return 0;  // This means "no header"
+  }
+  if (size > SIZE_MAX / nmemb) {
+    // If size is zero we end up into this branch.
+    return 0;
+  }
+  if (ptr == nullptr || userdata == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto realsiz = size * nmemb;  // Overflow or zero not possible (see above)
+  auto xfer = static_cast<mk::curl::mkcurl_xfer *>(userdata);
+  mk::curl::Response &res = *xfer->res;
+  int64_t length = 0;
+  // We always parse the headers, but we only reserve when we accumulate
+  // the body into the response and reserving is enabled.
+  if (mk::curl::mkcurl_parse_header(res, ptr, realsiz) &&
+      xfer->body_sink == nullptr && xfer->body_reserve_max > 0 &&
+      mk::curl::mkcurl_content_length(res, res.header_entries.back(),
+                                      length)) {
+    // Implementation note: cURL passes us the headers of all the responses,
+    // including redirects, but reserving more than needed is harmless.
+    res.body.reserve((size_t)(std::min)(
+        (uint64_t)length, (uint64_t)xfer->body_reserve_max));
+  }
+  // Unlike the write callback, the header callback returns bytes.
+  return realsiz;
+}
+
+static int mkcurl_xferinfo_cb_(void *clientp, curl_off_t dltotal,
+                               curl_off_t dlnow, curl_off_t ultotal,
+                               curl_off_t ulnow) {
+  (void)dltotal;
+  (void)ultotal;
+  if (clientp == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto xfer = static_cast<mk::curl::mkcurl_xfer *>(clientp);
+  if (xfer->cancellation != nullptr && xfer->cancellation->cancelled()) {
+    return 1;  // Causes cURL to fail with CURLE_ABORTED_BY_CALLBACK
+  }
+  if (xfer->sample_interval_us <= 0) {
+    return 0;
+  }
+  curl_off_t elapsed = 0;
+  if (xfer->handle == nullptr ||
+      curl_easy_getinfo(xfer->handle, CURLINFO_TOTAL_TIME_T, &elapsed) !=
+          CURLE_OK) {
+    return 0;  // Not a good reason for interrupting the transfer
+  }
+  if (elapsed + xfer->sample_interval_us < xfer->sample_next) {
+    xfer->sample_next = 0;  // This is a new attempt
+  }
+  if (elapsed < xfer->sample_next) {
+    return 0;
+  }
+  xfer->sample_next = elapsed + xfer->sample_interval_us;
+  mk::curl::Sample sample;
+  sample.elapsed_us = (int64_t)elapsed;
+  sample.bytes_recv = (int64_t)dlnow;
+  sample.bytes_sent = (int64_t)ulnow;
+  if (xfer->sample_sink != nullptr) {
+    (*xfer->sample_sink)(sample);
+  } else {
+    xfer->res->samples.push_back(sample);
+  }
+  return 0;
+}
+
+static int mkcurl_debug_cb_(CURL *handle,
+                            curl_infotype type,
+                            char *data,
+                            size_t size,
+                            void *userptr) {
+  (void)handle;
+  if (data == nullptr || userptr == nullptr) {
+    MKCURL_ABORT();
+  }
+  auto xfer = static_cast<mk::curl::mkcurl_xfer *>(userptr);
+  auto res = xfer->res;
+  MKCURL_COUNT(debug_callbacks, 1);
+
+  switch (type) {
+    case CURLINFO_HEADER_IN:
+      res->response_headers.append(data, size);
       break;
     case CURLINFO_HEADER_OUT:
-      {
-        std::string s{(const char *)data, size};
-        log_many_lines(">", s);
-        res->request_headers += s;
+      res->request_headers.append(data, size);
+      break;
+    case CURLINFO_TEXT:
+      // cURL 7.x logs "re-using" while cURL 8.x logs "reusing".
+      if ((size >= 20 && memcmp(data, "SSL re-using session", 20) == 0) ||
+          (size >= 19 && memcmp(data, "SSL reusing session", 19) == 0)) {
+        res->tls_session_resumed = true;
       }
       break;
+    case CURLINFO_DATA_IN:
+    case CURLINFO_SSL_DATA_IN:
     case CURLINFO_DATA_OUT:
-      log_many_lines(">data:", std::to_string(size));
-      break;
     case CURLINFO_SSL_DATA_OUT:
-      log_many_lines(">tls_data:", std::to_string(size));
-      break;
     case CURLINFO_END:
       /* NOTHING */
       break;
   }
+  mk::curl::mkcurl_debug_log(*xfer, type, data, size);
 
   // Note regarding counting TLS data
   // ````````````````````````````````
@@ -380,6 +1946,25 @@ static int mkcurl_debug_cb_(CURL *handle,
   return 0;
 }
 
+static void mkcurl_share_lock_cb_(CURL *handle, curl_lock_data data,
+                                  curl_lock_access access, void *userptr) {
+  (void)handle;
+  (void)access;
+  if (data < 0 || data >= CURL_LOCK_DATA_LAST || userptr == nullptr) {
+    MKCURL_ABORT();
+  }
+  static_cast<std::mutex *>(userptr)[data].lock();
+}
+
+static void mkcurl_share_unlock_cb_(
+    CURL *handle, curl_lock_data data, void *userptr) {
+  (void)handle;
+  if (data < 0 || data >= CURL_LOCK_DATA_LAST || userptr == nullptr) {
+    MKCURL_ABORT();
+  }
+  static_cast<std::mutex *>(userptr)[data].unlock();
+}
+
 }  // extern "C"
 
 namespace mk {
@@ -401,43 +1986,338 @@ static const char *HTTPVersionString(long httpv) noexcept {
   return "";
 }
 
-// perform_and_retry performs the request implied by @p handle for
-// @p retries times. A request is only retried if (a) it failed and (b)
-// the reason for failure is either DNS or connect error.
-static CURLcode perform_and_retry(
-    CURL *handlep, size_t retries, std::vector<Log> &logs) noexcept {
-  CURLcode rv{};
-  bool retriable{};
+// mkcurl_is_transient returns true if @p rv is either a DNS or a connect
+// error, that is, a failure that happens before sending the request.
+static bool mkcurl_is_transient(CURLcode rv) noexcept {
+  return rv == CURLE_COULDNT_CONNECT || rv == CURLE_COULDNT_RESOLVE_HOST;
+}
+
+// mkcurl_is_retriable returns true if @p rv is an error for which
+// @p policy says that we should retry.
+static bool mkcurl_is_retriable(
+    const RetryPolicy &policy, CURLcode rv) noexcept {
+  if (policy.retriable_errors.empty()) {
+    return mkcurl_is_transient(rv) || rv == CURLE_OPERATION_TIMEDOUT ||
+           rv == CURLE_SEND_ERROR || rv == CURLE_RECV_ERROR ||
+           rv == CURLE_GOT_NOTHING;
+  }
+  return std::find(policy.retriable_errors.begin(),
+                   policy.retriable_errors.end(),
+                   (int64_t)rv) != policy.retriable_errors.end();
+}
+
+// mkcurl_random returns a pseudo random number. Since we only use it for
+// jitter, we do not need a strong generator, but it must be thread safe.
+static uint64_t mkcurl_random() noexcept {
+  static std::atomic<uint64_t> state{(uint64_t)mkcurl_now()};
+  // This is splitmix64 <http://xoshiro.di.unimi.it/splitmix64.c>.
+  uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// mkcurl_backoff returns the delay in milliseconds before the retry number
+// @p retry, starting from zero, according to @p policy.
+static int64_t mkcurl_backoff(
+    const RetryPolicy &policy, size_t retry) noexcept {
+  int64_t max = (std::max)(policy.max_backoff_ms, (int64_t)0);
+  int64_t delay = (std::max)(policy.initial_backoff_ms, (int64_t)0);
+  delay = (std::min)(delay, max);
+  for (; retry > 0 && delay < max; --retry) {
+    delay = (delay > max / 2) ? max : delay * 2;
+  }
+  double jitter = (std::min)((std::max)(policy.jitter, 0.0), 1.0);
+  double random = (double)(mkcurl_random() >> 11) / (double)(1ULL << 53);
+  return delay - (int64_t)((double)delay * jitter * random);
+}
+
+// mkcurl_retry records into @p res the attempt at performing @p req using
+// @p handlep that failed with @p rv, started @p attempt_start milliseconds
+// and the first attempt @p first_start milliseconds after the epoch of the
+// steady clock. Then decides whether to retry, given that we have already
+// retried @p retry times. If so, it sets @p delay_ms to the milliseconds to
+// wait before retrying, resets @p res for the next attempt, and returns true.
+static bool mkcurl_retry(CURL *handlep, const Request &req, CURLcode rv,
+                         size_t retry, int64_t first_start,
+                         int64_t attempt_start, Response &res,
+                         int64_t &delay_ms) noexcept {
+  const RetryPolicy &policy = req.retry_policy;
+  Attempt attempt;
+  attempt.error = rv;
+  int64_t now = mkcurl_now();
+  attempt.elapsed_ms = now - attempt_start;
+  if (rv == CURLE_OK) {
+    long status_code = 0;
+    if (curl_easy_getinfo(handlep, CURLINFO_RESPONSE_CODE, &status_code) ==
+        CURLE_OK) {
+      attempt.status_code = (int64_t)status_code;
+    }
+  }
+  res.attempts.push_back(attempt);
+  if (retry >= req.retries ||
+      (req.cancellation && req.cancellation->cancelled())) {
+    return false;
+  }
+  bool idempotent = policy.retry_non_idempotent ||
+                    (req.method != "POST" && !req.body_sink &&
+                     !req.body_source);
+  bool retriable = false;
+  if (rv != CURLE_OK) {
+    retriable = idempotent ? mkcurl_is_retriable(policy, rv)
+                           : (mkcurl_is_transient(rv) &&
+                              mkcurl_is_retriable(policy, rv));
+  } else if (idempotent) {
+    retriable = std::find(policy.retriable_statuses.begin(),
+                          policy.retriable_statuses.end(),
+                          attempt.status_code) !=
+                policy.retriable_statuses.end();
+  }
+  if (!retriable) {
+    return false;
+  }
+  delay_ms = mkcurl_backoff(policy, retry);
+  std::string value;
+  int64_t seconds = 0;
+  // We do not parse the HTTP dates that Retry-After may also contain.
+  if (policy.honour_retry_after && rv == CURLE_OK &&
+      find_header(res, "retry-after", value) &&
+      mkcurl_parse_decimal(value.data(), value.size(), seconds)) {
+    if (seconds > policy.max_retry_after_ms / 1000) {
+      mkcurl_log(res, "Not retrying because Retry-After exceeds "
+                      "max_retry_after_ms");
+      return false;
+    }
+    delay_ms = (std::max)(delay_ms, seconds * 1000);
+  }
+  // Without max_elapsed_ms, the request timeout bounds the time we spend
+  // retrying, so that retries do not defeat the purpose of the timeout.
+  int64_t max_elapsed_ms = policy.max_elapsed_ms;
+  if (max_elapsed_ms <= 0 && req.timeout_ms > 0) {
+    max_elapsed_ms = req.timeout_ms;
+  } else if (max_elapsed_ms <= 0 && req.timeout > 0 &&
+             req.timeout < INT64_MAX / 1000) {
+    max_elapsed_ms = req.timeout * 1000;
+  }
+  if (max_elapsed_ms > 0 &&
+      (delay_ms > max_elapsed_ms ||
+       now - first_start > max_elapsed_ms - delay_ms)) {
+    mkcurl_log(res, (policy.max_elapsed_ms > 0)
+                        ? "Not retrying because we would exceed max_elapsed_ms"
+                        : "Not retrying because we would exceed the timeout");
+    return false;
+  }
+  // Unless we failed before sending the request, cURL has already read
+  // from the body_source, hence we must rewind it to send it again.
+  if (req.body_source && !mkcurl_is_transient(rv) &&
+      (!req.body_source_rewind || !req.body_source_rewind(0))) {
+    mkcurl_log(res, "Not retrying because we cannot rewind the body_source");
+    return false;
+  }
+  res.attempts.back().delay_ms = delay_ms;
+  // Start the next attempt from a clean state. We keep the logs and the
+  // byte counters, which account for all the attempts.
+  res.body.clear();
+  res.request_headers.clear();
+  res.response_headers.clear();
+  res.samples.clear();
+  res.header_arena.clear();
+  res.header_entries.clear();
+  res.header_hops = 0;
+  res.body_bytes_decoded = 0;
+  res.tls_session_resumed = false;
+  std::stringstream ss;
+  ss << "Transient failure; let's try one more time in " << delay_ms << " ms";
+  mkcurl_log(res, ss.str());
+  MKCURL_COUNT(retries, 1);
+  return true;
+}
+
+// mkcurl_cancel_check_ms is how often we check whether a request waiting
+// to be retried has been cancelled.
+constexpr int64_t mkcurl_cancel_check_ms = 100;
+
+// mkcurl_sleep_before_retry sleeps for @p delay_ms milliseconds before
+// retrying @p req. @return false if @p req was cancelled meanwhile.
+static bool mkcurl_sleep_before_retry(
+    const Request &req, int64_t delay_ms) noexcept {
+  int64_t deadline = mkcurl_now() + delay_ms;
   for (;;) {
+    if (req.cancellation && req.cancellation->cancelled()) {
+      return false;
+    }
+    int64_t left = deadline - mkcurl_now();
+    if (left <= 0) {
+      return true;
+    }
+    if (req.cancellation) {
+      left = (std::min)(left, mkcurl_cancel_check_ms);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(left));
+  }
+}
+
+// perform_and_retry performs the request @p req implied by @p handle and
+// @p xfer and retries according to the request retry policy.
+static CURLcode perform_and_retry(CURL *handlep, const Request &req,
+                                  mkcurl_xfer &xfer, Response &res) noexcept {
+  CURLcode rv{};
+  int64_t first_start = mkcurl_now();
+  for (size_t retry = 0;; ++retry) {
+    int64_t attempt_start = mkcurl_now();
     rv = curl_easy_perform(handlep);
     MKCURL_HOOK(curl_easy_perform, rv);
-    retriable = retries-- > 0 && (rv == CURLE_COULDNT_CONNECT ||
-                                  rv == CURLE_COULDNT_RESOLVE_HOST);
-    if (!retriable) {
+    // Log the data of this attempt before deciding whether to retry.
+    mkcurl_flush_data_log(xfer);
+    int64_t delay_ms = 0;
+    if (!mkcurl_retry(handlep, req, rv, retry, first_start, attempt_start,
+                      res, delay_ms)) {
+      break;
+    }
+    if (!mkcurl_sleep_before_retry(req, delay_ms)) {
+      mkcurl_log_failure(res, "Cancelled while waiting to retry");
+      rv = CURLE_ABORTED_BY_CALLBACK;
       break;
     }
-    mkcurl_log(logs, "Transient failure; let's try one more time");
   }
   return rv;
 }
 
-// perform2 will use @p handle to perform @p req. If @p handle is not set
-// we will initialise it. Otherwise the @p handle argument options are
-// reset to allow constructing a fresh HTTP request. Still, in such case, we'll
-// reuse existing connections etc. @return the response.
-static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
-  Response res;
+// mkcurl_prepare prepares @p res to receive the logs of @p req.
+static void mkcurl_prepare(const Request &req, Response &res) {
+  res.compact_logs = req.compact_logs;
+  if (res.compact_logs) {
+    res.log_arena.reserve(req.log_arena_reserve);
+    // Roughly estimate the number of lines from the arena size.
+    res.log_entries.reserve(req.log_arena_reserve / 64);
+  }
+}
+
+// mkcurl_init initialises @p handle, unless it is already initialised. If
+// @p share is not null, the new handle will use @p share. (We only need to
+// do this once, because curl_easy_reset() does not change the share.) On
+// failure, it sets @p res error and logs the reason of the failure.
+static void mkcurl_init(
+    mkcurl_uptr &handle, CURLSH *share, Response &res) noexcept {
   if (!handle) {
     CURL *handlep = curl_easy_init();
     MKCURL_HOOK_ALLOC(curl_easy_init, handlep, curl_easy_cleanup);
     handle.reset(handlep);
     if (!handle) {
       res.error = CURLE_OUT_OF_MEMORY;
-      mkcurl_log(res.logs, "curl_easy_init() failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_init() failed");
+      return;
+    }
+    MKCURL_COUNT(live_handles, 1);
+    if (share != nullptr) {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_SHARE, share);
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_SHARE, res.error);
+      if (res.error != CURLE_OK) {
+        handle.reset();  // Make sure we'll try again next time
+        mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_SHARE) failed");
+        return;
+      }
+    }
+  }
+}
+
+// mkcurl_parse_url parses the lowercase @p host and the @p port of @p url.
+// The host of an IPv6 address is quoted using [ and ]. @return false if the
+// URL is malformed or the scheme is not HTTP and there is no port.
+static bool mkcurl_parse_url(
+    const std::string &url, std::string &host, long &port) noexcept {
+  size_t pos = url.find("://");
+  if (pos == std::string::npos) {
+    return false;
+  }
+  std::string scheme = url.substr(0, pos);
+  auto lower = [](char c) { return (char)tolower((unsigned char)c); };
+  std::transform(scheme.begin(), scheme.end(), scheme.begin(), lower);
+  pos += 3;
+  size_t end = url.find_first_of("/?#", pos);
+  std::string authority = url.substr(pos, end - pos);
+  size_t at = authority.rfind('@');
+  if (at != std::string::npos) {
+    authority = authority.substr(at + 1);
+  }
+  size_t colon = authority.rfind(':');
+  size_t bracket = authority.rfind(']');
+  if (colon == std::string::npos ||
+      (bracket != std::string::npos && colon < bracket)) {
+    port = (scheme == "https") ? 443 : (scheme == "http") ? 80 : 0;
+    colon = authority.size();
+  } else {
+    port = 0;
+    for (size_t i = colon + 1; i < authority.size(); ++i) {
+      if (!isdigit((unsigned char)authority[i]) ||
+          (port = port * 10 + (authority[i] - '0')) > 65535) {
+        return false;
+      }
     }
-    // FALLTHROUGH
   }
+  host = authority.substr(0, colon);
+  std::transform(host.begin(), host.end(), host.begin(), lower);
+  return port > 0 && !host.empty();
+}
+
+// mkcurl_origin returns the lowercase host and the port of @p url joined
+// by a colon, or an empty string if the URL is malformed.
+static std::string mkcurl_origin(const std::string &url) noexcept {
+  std::string host;
+  long port = 0;
+  if (!mkcurl_parse_url(url, host, port)) {
+    return "";
+  }
+  return host + ":" + std::to_string(port);
+}
+
+// mkcurl_pin_addresses computes the @p connect_to and @p resolve settings
+// required to connect to @p addresses rather than to the host in @p url.
+// We do not add the addresses to the DNS cache under the URL host, since
+// cURL may share such entries with other clients. Rather, we connect to a
+// fake host that only cURL's DNS cache knows and whose name depends on the
+// addresses, so that we can reuse connections. The entry expires like any
+// other DNS cache entry, except with cURL older than 7.75.0, which keeps it
+// forever. We only redirect the host and port in @p url, so that following
+// redirects to other origins works as usual. @return false if we cannot
+// determine the host and port to connect to.
+static bool mkcurl_pin_addresses(
+    const std::string &url, const std::vector<std::string> &addresses,
+    std::string &connect_to, std::string &resolve) noexcept {
+  std::string origin;
+  long port = 0;
+  if (!mkcurl_parse_url(url, origin, port)) {
+    return false;
+  }
+  std::string list;
+  for (auto &address : addresses) {
+    if (!list.empty()) list += ",";
+    bool quote = address.find(':') != std::string::npos &&
+                 (address.empty() || address[0] != '[');
+    list += quote ? "[" + address + "]" : address;
+  }
+  uint64_t hash = 14695981039346656037ULL;  // This is FNV-1a
+  for (auto c : list) {
+    hash = (hash ^ (unsigned char)c) * 1099511628211ULL;
+  }
+  std::stringstream host;
+  host << "mkcurl-" << std::hex << hash << ".invalid";
+  std::string suffix = ":" + std::to_string(port);
+  connect_to = origin + suffix + ":" + host.str() + suffix;
+#if LIBCURL_VERSION_NUM >= 0x074b00
+  resolve = "+" + host.str() + suffix + ":" + list;
+#else
+  resolve = host.str() + suffix + ":" + list;  // Permanent until 7.75.0
+#endif
+  return true;
+}
+
+// mkcurl_setup resets @p handle and configures it to perform @p req. The
+// @p xfer argument will keep the state that must outlive the configuration
+// and @p res is where the response will be written. Therefore both must
+// outlive the transfer. On failure, it sets @p res error.
+static void mkcurl_setup(mkcurl_uptr &handle, const Request &req,
+                         mkcurl_xfer &xfer, Response &res) noexcept {
   /*
    * From <https://curl.haxx.se/libcurl/c/curl_easy_reset.html>:
    *
@@ -452,41 +2332,114 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
    * new request whose options can be set from scratch below.
    */
   curl_easy_reset(handle.get());
-  mkcurl_slist headers;  // This must have function scope
+  // The @p xfer of a PreparedRequest may contain the lists of a previous
+  // setup, which the handle does not use anymore after curl_easy_reset().
+  curl_slist_free_all(xfer.headers.p);
+  xfer.headers.p = nullptr;
+  curl_slist_free_all(xfer.connect_to_settings.p);
+  xfer.connect_to_settings.p = nullptr;
+  curl_slist_free_all(xfer.resolve_settings.p);
+  xfer.resolve_settings.p = nullptr;
   for (auto &s : req.headers) {
-    curl_slist *slistp = curl_slist_append(headers.p, s.c_str());
+    curl_slist *slistp = curl_slist_append(xfer.headers.p, s.c_str());
     MKCURL_HOOK_ALLOC(curl_slist_append_headers, slistp, curl_slist_free_all);
-    if ((headers.p = slistp) == nullptr) {
+    if ((xfer.headers.p = slistp) == nullptr) {
+      res.error = CURLE_OUT_OF_MEMORY;
+      mkcurl_log_failure(res, "curl_slist_append() failed");
+      return;
+    }
+  }
+  std::string connect_to = req.connect_to;
+  std::vector<std::string> addresses = req.connect_addresses;
+  xfer.dns_cache = nullptr;
+  if (addresses.empty() && req.dns_cache) {
+    std::string host;
+    long port = 0;
+    if (mkcurl_parse_url(req.url, host, port)) {
+      addresses = req.dns_cache->lookup(host, port);
+      if (addresses.empty() && req.proxy_url.empty() &&
+          req.dns_cache->learn_ttl_ms() > 0) {
+        // Remember to learn the address after a successful transfer.
+        xfer.dns_cache = req.dns_cache.get();
+        xfer.host = std::move(host);
+        xfer.port = port;
+      }
+    }
+  }
+  if (!addresses.empty()) {
+    std::string resolve;
+    if (!mkcurl_pin_addresses(req.url, addresses, connect_to, resolve)) {
+      res.error = CURLE_URL_MALFORMAT;
+      mkcurl_log_failure(res, "cannot determine the origin to connect to");
+      return;
+    }
+    curl_slist *slistp = curl_slist_append(
+        xfer.resolve_settings.p, resolve.c_str());
+    MKCURL_HOOK_ALLOC(
+        curl_slist_append_resolve, slistp, curl_slist_free_all);
+    if ((xfer.resolve_settings.p = slistp) == nullptr) {
       res.error = CURLE_OUT_OF_MEMORY;
-      mkcurl_log(res.logs, "curl_slist_append() failed");
-      return res;
+      mkcurl_log_failure(res, "curl_slist_append() failed");
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_RESOLVE,
+                                 xfer.resolve_settings.p);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_RESOLVE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_RESOLVE) failed");
+      return;
+    }
+  }
+  if (addresses.empty() && !req.doh_url.empty()) {
+#if LIBCURL_VERSION_NUM >= 0x073e00
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_DOH_URL,
+                                 req.doh_url.c_str());
+#else
+    res.error = CURLE_NOT_BUILT_IN;  // Added in cURL 7.62.0
+#endif
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_DOH_URL, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_DOH_URL) failed");
+      return;
+    }
+  }
+  if (req.happy_eyeballs_timeout_ms >= 0) {
+    long t = (req.happy_eyeballs_timeout_ms < LONG_MAX)
+                 ? (long)req.happy_eyeballs_timeout_ms
+                 : LONG_MAX;
+    res.error = curl_easy_setopt(
+        handle.get(), CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, t);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS) failed");
+      return;
     }
   }
-  mkcurl_slist connect_to_settings;  // This must have function scope
-  if (!req.connect_to.empty()) {
+  if (!connect_to.empty()) {
     curl_slist *slistp = curl_slist_append(
-        connect_to_settings.p, req.connect_to.c_str());
+        xfer.connect_to_settings.p, connect_to.c_str());
     MKCURL_HOOK_ALLOC(
         curl_slist_append_connect_to, slistp, curl_slist_free_all);
-    if ((connect_to_settings.p = slistp) == nullptr) {
+    if ((xfer.connect_to_settings.p = slistp) == nullptr) {
       res.error = CURLE_OUT_OF_MEMORY;
-      mkcurl_log(res.logs, "curl_slist_append() failed");
-      return res;
+      mkcurl_log_failure(res, "curl_slist_append() failed");
+      return;
     }
     res.error = curl_easy_setopt(handle.get(), CURLOPT_CONNECT_TO,
-                                 connect_to_settings.p);
+                                 xfer.connect_to_settings.p);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_CONNECT_TO, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CONNECT_TO) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_CONNECT_TO) failed");
+      return;
     }
   }
   if (req.enable_fastopen) {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_TCP_FASTOPEN, 1L);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_TCP_FASTOPEN, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_TCP_FASTOPEN) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_TCP_FASTOPEN) failed");
+      return;
     }
   }
   if (!req.ca_path.empty()) {
@@ -494,8 +2447,20 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
                                  req.ca_path.c_str());
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_CAINFO, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CAINFO) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_CAINFO) failed");
+      return;
+    }
+  }
+  if (req.enable_compression) {
+    // Note: cURL interprets an empty string as all the encodings it
+    // supports, unlike a null pointer which disables decoding.
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_ACCEPT_ENCODING,
+                                 req.accept_encoding.c_str());
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_ACCEPT_ENCODING, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_ACCEPT_ENCODING) failed");
+      return;
     }
   }
   if (req.enable_http2) {
@@ -503,8 +2468,8 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
                                  CURL_HTTP_VERSION_2_0);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_HTTP_VERSION, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HTTP_VERSION) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_HTTP_VERSION) failed");
+      return;
     }
   }
   if (req.method == "POST" || req.method == "PUT") {
@@ -512,96 +2477,185 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
     // arguments against NOT sending this specific HTTP header by default
     // with P{OS,U}T <https://curl.haxx.se/mail/lib-2017-07/0013.html>.
     {
-      curl_slist *slistp = curl_slist_append(headers.p, "Expect:");
+      curl_slist *slistp = curl_slist_append(xfer.headers.p, "Expect:");
       MKCURL_HOOK_ALLOC(
           curl_slist_append_Expect_header, slistp, curl_slist_free_all);
-      if ((headers.p = slistp) == nullptr) {
+      if ((xfer.headers.p = slistp) == nullptr) {
         res.error = CURLE_OUT_OF_MEMORY;
-        mkcurl_log(res.logs, "curl_slist_append() failed");
-        return res;
+        mkcurl_log_failure(res, "curl_slist_append() failed");
+        return;
       }
     }
     {
       res.error = curl_easy_setopt(handle.get(), CURLOPT_POST, 1L);
       MKCURL_HOOK(curl_easy_setopt_CURLOPT_POST, res.error);
       if (res.error != CURLE_OK) {
-        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_POST) failed");
-        return res;
+        mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_POST) failed");
+        return;
       }
     }
-    {
-      res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDS,
-                                   req.body.c_str());
-      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDS, res.error);
-      if (res.error != CURLE_OK) {
-        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_POSTFIELDS) failed");
-        return res;
+    if (req.body_source) {
+      {
+        res.error = curl_easy_setopt(handle.get(), CURLOPT_READFUNCTION,
+                                     mkcurl_body_source_cb_);
+        MKCURL_HOOK(curl_easy_setopt_CURLOPT_READFUNCTION, res.error);
+        if (res.error != CURLE_OK) {
+          mkcurl_log_failure(res,
+                             "curl_easy_setopt(CURLOPT_READFUNCTION) failed");
+          return;
+        }
       }
-    }
-    // The following is very important to allow us to upload any kind of
-    // binary file, otherwise CURL will use strlen(). We do not need to
-    // send more than 2 GiB of data, hence we can safely limit ourself to
-    // using CURLOPT_POSTFIELDSIZE that takes a `long` argument.
-    {
-      bool body_size_overflow = (req.body.size() > LONG_MAX);
-      MKCURL_HOOK(body_size_overflow_inject, body_size_overflow);
-      if (body_size_overflow) {
-        mkcurl_log(res.logs, "Body larger than LONG_MAX");
-        res.error = CURLE_FILESIZE_EXCEEDED;
-        return res;
-      }
-      res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDSIZE,
-                                   (long)req.body.size());
-      MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE, res.error);
-      if (res.error != CURLE_OK) {
-        mkcurl_log(res.logs, "curl_easy_setopt(MKCURLOPT_POSTFIELDSIZE) failed");
-        return res;
+      {
+        // The request outlives the transfer, hence this is safe.
+        const void *read_data = &req.body_source;
+        res.error = curl_easy_setopt(handle.get(), CURLOPT_READDATA,
+                                     read_data);
+        MKCURL_HOOK(curl_easy_setopt_CURLOPT_READDATA, res.error);
+        if (res.error != CURLE_OK) {
+          mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_READDATA) failed");
+          return;
+        }
+      }
+      if (req.body_source_rewind) {
+        res.error = curl_easy_setopt(handle.get(), CURLOPT_SEEKFUNCTION,
+                                     mkcurl_body_source_seek_cb_);
+        MKCURL_HOOK(curl_easy_setopt_CURLOPT_SEEKFUNCTION, res.error);
+        if (res.error != CURLE_OK) {
+          mkcurl_log_failure(res,
+                             "curl_easy_setopt(CURLOPT_SEEKFUNCTION) failed");
+          return;
+        }
+        // Like for CURLOPT_READDATA, the request outlives the transfer.
+        const void *seek_data = &req.body_source_rewind;
+        res.error = curl_easy_setopt(handle.get(), CURLOPT_SEEKDATA,
+                                     seek_data);
+        MKCURL_HOOK(curl_easy_setopt_CURLOPT_SEEKDATA, res.error);
+        if (res.error != CURLE_OK) {
+          mkcurl_log_failure(res,
+                             "curl_easy_setopt(CURLOPT_SEEKDATA) failed");
+          return;
+        }
+      }
+      // When we don't know the size, cURL uses chunked encoding with
+      // HTTP/1.1 and does not need to know the size with HTTP/2.
+      if (req.body_source_size >= 0) {
+        res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDSIZE_LARGE,
+                                     (curl_off_t)req.body_source_size);
+        MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE_LARGE, res.error);
+        if (res.error != CURLE_OK) {
+          mkcurl_log_failure(res,
+                     "curl_easy_setopt(CURLOPT_POSTFIELDSIZE_LARGE) failed");
+          return;
+        }
+      }
+    } else {
+      {
+        res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDS,
+                                     req.body.c_str());
+        MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDS, res.error);
+        if (res.error != CURLE_OK) {
+          mkcurl_log_failure(res,
+                             "curl_easy_setopt(CURLOPT_POSTFIELDS) failed");
+          return;
+        }
+      }
+      // The following is very important to allow us to upload any kind of
+      // binary file, otherwise CURL will use strlen(). We do not need to
+      // send more than 2 GiB of data, hence we can safely limit ourself to
+      // using CURLOPT_POSTFIELDSIZE that takes a `long` argument.
+      {
+        bool body_size_overflow = (req.body.size() > LONG_MAX);
+        MKCURL_HOOK(body_size_overflow_inject, body_size_overflow);
+        if (body_size_overflow) {
+          mkcurl_log_failure(res, "Body larger than LONG_MAX");
+          res.error = CURLE_FILESIZE_EXCEEDED;
+          return;
+        }
+        res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDSIZE,
+                                     (long)req.body.size());
+        MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE, res.error);
+        if (res.error != CURLE_OK) {
+          mkcurl_log_failure(res,
+                     "curl_easy_setopt(MKCURLOPT_POSTFIELDSIZE) failed");
+          return;
+        }
       }
     }
     if (req.method == "PUT") {
       res.error = curl_easy_setopt(handle.get(), CURLOPT_CUSTOMREQUEST, "PUT");
       MKCURL_HOOK(curl_easy_setopt_CURLOPT_CUSTOMREQUEST, res.error);
       if (res.error) {
-        mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CUSTOMREQUEST) failed");
-        return res;
+        mkcurl_log_failure(
+            res, "curl_easy_setopt(CURLOPT_CUSTOMREQUEST) failed");
+        return;
       }
     }
   } else if (req.method != "GET") {
     res.error = CURLE_BAD_FUNCTION_ARGUMENT;
-    mkcurl_log(res.logs, "unsupported request method");
-    return res;
+    mkcurl_log_failure(res, "unsupported request method");
+    return;
   }
-  if (headers.p != nullptr) {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_HTTPHEADER, headers.p);
+  if (xfer.headers.p != nullptr) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_HTTPHEADER,
+                                 xfer.headers.p);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_HTTPHEADER, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_HTTPHEADER) failed");
+      return;
     }
   }
   {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_URL, req.url.c_str());
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_URL, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_URL) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_URL) failed");
+      return;
+    }
+  }
+  xfer.res = &res;
+  xfer.body_reserve_max = req.body_reserve_max;
+  xfer.log_level = req.log_level;
+  {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_HEADERFUNCTION,
+                                 mkcurl_header_cb_);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HEADERFUNCTION, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_HEADERFUNCTION) failed");
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_HEADERDATA, &xfer);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_HEADERDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_HEADERDATA) failed");
+      return;
     }
   }
+  // When there is a body sink, we pass it the body rather than accumulating
+  // the body into the response. The request outlives the transfer.
+  curl_write_callback write_cb = mkcurl_body_cb_;
+  const void *write_data = &res;
+  xfer.body_sink = nullptr;
+  if (req.body_sink) {
+    write_cb = mkcurl_body_sink_cb_;
+    write_data = &xfer;
+    xfer.body_sink = &req.body_sink;
+  }
   {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION,
-                                 mkcurl_body_cb_);
+                                 write_cb);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_WRITEFUNCTION, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_WRITEFUNCTION) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_WRITEFUNCTION) failed");
+      return;
     }
   }
   {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &res);
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, write_data);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_WRITEDATA, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_WRITEDATA) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_WRITEDATA) failed");
+      return;
     }
   }
   // CURL uses MSG_NOSIGNAL where available (i.e. Linux) and SO_NOSIGPIPE
@@ -619,8 +2673,8 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_NOSIGNAL, 1L);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_NOSIGNAL) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_NOSIGNAL) failed");
+      return;
     }
   }
   {
@@ -629,8 +2683,54 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_TIMEOUT, t);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_TIMEOUT, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_TIMEOUT) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_TIMEOUT) failed");
+      return;
+    }
+  }
+  if (req.timeout_ms > 0) {
+    // Note: when both are set, the last one set takes precedence.
+    long t = (req.timeout_ms < LONG_MAX) ? (long)req.timeout_ms : LONG_MAX;
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_TIMEOUT_MS, t);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TIMEOUT_MS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_TIMEOUT_MS) failed");
+      return;
+    }
+  }
+  if (req.connect_timeout_ms > 0) {
+    long t = (req.connect_timeout_ms < LONG_MAX)
+                 ? (long)req.connect_timeout_ms
+                 : LONG_MAX;
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_CONNECTTIMEOUT_MS, t);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_CONNECTTIMEOUT_MS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_CONNECTTIMEOUT_MS) failed");
+      return;
+    }
+  }
+  if (req.low_speed_limit > 0 && req.low_speed_time > 0) {
+    if (req.low_speed_limit > LONG_MAX || req.low_speed_time > LONG_MAX) {
+      mkcurl_log_failure(
+          res, "low_speed_limit or low_speed_time larger than LONG_MAX");
+      res.error = CURLE_BAD_FUNCTION_ARGUMENT;
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_LIMIT,
+                                 (long)req.low_speed_limit);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_LOW_SPEED_LIMIT, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_LOW_SPEED_LIMIT) failed");
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_TIME,
+                                 (long)req.low_speed_time);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_LOW_SPEED_TIME, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_LOW_SPEED_TIME) failed");
+      return;
     }
   }
   {
@@ -638,24 +2738,24 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
                                  mkcurl_debug_cb_);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_DEBUGFUNCTION, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_DEBUGFUNCTION) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_DEBUGFUNCTION) failed");
+      return;
     }
   }
   {
-    res.error = curl_easy_setopt(handle.get(), CURLOPT_DEBUGDATA, &res);
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_DEBUGDATA, &xfer);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_DEBUGDATA, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_DEBUGDATA) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_DEBUGDATA) failed");
+      return;
     }
   }
   {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_VERBOSE, 1L);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_VERBOSE, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_VERBOSE) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_VERBOSE) failed");
+      return;
     }
   }
   if (!req.proxy_url.empty()) {
@@ -663,43 +2763,211 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
                                  req.proxy_url.c_str());
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_PROXY, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_PROXY) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_PROXY) failed");
+      return;
     }
   }
   if (req.follow_redir) {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_FOLLOWLOCATION, 1L);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_FOLLOWLOCATION, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_FOLLOWLOCATION) failed");
-      return res;
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_FOLLOWLOCATION) failed");
+      return;
     }
   }
-  {
+  if (req.enable_certinfo) {
     res.error = curl_easy_setopt(handle.get(), CURLOPT_CERTINFO, 1L);
     MKCURL_HOOK(curl_easy_setopt_CURLOPT_CERTINFO, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_setopt(CURLOPT_CERTINFO) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_CERTINFO) failed");
+      return;
+    }
+  }
+  xfer.certinfo = req.enable_certinfo;
+  xfer.handle = handle.get();
+  xfer.sample_interval_us = req.sample_interval_us;
+  xfer.sample_next = 0;
+  xfer.sample_sink = req.sample_sink ? &req.sample_sink : nullptr;
+  xfer.cancellation = req.cancellation.get();
+  if (req.sample_interval_us > 0 || req.cancellation) {
+    {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION,
+                                   mkcurl_xferinfo_cb_);
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_XFERINFOFUNCTION, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log_failure(
+            res, "curl_easy_setopt(CURLOPT_XFERINFOFUNCTION) failed");
+        return;
+      }
+    }
+    {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &xfer);
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_XFERINFODATA, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log_failure(
+            res, "curl_easy_setopt(CURLOPT_XFERINFODATA) failed");
+        return;
+      }
+    }
+    {
+      res.error = curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+      MKCURL_HOOK(curl_easy_setopt_CURLOPT_NOPROGRESS, res.error);
+      if (res.error != CURLE_OK) {
+        mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_NOPROGRESS) failed");
+        return;
+      }
+    }
+  }
+  if (req.max_recv_speed > 0) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAX_RECV_SPEED_LARGE,
+                                 (curl_off_t)req.max_recv_speed);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAX_RECV_SPEED_LARGE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_MAX_RECV_SPEED_LARGE) failed");
+      return;
+    }
+  }
+  if (req.max_send_speed > 0) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAX_SEND_SPEED_LARGE,
+                                 (curl_off_t)req.max_send_speed);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAX_SEND_SPEED_LARGE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(CURLOPT_MAX_SEND_SPEED_LARGE) failed");
+      return;
+    }
+  }
+}
+
+// mkcurl_timings fills @p res timings using the information available in
+// @p handle after a transfer, including a failed one. On failure, it sets
+// @p res error.
+static void mkcurl_timings(mkcurl_uptr &handle, Response &res) noexcept {
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_NAMELOOKUP_TIME_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_NAMELOOKUP_TIME_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_NAMELOOKUP_TIME_T) failed");
+      return;
+    }
+    res.timings.namelookup = (int64_t)value;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_CONNECT_TIME_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CONNECT_TIME_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_CONNECT_TIME_T) failed");
+      return;
+    }
+    res.timings.connect = (int64_t)value;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_APPCONNECT_TIME_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_APPCONNECT_TIME_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_APPCONNECT_TIME_T) failed");
+      return;
+    }
+    res.timings.appconnect = (int64_t)value;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_PRETRANSFER_TIME_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_PRETRANSFER_TIME_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_PRETRANSFER_TIME_T) failed");
+      return;
+    }
+    res.timings.pretransfer = (int64_t)value;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_STARTTRANSFER_TIME_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_STARTTRANSFER_TIME_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_STARTTRANSFER_TIME_T) failed");
+      return;
+    }
+    res.timings.starttransfer = (int64_t)value;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_TOTAL_TIME_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_TOTAL_TIME_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_TOTAL_TIME_T) failed");
+      return;
     }
+    res.timings.total = (int64_t)value;
   }
   {
-    res.error = perform_and_retry(handle.get(), req.retries, res.logs);
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_REDIRECT_TIME_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_TIME_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_REDIRECT_TIME_T) failed");
+      return;
+    }
+    res.timings.redirect = (int64_t)value;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_SPEED_DOWNLOAD_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_SPEED_DOWNLOAD_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_SPEED_DOWNLOAD_T) failed");
+      return;
+    }
+    res.timings.download_speed = (int64_t)value;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_SPEED_UPLOAD_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_SPEED_UPLOAD_T, res.error);
     if (res.error != CURLE_OK) {
-      std::stringstream ss;
-      ss << "curl_easy_perform: " << curl_easy_strerror((CURLcode)res.error);
-      mkcurl_log(res.logs, ss.str());
-      return res;
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_SPEED_UPLOAD_T) failed");
+      return;
     }
+    res.timings.upload_speed = (int64_t)value;
   }
+}
+
+// mkcurl_finish fills @p res using the information available in @p handle
+// after a successful transfer, including the certificate chain only when
+// @p certinfo_enabled is true. On failure, it sets @p res error.
+static void mkcurl_finish(
+    mkcurl_uptr &handle, bool certinfo_enabled, Response &res) noexcept {
   {
     long status_code = 0;
     res.error = curl_easy_getinfo(
         handle.get(), CURLINFO_RESPONSE_CODE, &status_code);
     MKCURL_HOOK(curl_easy_getinfo_CURLINFO_RESPONSE_CODE, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_RESPONSE_CODE) failed");
-      return res;
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_RESPONSE_CODE) failed");
+      return;
     }
     res.status_code = (int64_t)status_code;
   }
@@ -708,29 +2976,28 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
     res.error = curl_easy_getinfo(handle.get(), CURLINFO_REDIRECT_URL, &url);
     MKCURL_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_URL, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_REDIRECT_URL) failed");
-      return res;
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_REDIRECT_URL) failed");
+      return;
     }
     if (url != nullptr) res.redirect_url = url;
   }
-  {
+  if (certinfo_enabled) {
     curl_certinfo *certinfo = nullptr;
     res.error = curl_easy_getinfo(handle.get(), CURLINFO_CERTINFO, &certinfo);
     MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CERTINFO, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_CERTINFO) failed");
-      return res;
+      mkcurl_log_failure(res, "curl_easy_getinfo(CURLINFO_CERTINFO) failed");
+      return;
     }
     if (certinfo != nullptr && certinfo->num_of_certs > 0) {
       for (int i = 0; i < certinfo->num_of_certs; i++) {
         for (auto slist = certinfo->certinfo[i]; slist; slist = slist->next) {
-          if (slist->data != nullptr) {
-            // Just pass in the certificates and ignore the rest.
-            std::string s = slist->data;
-            if (s.find("Cert:") == 0) {
-              res.certs += s.substr(5);
-              res.certs += "\n";
-            }
+          // Just pass in the certificates and ignore the rest.
+          if (slist->data != nullptr &&
+              strncmp(slist->data, "Cert:", 5) == 0) {
+            res.certs.append(slist->data + 5);
+            res.certs += '\n';
           }
         }
       }
@@ -741,8 +3008,9 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
     res.error = curl_easy_getinfo(handle.get(), CURLINFO_CONTENT_TYPE, &ct);
     MKCURL_HOOK(curl_easy_getinfo_CURLINFO_CONTENT_TYPE, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_CONTENT_TYPE) failed");
-      return res;
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_CONTENT_TYPE) failed");
+      return;
     }
     if (ct != nullptr) res.content_type = ct;
   }
@@ -751,26 +3019,1865 @@ static Response perform2(mkcurl_uptr &handle, const Request &req) noexcept {
     res.error = curl_easy_getinfo(handle.get(), CURLINFO_HTTP_VERSION, &httpv);
     MKCURL_HOOK(curl_easy_getinfo_CURLINFO_HTTP_VERSION, res.error);
     if (res.error != CURLE_OK) {
-      mkcurl_log(res.logs, "curl_easy_getinfo(CURLINFO_HTTP_VERSION) failed");
-      return res;
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_HTTP_VERSION) failed");
+      return;
     }
     res.http_version = HTTPVersionString(httpv);
   }
-  return res;
-}
+  mkcurl_timings(handle, res);
+  if (res.error != CURLE_OK) {
+    return;
+  }
+  {
+    curl_off_t value = 0;
+    res.error = curl_easy_getinfo(
+        handle.get(), CURLINFO_SIZE_DOWNLOAD_T, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_SIZE_DOWNLOAD_T, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_SIZE_DOWNLOAD_T) failed");
+      return;
+    }
+    res.body_bytes_recv = (int64_t)value;
+  }
+  {
+    long value = 0;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_NUM_CONNECTS, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_NUM_CONNECTS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_NUM_CONNECTS) failed");
+      return;
+    }
+    res.num_connects = (int64_t)value;
+    res.connection_reused = (value == 0);
+  }
+  {
+    char *ip = nullptr;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_PRIMARY_IP, &ip);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_IP, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_getinfo(CURLINFO_PRIMARY_IP) failed");
+      return;
+    }
+    if (ip != nullptr) res.primary_ip = ip;
+  }
+  {
+    long value = 0;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_PRIMARY_PORT, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_PORT, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_getinfo(CURLINFO_PRIMARY_PORT) failed");
+      return;
+    }
+    res.primary_port = (int64_t)value;
+  }
+  {
+    char *ip = nullptr;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_LOCAL_IP, &ip);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_IP, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_getinfo(CURLINFO_LOCAL_IP) failed");
+      return;
+    }
+    if (ip != nullptr) res.local_ip = ip;
+  }
+  {
+    long value = 0;
+    res.error = curl_easy_getinfo(handle.get(), CURLINFO_LOCAL_PORT, &value);
+    MKCURL_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_PORT, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_getinfo(CURLINFO_LOCAL_PORT) failed");
+      return;
+    }
+    res.local_port = (int64_t)value;
+  }
+}
+
+// PreparedRequest::Impl contains the implementation of a prepared request.
+class PreparedRequest::Impl {
+ public:
+  // id uniquely identifies this prepared request, so that a client can
+  // tell whether its handle is configured for it, even if a new prepared
+  // request is later allocated at the same address.
+  uint64_t id = 0;
+  Request req;
+  // xfer must outlive the transfers, because the handle has pointers to it.
+  mkcurl_xfer xfer;
+  // handle is the handle configured for this prepared request, which points
+  // to the lists in xfer, or null. When a client configures another handle,
+  // the lists are rebuilt, so this handle must be configured again.
+  CURL *handle = nullptr;
+  // origin is the origin of the URL for which handle was configured.
+  std::string origin;
+  // url_changed and body_changed indicate whether the URL and the body have
+  // changed since handle was configured or patched.
+  bool url_changed = false;
+  bool body_changed = false;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+};
+PreparedRequest::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
+
+// mkcurl_can_patch returns whether we can patch a handle configured for
+// @p req when the URL had @p origin, rather than configuring it again. We
+// cannot when we need to lookup the DNS cache, whose entries may have
+// expired, or when the URL moved to another origin, since the state in the
+// xfer refers to the previous origin. Since the pinned addresses depend on
+// the URL port, we also cannot when @p url_changed and there are
+// connect_addresses.
+static bool mkcurl_can_patch(const Request &req, const std::string &origin,
+                             bool url_changed) noexcept {
+  if (req.dns_cache) {
+    return false;
+  }
+  if (!url_changed) {
+    return true;
+  }
+  return req.connect_addresses.empty() && mkcurl_origin(req.url) == origin;
+}
+
+// mkcurl_patch updates the options of @p handle, already configured for
+// @p req and @p xfer, so that it can be used to fill @p res. It only changes
+// the options that are different between consecutive transfers, plus the
+// URL and body if @p url_changed and @p body_changed, respectively.
+static void mkcurl_patch(mkcurl_uptr &handle, const Request &req,
+                         mkcurl_xfer &xfer, bool url_changed,
+                         bool body_changed, Response &res) noexcept {
+  xfer.res = &res;
+  xfer.data_type = CURLINFO_END;
+  xfer.data_size = 0;
+  xfer.sample_next = 0;
+  if (url_changed) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_URL, req.url.c_str());
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_URL, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_URL) failed");
+      return;
+    }
+  }
+  if (body_changed && !req.body_source &&
+      (req.method == "POST" || req.method == "PUT")) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDS,
+                                 req.body.c_str());
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_POSTFIELDS) failed");
+      return;
+    }
+    if (req.body.size() > LONG_MAX) {
+      mkcurl_log_failure(res, "Body larger than LONG_MAX");
+      res.error = CURLE_FILESIZE_EXCEEDED;
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_POSTFIELDSIZE,
+                                 (long)req.body.size());
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(
+          res, "curl_easy_setopt(MKCURLOPT_POSTFIELDSIZE) failed");
+      return;
+    }
+  }
+  if (!req.body_sink) {
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &res);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_WRITEDATA, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_WRITEDATA) failed");
+      return;
+    }
+  }
+}
+
+// mkcurl_learn adds to the DNS cache of @p xfer the address to which we
+// connected using @p handle, unless we followed redirects. Since we do not
+// want to fail a successful transfer, we don't report failures.
+static void mkcurl_learn(mkcurl_uptr &handle, mkcurl_xfer &xfer) noexcept {
+  long redirects = 0;
+  CURLcode rv = curl_easy_getinfo(
+      handle.get(), CURLINFO_REDIRECT_COUNT, &redirects);
+  MKCURL_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_COUNT, rv);
+  if (rv != CURLE_OK || redirects != 0 || xfer.res->primary_ip.empty()) {
+    return;
+  }
+  xfer.dns_cache->add(xfer.host, xfer.port, {xfer.res->primary_ip},
+                      xfer.dns_cache->learn_ttl_ms());
+}
+
+// mkcurl_complete completes the transfer using @p handle and @p xfer that
+// terminated with @p rv, filling the response on success and just the
+// timings on failure.
+static void mkcurl_complete(
+    mkcurl_uptr &handle, mkcurl_xfer &xfer, CURLcode rv) {
+  Response &res = *xfer.res;
+  mkcurl_flush_data_log(xfer);
+  MKCURL_COUNT(transfers, 1);
+  if ((res.error = rv) != CURLE_OK) {
+    MKCURL_COUNT(failures, 1);
+    mkcurl_log_failure(res, "curl_easy_perform", rv);
+    // The timings tell where a transfer that failed got stuck.
+    mkcurl_timings(handle, res);
+    res.error = rv;
+    return;
+  }
+  mkcurl_finish(handle, xfer.certinfo, res);
+  if (res.error != CURLE_OK) {
+    MKCURL_COUNT(failures, 1);
+    return;
+  }
+  MKCURL_COUNT(connects, (uint64_t)res.num_connects);
+  MKCURL_COUNT(reused, res.connection_reused ? 1 : 0);
+  MKCURL_COUNT(bytes_sent, (uint64_t)res.bytes_sent);
+  MKCURL_COUNT(bytes_recv, (uint64_t)res.bytes_recv);
+  MKCURL_OBSERVE(transfer_us, res.timings.total);
+  if (xfer.dns_cache != nullptr) {
+    mkcurl_learn(handle, xfer);
+  }
+}
+
+// mkcurl_apply_policy configures @p handle, already set up for a request,
+// to manage connections according to @p policy. On failure, it sets @p res
+// error and logs the reason of the failure.
+static void mkcurl_apply_policy(mkcurl_uptr &handle,
+                                const ConnectionPolicy &policy,
+                                Response &res) noexcept {
+  if (policy.max_connections > 0) {
+    if (policy.max_connections > LONG_MAX) {
+      mkcurl_log_failure(res, "max_connections larger than LONG_MAX");
+      res.error = CURLE_BAD_FUNCTION_ARGUMENT;
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAXCONNECTS,
+                                 (long)policy.max_connections);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAXCONNECTS, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_MAXCONNECTS) failed");
+      return;
+    }
+  }
+#if LIBCURL_VERSION_NUM >= 0x074100
+  if (policy.idle_timeout > 0) {
+    if (policy.idle_timeout > LONG_MAX) {
+      mkcurl_log_failure(res, "idle_timeout larger than LONG_MAX");
+      res.error = CURLE_BAD_FUNCTION_ARGUMENT;
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_MAXAGE_CONN,
+                                 (long)policy.idle_timeout);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_MAXAGE_CONN, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_MAXAGE_CONN) failed");
+      return;
+    }
+  }
+#endif
+  if (policy.keepalive_interval > 0) {
+    if (policy.keepalive_interval > LONG_MAX) {
+      mkcurl_log_failure(res, "keepalive_interval larger than LONG_MAX");
+      res.error = CURLE_BAD_FUNCTION_ARGUMENT;
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_TCP_KEEPALIVE, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TCP_KEEPALIVE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_TCP_KEEPALIVE) failed");
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_TCP_KEEPIDLE,
+                                 (long)policy.keepalive_interval);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TCP_KEEPIDLE, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_TCP_KEEPIDLE) failed");
+      return;
+    }
+    res.error = curl_easy_setopt(handle.get(), CURLOPT_TCP_KEEPINTVL,
+                                 (long)policy.keepalive_interval);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_TCP_KEEPINTVL, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_TCP_KEEPINTVL) failed");
+      return;
+    }
+  }
+}
+
+// mkcurl_recycle resets @p res to its default state, except that it keeps
+// the capacity of its buffers so that reusing it does not reallocate them.
+static void mkcurl_recycle(Response &res) noexcept {
+  Response fresh;
+  fresh.body.swap(res.body);
+  fresh.body.clear();
+  fresh.logs.swap(res.logs);
+  fresh.logs.clear();
+  fresh.log_arena.swap(res.log_arena);
+  fresh.log_arena.clear();
+  fresh.log_entries.swap(res.log_entries);
+  fresh.log_entries.clear();
+  fresh.request_headers.swap(res.request_headers);
+  fresh.request_headers.clear();
+  fresh.response_headers.swap(res.response_headers);
+  fresh.response_headers.clear();
+  fresh.header_arena.swap(res.header_arena);
+  fresh.header_arena.clear();
+  fresh.header_entries.swap(res.header_entries);
+  fresh.header_entries.clear();
+  res = std::move(fresh);
+}
+
+// perform2 will use @p handle to perform @p req and fill @p res, which is
+// recycled first. If @p handle is not set we will initialise it, using
+// @p share if not null. Otherwise the @p handle argument options are reset
+// to allow constructing a fresh HTTP request. Still, in such case, we'll
+// reuse existing connections etc, according to @p policy.
+static void perform2(mkcurl_uptr &handle, CURLSH *share, const Request &req,
+                     const ConnectionPolicy &policy, Response &res) noexcept {
+  mkcurl_recycle(res);
+  mkcurl_prepare(req, res);
+  mkcurl_init(handle, share, res);
+  if (res.error != CURLE_OK) {
+    return;
+  }
+  mkcurl_xfer xfer;  // This must have function scope
+  MKCURL_STOPWATCH(setup_start);
+  mkcurl_setup(handle, req, xfer, res);
+  if (res.error == CURLE_OK) {
+    mkcurl_apply_policy(handle, policy, res);
+  }
+  MKCURL_OBSERVE_SINCE(setup_us, setup_start);
+  if (res.error != CURLE_OK) {
+    return;
+  }
+  CURLcode rv = perform_and_retry(handle.get(), req, xfer, res);
+  mkcurl_complete(handle, xfer, rv);
+}
+
+Share::Share() noexcept : Share{false} {}
+Share::Share(bool share_connections) noexcept {
+  impl_.reset(new Share::Impl);
+  CURLSH *sharep = curl_share_init();
+  MKCURL_HOOK_ALLOC(curl_share_init, sharep, curl_share_cleanup);
+  mkcurl_share_uptr handle{sharep};
+  if (!handle) {
+    return;
+  }
+  // Note: we set the user data first because cURL may call the lock
+  // function when destroying the share, e.g., if a later step fails.
+  {
+    CURLSHcode rv = curl_share_setopt(
+        handle.get(), CURLSHOPT_USERDATA, impl_->mutexes);
+    MKCURL_HOOK(curl_share_setopt_CURLSHOPT_USERDATA, rv);
+    if (rv != CURLSHE_OK) {
+      return;
+    }
+  }
+  {
+    CURLSHcode rv = curl_share_setopt(
+        handle.get(), CURLSHOPT_LOCKFUNC, mkcurl_share_lock_cb_);
+    MKCURL_HOOK(curl_share_setopt_CURLSHOPT_LOCKFUNC, rv);
+    if (rv != CURLSHE_OK) {
+      return;
+    }
+  }
+  {
+    CURLSHcode rv = curl_share_setopt(
+        handle.get(), CURLSHOPT_UNLOCKFUNC, mkcurl_share_unlock_cb_);
+    MKCURL_HOOK(curl_share_setopt_CURLSHOPT_UNLOCKFUNC, rv);
+    if (rv != CURLSHE_OK) {
+      return;
+    }
+  }
+  std::vector<curl_lock_data> shared{
+      CURL_LOCK_DATA_DNS, CURL_LOCK_DATA_SSL_SESSION};
+  if (share_connections) {
+    shared.push_back(CURL_LOCK_DATA_CONNECT);
+  }
+  for (auto data : shared) {
+    CURLSHcode rv = curl_share_setopt(handle.get(), CURLSHOPT_SHARE, data);
+    MKCURL_HOOK(curl_share_setopt_CURLSHOPT_SHARE, rv);
+    if (rv != CURLSHE_OK) {
+      return;
+    }
+  }
+  std::swap(impl_->handle, handle);
+}
+Share::~Share() noexcept = default;
+
+void Cancellation::cancel() noexcept { cancelled_ = true; }
+bool Cancellation::cancelled() const noexcept { return cancelled_; }
+
+// mkcurl_dns_entry is an entry of a DNSCache.
+struct mkcurl_dns_entry {
+  // addresses are the addresses.
+  std::vector<std::string> addresses;
+  // expiry is when this entry expires or -1 if it never expires.
+  int64_t expiry = -1;
+};
+
+// DNSCache::Impl contains the implementation of a DNS cache.
+class DNSCache::Impl {
+ public:
+  int64_t learn_ttl_ms = 0;
+  mutable std::mutex mutex;
+  // entries maps the lowercase host and the port to the entry.
+  std::map<std::pair<std::string, int64_t>, mkcurl_dns_entry> entries;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+};
+DNSCache::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
+
+// mkcurl_dns_key returns the key of @p host and @p port in a DNSCache.
+static std::pair<std::string, int64_t> mkcurl_dns_key(
+    const std::string &host, int64_t port) noexcept {
+  std::string lower = host;
+  std::transform(lower.begin(), lower.end(), lower.begin(),
+                 [](char c) { return (char)tolower((unsigned char)c); });
+  return std::make_pair(std::move(lower), port);
+}
+
+DNSCache::DNSCache() noexcept : DNSCache{0} {}
+DNSCache::DNSCache(int64_t learn_ttl_ms) noexcept {
+  impl_.reset(new DNSCache::Impl);
+  impl_->learn_ttl_ms = learn_ttl_ms;
+}
+DNSCache::~DNSCache() noexcept = default;
+void DNSCache::add(const std::string &host, int64_t port,
+                   std::vector<std::string> addresses,
+                   int64_t ttl_ms) noexcept {
+  if (addresses.empty()) {
+    remove(host, port);
+    return;
+  }
+  mkcurl_dns_entry entry;
+  entry.addresses = std::move(addresses);
+  entry.expiry = (ttl_ms > 0) ? mkcurl_now() + ttl_ms : -1;
+  auto key = mkcurl_dns_key(host, port);
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  impl_->entries[std::move(key)] = std::move(entry);
+}
+void DNSCache::remove(const std::string &host, int64_t port) noexcept {
+  auto key = mkcurl_dns_key(host, port);
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  impl_->entries.erase(key);
+}
+std::vector<std::string> DNSCache::lookup(
+    const std::string &host, int64_t port) const noexcept {
+  auto key = mkcurl_dns_key(host, port);
+  int64_t now = mkcurl_now();
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  auto it = impl_->entries.find(key);
+  if (it == impl_->entries.end()) {
+    return {};
+  }
+  if (it->second.expiry >= 0 && it->second.expiry <= now) {
+    impl_->entries.erase(it);
+    return {};
+  }
+  return it->second.addresses;
+}
+size_t DNSCache::size() const noexcept {
+  int64_t now = mkcurl_now();
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  size_t count = 0;
+  for (auto &pair : impl_->entries) {
+    if (pair.second.expiry < 0 || pair.second.expiry > now) {
+      ++count;
+    }
+  }
+  return count;
+}
+void DNSCache::clear() noexcept {
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  impl_->entries.clear();
+}
+int64_t DNSCache::learn_ttl_ms() const noexcept {
+  return impl_->learn_ttl_ms;
+}
+
+// mkcurl_cached_response is a response stored into a ResponseCache.
+struct mkcurl_cached_response {
+  // vary contains the lowercase names and the values of the request
+  // headers named by the Vary header of the response.
+  std::vector<std::pair<std::string, std::string>> vary;
+  // response is the response, without logs.
+  Response response;
+  // fresh_until is the time until which the response is fresh.
+  int64_t fresh_until = 0;
+  // last_used tells when we last used the response.
+  uint64_t last_used = 0;
+};
+
+// ResponseCache::Impl contains the implementation of a response cache.
+class ResponseCache::Impl {
+ public:
+  size_t max_bytes = 0;
+  mutable std::mutex mutex;
+  // bytes is the total size of the cached bodies.
+  size_t bytes = 0;
+  // clock is incremented each time we use a response.
+  uint64_t clock = 0;
+  // entries maps method and URL to the responses for each variant.
+  std::map<std::string, std::vector<mkcurl_cached_response>> entries;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+};
+ResponseCache::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
+
+// mkcurl_lower returns @p s converted to lowercase.
+static std::string mkcurl_lower(std::string s) noexcept {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](char c) { return (char)tolower((unsigned char)c); });
+  return s;
+}
+
+// mkcurl_trim returns @p s without leading and trailing whitespace.
+static std::string mkcurl_trim(const std::string &s) noexcept {
+  size_t begin = s.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return "";
+  }
+  return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+}
+
+// mkcurl_split splits the comma separated list @p s into its trimmed and
+// lowercase non empty elements.
+static std::vector<std::string> mkcurl_split(const std::string &s) noexcept {
+  std::vector<std::string> out;
+  std::stringstream ss{s};
+  std::string elem;
+  while (std::getline(ss, elem, ',')) {
+    elem = mkcurl_lower(mkcurl_trim(elem));
+    if (!elem.empty()) out.push_back(std::move(elem));
+  }
+  return out;
+}
+
+// mkcurl_request_header returns the value of the header of @p req with the
+// lowercase name @p name, or an empty string if there is no such header.
+static std::string mkcurl_request_header(
+    const Request &req, const std::string &name) noexcept {
+  for (auto &header : req.headers) {
+    size_t colon = header.find(':');
+    if (colon != std::string::npos &&
+        mkcurl_lower(mkcurl_trim(header.substr(0, colon))) == name) {
+      return mkcurl_trim(header.substr(colon + 1));
+    }
+  }
+  return "";
+}
+
+// mkcurl_vary returns the names of the request headers named by the Vary
+// header of @p res and the values they have in @p req. We set @p any
+// when the Vary header contains `*`.
+static std::vector<std::pair<std::string, std::string>> mkcurl_vary(
+    const Request &req, const Response &res, bool &any) noexcept {
+  std::vector<std::pair<std::string, std::string>> vary;
+  std::string value;
+  any = false;
+  if (find_header(res, "vary", value)) {
+    for (auto &name : mkcurl_split(value)) {
+      any = any || name == "*";
+      vary.emplace_back(name, mkcurl_request_header(req, name));
+    }
+  }
+  return vary;
+}
+
+// mkcurl_cache_control parses the Cache-Control header of @p res and sets
+// @p max_age to the max-age in seconds, or to -1 if there is none.
+static void mkcurl_cache_control(const Response &res, int64_t &max_age,
+                                 bool &no_store, bool &no_cache) noexcept {
+  max_age = -1;
+  no_store = no_cache = false;
+  std::string value;
+  if (!find_header(res, "cache-control", value)) {
+    return;
+  }
+  for (auto &directive : mkcurl_split(value)) {
+    if (directive == "no-store") {
+      no_store = true;
+    } else if (directive == "no-cache") {
+      no_cache = true;
+    } else if (directive.find("max-age=") == 0) {
+      max_age = strtoll(directive.c_str() + 8, nullptr, 10);
+      max_age = (std::max<int64_t>)(0, (std::min<int64_t>)(
+          max_age, (INT64_MAX - mkcurl_now()) / 1000));
+    }
+  }
+}
+
+// mkcurl_cache_find returns the response to @p req among @p variants,
+// or an null pointer if there is no such response.
+static mkcurl_cached_response *mkcurl_cache_find(
+    std::vector<mkcurl_cached_response> &variants,
+    const Request &req) noexcept {
+  for (auto &variant : variants) {
+    bool match = true;
+    for (auto &pair : variant.vary) {
+      match = match && mkcurl_request_header(req, pair.first) == pair.second;
+    }
+    if (match) {
+      return &variant;
+    }
+  }
+  return nullptr;
+}
+
+ResponseCache::ResponseCache() noexcept : ResponseCache{16 << 20} {}
+ResponseCache::ResponseCache(size_t max_bytes) noexcept {
+  impl_.reset(new ResponseCache::Impl);
+  impl_->max_bytes = max_bytes;
+}
+ResponseCache::~ResponseCache() noexcept = default;
+bool ResponseCache::get(const Request &req, Response &res,
+                        bool &fresh) const noexcept {
+  std::string key = req.method + " " + req.url;
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  auto it = impl_->entries.find(key);
+  if (it == impl_->entries.end()) {
+    return false;
+  }
+  mkcurl_cached_response *cached = mkcurl_cache_find(it->second, req);
+  if (cached == nullptr) {
+    return false;
+  }
+  cached->last_used = ++impl_->clock;
+  fresh = mkcurl_now() < cached->fresh_until;
+  res = cached->response;
+  return true;
+}
+void ResponseCache::put(const Request &req, const Response &res) noexcept {
+  if (req.method != "GET" || res.error != CURLE_OK ||
+      (res.status_code != 200 && res.status_code != 304)) {
+    return;
+  }
+  int64_t max_age = -1;
+  bool no_store = false, no_cache = false;
+  mkcurl_cache_control(res, max_age, no_store, no_cache);
+  int64_t fresh_until = mkcurl_now() + (no_cache ? 0 : max_age * 1000);
+  std::string key = req.method + " " + req.url;
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  auto &variants = impl_->entries[key];
+  mkcurl_cached_response *cached = mkcurl_cache_find(variants, req);
+  if (res.status_code == 304) {
+    if (cached != nullptr) {
+      // When the 304 does not tell for how long the response is fresh, we
+      // use the max-age of the cached response (RFC 7234, Section 4.3.4).
+      if (max_age < 0 && !no_cache) {
+        mkcurl_cache_control(cached->response, max_age, no_store, no_cache);
+        fresh_until = mkcurl_now() + (no_cache ? 0 : max_age * 1000);
+      }
+      cached->fresh_until = fresh_until;
+      cached->last_used = ++impl_->clock;
+    }
+    if (variants.empty()) impl_->entries.erase(key);
+    return;
+  }
+  if (cached != nullptr) {
+    impl_->bytes -= cached->response.body.size();
+    variants.erase(variants.begin() + (cached - variants.data()));
+  }
+  std::string value;
+  bool vary_any = false;
+  auto vary = mkcurl_vary(req, res, vary_any);
+  bool validators = find_header(res, "etag", value) ||
+                    find_header(res, "last-modified", value);
+  if (no_store || vary_any || (!validators && max_age <= 0) ||
+      res.body.size() > impl_->max_bytes) {
+    if (variants.empty()) impl_->entries.erase(key);
+    return;
+  }
+  mkcurl_cached_response entry;
+  entry.vary = std::move(vary);
+  entry.response = res;
+  entry.response.logs.clear();
+  entry.response.log_arena.clear();
+  entry.response.log_entries.clear();
+  entry.response.samples.clear();
+  entry.response.attempts.clear();
+  // A cache hit does not transfer any data with the network.
+  entry.response.bytes_sent = entry.response.bytes_recv = 0;
+  entry.response.body_bytes_recv = 0;
+  entry.response.num_connects = 0;
+  entry.response.connection_reused = false;
+  entry.response.tls_session_resumed = false;
+  entry.response.timings = Timings{};
+  entry.response.primary_ip.clear();
+  entry.response.primary_port = 0;
+  entry.response.local_ip.clear();
+  entry.response.local_port = 0;
+  entry.fresh_until = fresh_until;
+  entry.last_used = ++impl_->clock;
+  impl_->bytes += res.body.size();
+  variants.push_back(std::move(entry));
+  while (impl_->bytes > impl_->max_bytes) {
+    auto lru = impl_->entries.end();
+    size_t index = 0;
+    uint64_t oldest = UINT64_MAX;
+    for (auto it = impl_->entries.begin(); it != impl_->entries.end(); ++it) {
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        if (it->second[i].last_used < oldest) {
+          oldest = it->second[i].last_used;
+          lru = it;
+          index = i;
+        }
+      }
+    }
+    impl_->bytes -= lru->second[index].response.body.size();
+    lru->second.erase(lru->second.begin() + (ptrdiff_t)index);
+    if (lru->second.empty()) impl_->entries.erase(lru);
+  }
+}
+size_t ResponseCache::size() const noexcept {
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  size_t count = 0;
+  for (auto &pair : impl_->entries) {
+    count += pair.second.size();
+  }
+  return count;
+}
+size_t ResponseCache::bytes() const noexcept {
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  return impl_->bytes;
+}
+void ResponseCache::clear() noexcept {
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  impl_->entries.clear();
+  impl_->bytes = 0;
+}
+
+// mkcurl_perform_cached is like perform2 except that it uses the
+// Request::response_cache of @p req, if any, when possible.
+static void mkcurl_perform_cached(mkcurl_uptr &handle, CURLSH *share,
+                                  const Request &req,
+                                  const ConnectionPolicy &policy,
+                                  Response &res) noexcept {
+  if (!req.response_cache || req.method != "GET" || req.body_sink) {
+    perform2(handle, share, req, policy, res);
+    return;
+  }
+  ResponseCache &cache = *req.response_cache;
+  Response cached;
+  bool fresh = false;
+  if (!cache.get(req, cached, fresh)) {
+    perform2(handle, share, req, policy, res);
+    cache.put(req, res);
+    return;
+  }
+  if (fresh) {
+    mkcurl_prepare(req, cached);
+    mkcurl_log(cached, "Using the cached response");
+    cached.from_cache = true;
+    res = std::move(cached);
+    return;
+  }
+  Request conditional = req;
+  std::string value;
+  if (find_header(cached, "etag", value)) {
+    conditional.headers.push_back("If-None-Match: " + value);
+  }
+  if (find_header(cached, "last-modified", value)) {
+    conditional.headers.push_back("If-Modified-Since: " + value);
+  }
+  perform2(handle, share, conditional, policy, res);
+  cache.put(req, res);
+  if (res.error != CURLE_OK || res.status_code != 304) {
+    return;
+  }
+  // Use the cached representation with the metadata of this transfer.
+  mkcurl_log(res, "Using the revalidated cached response");
+  res.status_code = cached.status_code;
+  res.body = std::move(cached.body);
+  res.response_headers = std::move(cached.response_headers);
+  res.header_arena = std::move(cached.header_arena);
+  res.header_entries = std::move(cached.header_entries);
+  res.header_hops = cached.header_hops;
+  res.content_type = std::move(cached.content_type);
+  res.body_bytes_decoded = cached.body_bytes_decoded;
+  res.from_cache = true;
+  res.revalidated = true;
+}
+
+// mkcurl_account accounts for @p res into @p stats.
+static void mkcurl_account(ClientStats &stats, const Response &res) noexcept {
+  stats.requests += 1;
+  if (res.error != CURLE_OK) {
+    stats.failures += 1;
+  } else {
+    stats.reused += res.connection_reused ? 1 : 0;
+  }
+  stats.connects += (uint64_t)res.num_connects;
+  stats.tls_resumed += res.tls_session_resumed ? 1 : 0;
+  stats.bytes_sent += res.bytes_sent;
+  stats.bytes_recv += res.bytes_recv;
+}
 
 Client::Client() noexcept { impl_.reset(new Client::Impl); }
+Client::Client(std::shared_ptr<Share> share) noexcept
+    : Client{std::move(share), ConnectionPolicy{}} {}
+Client::Client(std::shared_ptr<Share> share, ConnectionPolicy policy) noexcept {
+  impl_.reset(new Client::Impl);
+  if (share) {
+    impl_->shareh = share->impl_->handle.get();
+    impl_->share = std::move(share);
+  }
+  impl_->policy = policy;
+}
 Client::Client(Client &&) noexcept = default;
 Client &Client::operator=(Client &&) noexcept = default;
 Client::~Client() noexcept = default;
 Response Client::perform(const Request &req) noexcept {
-  return perform2(impl_->handle, req);
+  Response res;
+  perform(req, res);
+  return res;
+}
+void Client::perform(const Request &req, Response &res) noexcept {
+  impl_->prepared = 0;
+  mkcurl_perform_cached(impl_->handle, impl_->shareh, req, impl_->policy,
+                        res);
+  mkcurl_account(impl_->stats, res);
+}
+Response Client::perform(PreparedRequest &request) noexcept {
+  PreparedRequest::Impl &prepared = *request.impl_;
+  Response res;
+  mkcurl_prepare(prepared.req, res);
+  mkcurl_init(impl_->handle, impl_->shareh, res);
+  if (res.error != CURLE_OK) {
+    impl_->prepared = 0;
+    mkcurl_account(impl_->stats, res);
+    return res;
+  }
+  MKCURL_STOPWATCH(setup_start);
+  // Another client may have configured its own handle for the same prepared
+  // request in the meanwhile, thus rebuilding the lists in xfer.
+  if (impl_->prepared == prepared.id &&
+      prepared.handle == impl_->handle.get() &&
+      mkcurl_can_patch(prepared.req, prepared.origin, prepared.url_changed)) {
+    mkcurl_patch(impl_->handle, prepared.req, prepared.xfer,
+                 prepared.url_changed, prepared.body_changed, res);
+  } else {
+    prepared.handle = nullptr;
+    mkcurl_setup(impl_->handle, prepared.req, prepared.xfer, res);
+    if (res.error == CURLE_OK) {
+      mkcurl_apply_policy(impl_->handle, impl_->policy, res);
+    }
+    prepared.origin = mkcurl_origin(prepared.req.url);
+  }
+  MKCURL_OBSERVE_SINCE(setup_us, setup_start);
+  if (res.error != CURLE_OK) {
+    // We don't know which options were set, so setup again next time.
+    impl_->prepared = 0;
+    prepared.handle = nullptr;
+    mkcurl_account(impl_->stats, res);
+    return res;
+  }
+  impl_->prepared = prepared.id;
+  prepared.handle = impl_->handle.get();
+  prepared.url_changed = false;
+  prepared.body_changed = false;
+  CURLcode rv = perform_and_retry(
+      impl_->handle.get(), prepared.req, prepared.xfer, res);
+  mkcurl_complete(impl_->handle, prepared.xfer, rv);
+  mkcurl_account(impl_->stats, res);
+  return res;
+}
+size_t Client::prewarm(const Request &request,
+                       const std::vector<std::string> &urls) noexcept {
+  size_t count = 0;
+  Request req = request;
+  req.method = "GET";
+  req.body.clear();
+  req.body_source = nullptr;
+  req.body_source_rewind = nullptr;
+  req.sample_sink = nullptr;
+  req.response_cache = nullptr;
+  req.retries = 0;
+  req.log_level = LogLevel::none;
+  req.body_sink = [](const char *, size_t) { return true; };
+  if (req.timeout <= 0 && req.timeout_ms <= 0) {
+    req.timeout_ms = 10000;  // Do not block forever on unresponsive origins
+  }
+  Response res;
+  for (auto &url : urls) {
+    req.url = url;
+    perform(req, res);
+    count += (res.error == CURLE_OK) ? 1 : 0;
+  }
+  return count;
+}
+void Client::close_connections() noexcept {
+  impl_->handle.reset();
+  impl_->prepared = 0;
+}
+ClientStats Client::stats() const noexcept { return impl_->stats; }
+
+PreparedRequest::PreparedRequest(Request request) noexcept {
+  static std::atomic<uint64_t> next_id{1};
+  impl_.reset(new PreparedRequest::Impl);
+  impl_->id = next_id++;
+  impl_->req = std::move(request);
+}
+PreparedRequest::PreparedRequest(PreparedRequest &&) noexcept = default;
+PreparedRequest &PreparedRequest::operator=(
+    PreparedRequest &&) noexcept = default;
+PreparedRequest::~PreparedRequest() noexcept = default;
+const Request &PreparedRequest::request() const noexcept {
+  return impl_->req;
+}
+void PreparedRequest::set_url(std::string url) noexcept {
+  impl_->req.url = std::move(url);
+  impl_->url_changed = true;
+}
+void PreparedRequest::set_body(std::string body) noexcept {
+  impl_->req.body = std::move(body);
+  impl_->body_changed = true;
 }
 
 Response perform(const Request &req) noexcept {
   return Client{}.perform(req);
 }
 
+bool find_header(const Response &res, const std::string &name,
+                 std::string &value) noexcept {
+  if (res.header_hops <= 0) {
+    return false;
+  }
+  size_t hop = res.header_hops - 1;
+  for (auto &entry : res.header_entries) {
+    if (entry.hop != hop || entry.name_size != name.size()) {
+      continue;
+    }
+    size_t i = 0;
+    while (i < entry.name_size &&
+           res.header_arena[entry.name_offset + i] ==
+               (char)tolower((unsigned char)name[i])) {
+      ++i;
+    }
+    if (i == entry.name_size) {
+      value = res.header_arena.substr(entry.value_offset, entry.value_size);
+      return true;
+    }
+  }
+  return false;
+}
+
+// ClientPool::Impl contains the implementation of a pool.
+class ClientPool::Impl {
+ public:
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<Client> clients;  // protected by mutex
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+};
+ClientPool::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
+
+ClientPool::Lease::Lease(ClientPool *pool, Client &&client) noexcept
+    : pool_{pool}, client_{std::move(client)} {}
+ClientPool::Lease::Lease(Lease &&other) noexcept
+    : pool_{other.pool_}, client_{std::move(other.client_)} {
+  other.pool_ = nullptr;
+}
+ClientPool::Lease &ClientPool::Lease::operator=(Lease &&other) noexcept {
+  if (this != &other) {
+    if (pool_ != nullptr) {
+      pool_->checkin(std::move(client_));
+    }
+    pool_ = other.pool_;
+    client_ = std::move(other.client_);
+    other.pool_ = nullptr;
+  }
+  return *this;
+}
+ClientPool::Lease::~Lease() noexcept {
+  if (pool_ != nullptr) {
+    pool_->checkin(std::move(client_));
+  }
+}
+Client &ClientPool::Lease::client() noexcept { return client_; }
+
+ClientPool::ClientPool(size_t size, std::shared_ptr<Share> share,
+                       ConnectionPolicy policy) noexcept {
+  impl_.reset(new ClientPool::Impl);
+  size = (std::max)(size, (size_t)1);
+  for (size_t i = 0; i < size; ++i) {
+    impl_->clients.push_back(Client{share, policy});
+  }
+}
+ClientPool::~ClientPool() noexcept = default;
+
+ClientPool::Lease ClientPool::checkout() noexcept {
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  impl_->cond.wait(lock, [this]() { return !impl_->clients.empty(); });
+  Client client = std::move(impl_->clients.back());
+  impl_->clients.pop_back();
+  return Lease{this, std::move(client)};
+}
+
+void ClientPool::checkin(Client &&client) noexcept {
+  {
+    std::unique_lock<std::mutex> lock{impl_->mutex};
+    impl_->clients.push_back(std::move(client));
+  }
+  impl_->cond.notify_one();
+}
+
+Response ClientPool::perform(const Request &req) noexcept {
+  return checkout().client().perform(req);
+}
+
+// mkcurl_multi_slot is a transfer running inside a mkcurl_engine.
+struct mkcurl_multi_slot {
+  // handle is the handle used by this transfer.
+  mkcurl_uptr handle;
+  // index is the number identifying this transfer.
+  size_t index = 0;
+  // res is the response of this transfer.
+  Response *res = nullptr;
+  // req is the request, which outlives the transfer.
+  const Request *req = nullptr;
+  // retry is the number of retries done so far.
+  size_t retry = 0;
+  // first_start is when the first attempt started.
+  int64_t first_start = 0;
+  // attempt_start is when the current attempt started.
+  int64_t attempt_start = 0;
+  // retry_at is when we should retry or -1 if the handle is not waiting to
+  // be added again to the multi handle.
+  int64_t retry_at = -1;
+  // xfer is the state that must outlive the configuration of handle.
+  mkcurl_xfer xfer;
+};
+
+// mkcurl_multi_slot_uptr is a unique pointer to a mkcurl_multi_slot.
+using mkcurl_multi_slot_uptr = std::unique_ptr<mkcurl_multi_slot>;
+
+// mkcurl_done_cb is called with the index of each completed transfer.
+using mkcurl_done_cb = std::function<void(size_t)>;
+
+// mkcurl_engine runs transfers using cURL's multi interface. It is the
+// common implementation of MultiClient and AsyncClient.
+class mkcurl_engine {
+ public:
+  // Note: settings must be declared first because the handles MUST be
+  // destroyed before the share they may be using.
+  MultiSettings settings;
+  CURLSH *shareh = nullptr;  // Owned by settings
+  mkcurl_multi_uptr multi;
+  std::vector<mkcurl_uptr> idle;
+  std::vector<mkcurl_multi_slot_uptr> active;
+  mkcurl_engine() noexcept = default;
+  mkcurl_engine(const mkcurl_engine &) noexcept = delete;
+  mkcurl_engine &operator=(const mkcurl_engine &) noexcept = delete;
+  mkcurl_engine(mkcurl_engine &&) noexcept = delete;
+  mkcurl_engine &operator=(mkcurl_engine &&) noexcept = delete;
+  ~mkcurl_engine() noexcept;
+
+  // init initialises and configures the multi handle, unless it is already
+  // initialised. @return true on success and false on failure.
+  bool init() noexcept;
+
+  // full returns true when we cannot start any other transfer because we
+  // are already running as many transfers as the configured concurrency.
+  bool full() const noexcept;
+
+  // start starts performing @p req as the transfer identified by @p index.
+  // Both @p req and @p res must outlive the transfer. On failure, it sets
+  // @p res error and the transfer is not started.
+  void start(const Request &req, Response &res, size_t index) noexcept;
+
+  // perform performs the active transfers and calls @p done for each
+  // transfer that completed, after having filled its response. Transfers
+  // that failed and should be retried later remain active.
+  void perform(const mkcurl_done_cb &done) noexcept;
+
+  // wait waits for up to @p timeout_ms milliseconds for activity on the
+  // active transfers, or until it is time to retry a transfer. On failure,
+  // all active transfers are aborted and @p done is called for each of
+  // them. When supported by cURL, this wait can be interrupted using
+  // curl_multi_wakeup().
+  void wait(int timeout_ms, const mkcurl_done_cb &done) noexcept;
+
+  // abort interrupts all active transfers, setting their response error
+  // to @p error and logging @p reason, and calls @p done for each of them.
+  void abort(CURLcode error, const char *reason,
+             const mkcurl_done_cb &done) noexcept;
+};
+mkcurl_engine::~mkcurl_engine() noexcept = default; // Avoid `-Wweak-vtables`
+
+bool mkcurl_engine::init() noexcept {
+  if (!multi) {
+    CURLM *multip = curl_multi_init();
+    MKCURL_HOOK_ALLOC(curl_multi_init, multip, curl_multi_cleanup);
+    mkcurl_multi_uptr handle{multip};
+    if (!handle) {
+      return false;
+    }
+    {
+      long pipelining = settings.enable_multiplex ? CURLPIPE_MULTIPLEX
+                                                  : CURLPIPE_NOTHING;
+      CURLMcode mc = curl_multi_setopt(
+          handle.get(), CURLMOPT_PIPELINING, pipelining);
+      MKCURL_HOOK(curl_multi_setopt_CURLMOPT_PIPELINING, mc);
+      if (mc != CURLM_OK) {
+        return false;
+      }
+    }
+    if (settings.max_host_connections > 0) {
+      long max = (settings.max_host_connections < LONG_MAX)
+                     ? (long)settings.max_host_connections
+                     : LONG_MAX;
+      CURLMcode mc = curl_multi_setopt(
+          handle.get(), CURLMOPT_MAX_HOST_CONNECTIONS, max);
+      MKCURL_HOOK(curl_multi_setopt_CURLMOPT_MAX_HOST_CONNECTIONS, mc);
+      if (mc != CURLM_OK) {
+        return false;
+      }
+    }
+    std::swap(multi, handle);
+  }
+  return true;
+}
+
+bool mkcurl_engine::full() const noexcept {
+  return active.size() >= (std::max)(settings.concurrency, (size_t)1);
+}
+
+void mkcurl_engine::start(
+    const Request &req, Response &res, size_t index) noexcept {
+  mkcurl_multi_slot_uptr slot{new mkcurl_multi_slot};
+  slot->index = index;
+  slot->res = &res;
+  slot->req = &req;
+  if (!idle.empty()) {
+    slot->handle = std::move(idle.back());
+    idle.pop_back();
+  }
+  mkcurl_prepare(req, res);
+  mkcurl_init(slot->handle, shareh, res);
+  if (res.error != CURLE_OK) {
+    return;
+  }
+  MKCURL_STOPWATCH(setup_start);
+  mkcurl_setup(slot->handle, req, slot->xfer, res);
+  MKCURL_OBSERVE_SINCE(setup_us, setup_start);
+  if (res.error != CURLE_OK) {
+    idle.push_back(std::move(slot->handle));
+    return;
+  }
+  if (settings.enable_multiplex && req.enable_http2) {
+    res.error = curl_easy_setopt(slot->handle.get(), CURLOPT_PIPEWAIT, 1L);
+    MKCURL_HOOK(curl_easy_setopt_CURLOPT_PIPEWAIT, res.error);
+    if (res.error != CURLE_OK) {
+      mkcurl_log_failure(res, "curl_easy_setopt(CURLOPT_PIPEWAIT) failed");
+      idle.push_back(std::move(slot->handle));
+      return;
+    }
+  }
+  CURLMcode mc = curl_multi_add_handle(multi.get(), slot->handle.get());
+  MKCURL_HOOK(curl_multi_add_handle, mc);
+  if (mc != CURLM_OK) {
+    // Response::error is a CURLcode, hence we map failures of the
+    // multi interface to the generic CURLE_FAILED_INIT error.
+    res.error = CURLE_FAILED_INIT;
+    mkcurl_log_failure(res, "curl_multi_add_handle() failed");
+    return;  // Let the handle go, since it may be in a weird state
+  }
+  slot->first_start = slot->attempt_start = mkcurl_now();
+  active.push_back(std::move(slot));
+}
+
+void mkcurl_engine::perform(const mkcurl_done_cb &done) noexcept {
+  {
+    int64_t now = mkcurl_now();
+    for (size_t i = 0; i < active.size();) {
+      mkcurl_multi_slot &slot = *active[i];
+      if (slot.retry_at >= 0 && slot.req->cancellation &&
+          slot.req->cancellation->cancelled()) {
+        mkcurl_multi_slot_uptr cancelled = std::move(active[i]);
+        active.erase(active.begin() + (ptrdiff_t)i);
+        mkcurl_log_failure(*cancelled->res, "Cancelled while waiting to retry");
+        mkcurl_complete(cancelled->handle, cancelled->xfer,
+                        CURLE_ABORTED_BY_CALLBACK);
+        idle.push_back(std::move(cancelled->handle));
+        done(cancelled->index);
+        continue;
+      }
+      if (slot.retry_at < 0 || slot.retry_at > now) {
+        ++i;
+        continue;
+      }
+      slot.retry_at = -1;
+      slot.attempt_start = now;
+      CURLMcode mc = curl_multi_add_handle(multi.get(), slot.handle.get());
+      MKCURL_HOOK(curl_multi_add_handle, mc);
+      if (mc == CURLM_OK) {
+        ++i;
+        continue;
+      }
+      slot.res->error = CURLE_FAILED_INIT;
+      mkcurl_log_failure(*slot.res, "curl_multi_add_handle() failed");
+      size_t index = slot.index;
+      active.erase(active.begin() + (ptrdiff_t)i);
+      done(index);
+    }
+  }
+  {
+    int running = 0;
+    CURLMcode mc = curl_multi_perform(multi.get(), &running);
+    MKCURL_HOOK(curl_multi_perform, mc);
+    if (mc != CURLM_OK) {
+      abort(CURLE_FAILED_INIT, "curl_multi_perform() failed", done);
+      return;
+    }
+  }
+  for (;;) {
+    int left = 0;
+    CURLMsg *msg = curl_multi_info_read(multi.get(), &left);
+    if (msg == nullptr) {
+      break;
+    }
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    // Note: msg does not survive curl_multi_remove_handle().
+    CURL *handlep = msg->easy_handle;
+    CURLcode rv = msg->data.result;
+    auto it = std::find_if(
+        active.begin(), active.end(), [&](const mkcurl_multi_slot_uptr &s) {
+          return s->handle.get() == handlep;
+        });
+    if (it == active.end()) {
+      continue;  // Should not happen but let's be defensive
+    }
+    mkcurl_multi_slot_uptr slot = std::move(*it);
+    active.erase(it);
+    Response &res = *slot->res;
+    // Removing a handle only fails if the handle is not valid or if it is
+    // being used by another multi handle, which cannot be the case here.
+    (void)curl_multi_remove_handle(multi.get(), handlep);
+    // Log the data of this attempt before deciding whether to retry.
+    mkcurl_flush_data_log(slot->xfer);
+    int64_t delay_ms = 0;
+    if (mkcurl_retry(handlep, *slot->req, rv, slot->retry, slot->first_start,
+                     slot->attempt_start, res, delay_ms)) {
+      // We add the handle again at the beginning of the next perform.
+      slot->retry += 1;
+      slot->retry_at = mkcurl_now() + delay_ms;
+      active.push_back(std::move(slot));
+      continue;
+    }
+    mkcurl_complete(slot->handle, slot->xfer, rv);
+    idle.push_back(std::move(slot->handle));
+    done(slot->index);
+  }
+}
+
+void mkcurl_engine::wait(int timeout_ms, const mkcurl_done_cb &done) noexcept {
+  // Do not wait past the time when we should retry a transfer.
+  bool waiting = false;
+  bool running = false;
+  int64_t now = mkcurl_now();
+  for (auto &slot : active) {
+    if (slot->retry_at < 0) {
+      running = true;
+      continue;
+    }
+    waiting = true;
+    int64_t delta = (std::max)(slot->retry_at - now, (int64_t)0);
+    if (slot->req->cancellation) {
+      delta = (std::min)(delta, mkcurl_cancel_check_ms);
+    }
+    if (delta < (int64_t)timeout_ms) timeout_ms = (int)delta;
+  }
+  if (waiting && timeout_ms <= 0) {
+    return;
+  }
+#ifdef MKCURL_HAVE_MULTI_WAKEUP
+  (void)running;
+  CURLMcode mc = curl_multi_poll(multi.get(), nullptr, 0, timeout_ms, nullptr);
+  MKCURL_HOOK(curl_multi_poll, mc);
+  if (mc != CURLM_OK) {
+    abort(CURLE_FAILED_INIT, "curl_multi_poll() failed", done);
+  }
+#else
+  // Without transfers, curl_multi_wait() may return immediately.
+  if (!running) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+    return;
+  }
+  CURLMcode mc = curl_multi_wait(multi.get(), nullptr, 0, timeout_ms, nullptr);
+  MKCURL_HOOK(curl_multi_wait, mc);
+  if (mc != CURLM_OK) {
+    abort(CURLE_FAILED_INIT, "curl_multi_wait() failed", done);
+  }
+#endif
+}
+
+void mkcurl_engine::abort(CURLcode error, const char *reason,
+                          const mkcurl_done_cb &done) noexcept {
+  std::vector<mkcurl_multi_slot_uptr> slots;
+  std::swap(slots, active);
+  for (auto &slot : slots) {
+    slot->res->error = error;
+    mkcurl_log_failure(*slot->res, reason);
+    // This is harmless if the handle is waiting to be added again.
+    (void)curl_multi_remove_handle(multi.get(), slot->handle.get());
+    done(slot->index);
+  }
+}
+
+// MultiClient::Impl contains the implementation of a multi client.
+class MultiClient::Impl {
+ public:
+  mkcurl_engine engine;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+};
+MultiClient::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
+
+MultiClient::MultiClient() noexcept : MultiClient{MultiSettings{}} {}
+MultiClient::MultiClient(MultiSettings settings) noexcept {
+  impl_.reset(new MultiClient::Impl);
+  if (settings.share) {
+    impl_->engine.shareh = settings.share->impl_->handle.get();
+  }
+  impl_->engine.settings = std::move(settings);
+}
+MultiClient::MultiClient(MultiClient &&) noexcept = default;
+MultiClient &MultiClient::operator=(MultiClient &&) noexcept = default;
+MultiClient::~MultiClient() noexcept = default;
+
+std::vector<Response> MultiClient::perform(
+    const std::vector<Request> &requests) noexcept {
+  // Note that we pass to cURL pointers to the elements of responses, hence
+  // we MUST NOT resize this vector until all the transfers are complete.
+  std::vector<Response> responses(requests.size());
+  mkcurl_engine &engine = impl_->engine;
+  if (!engine.init()) {
+    for (size_t i = 0; i < responses.size(); ++i) {
+      mkcurl_prepare(requests[i], responses[i]);
+      responses[i].error = CURLE_OUT_OF_MEMORY;
+      mkcurl_log_failure(responses[i], "curl_multi_init() failed");
+    }
+    return responses;
+  }
+  size_t next = 0;
+  bool completed = false;
+  mkcurl_done_cb done = [&](size_t) { completed = true; };
+  for (;;) {
+    while (!engine.full() && next < requests.size()) {
+      engine.start(requests[next], responses[next], next);
+      ++next;
+    }
+    if (engine.active.empty()) {
+      break;
+    }
+    completed = false;
+    engine.perform(done);
+    // Do not wait if we can immediately start more transfers.
+    if (!engine.active.empty() && (!completed || next >= requests.size())) {
+      engine.wait(1000, done);
+    }
+  }
+  return responses;
+}
+
+// mkcurl_async_job is a request submitted to an AsyncClient.
+struct mkcurl_async_job {
+  // req is the request to perform.
+  Request req;
+  // res is the response.
+  Response res;
+  // callback is the callback to call when done.
+  std::function<void(Response)> callback;
+};
+
+// mkcurl_async_job_uptr is a unique pointer to a mkcurl_async_job.
+using mkcurl_async_job_uptr = std::unique_ptr<mkcurl_async_job>;
+
+// AsyncClient::Impl contains the implementation of an async client.
+class AsyncClient::Impl {
+ public:
+  // engine is only used by the thread, except for curl_multi_wakeup().
+  mkcurl_engine engine;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<mkcurl_async_job_uptr> pending;  // protected by mutex
+  bool stopping = false;                      // protected by mutex
+  std::map<size_t, mkcurl_async_job_uptr> running;
+  size_t next_index = 0;
+  std::thread thread;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+
+  // submit schedules @p job to be performed by the thread.
+  void submit(mkcurl_async_job_uptr job) noexcept;
+
+  // complete calls the callback of the @p index-th running job.
+  void complete(size_t index) noexcept;
+
+  // loop is the function run by the thread.
+  void loop() noexcept;
+};
+
+AsyncClient::Impl::~Impl() noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex};
+    stopping = true;
+  }
+  cond.notify_all();
+#ifdef MKCURL_HAVE_MULTI_WAKEUP
+  if (engine.multi) {
+    (void)curl_multi_wakeup(engine.multi.get());
+  }
+#endif
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void AsyncClient::Impl::submit(mkcurl_async_job_uptr job) noexcept {
+  {
+    std::unique_lock<std::mutex> _{mutex};
+    pending.push_back(std::move(job));
+  }
+  cond.notify_all();
+#ifdef MKCURL_HAVE_MULTI_WAKEUP
+  if (engine.multi) {
+    (void)curl_multi_wakeup(engine.multi.get());
+  }
+#endif
+}
+
+void AsyncClient::Impl::complete(size_t index) noexcept {
+  auto it = running.find(index);
+  if (it == running.end()) {
+    return;  // Should not happen but let's be defensive
+  }
+  mkcurl_async_job_uptr job = std::move(it->second);
+  running.erase(it);
+  job->callback(std::move(job->res));
+}
+
+void AsyncClient::Impl::loop() noexcept {
+  mkcurl_done_cb done = [this](size_t index) { complete(index); };
+  // Without curl_multi_wakeup() we cannot interrupt a wait when a new
+  // request is submitted, hence we use a shorter timeout.
+#ifdef MKCURL_HAVE_MULTI_WAKEUP
+  constexpr int timeout_ms = 1000;
+#else
+  constexpr int timeout_ms = 50;
+#endif
+  std::deque<mkcurl_async_job_uptr> jobs;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock{mutex};
+      if (engine.active.empty()) {
+        cond.wait(lock, [this]() { return stopping || !pending.empty(); });
+      }
+      if (stopping) {
+        std::swap(jobs, pending);
+        break;
+      }
+      while (!pending.empty() && engine.active.size() + jobs.size() <
+                                     (std::max)(engine.settings.concurrency,
+                                                (size_t)1)) {
+        jobs.push_back(std::move(pending.front()));
+        pending.pop_front();
+      }
+    }
+    for (auto &job : jobs) {
+      if (!engine.multi) {
+        mkcurl_prepare(job->req, job->res);
+        job->res.error = CURLE_OUT_OF_MEMORY;
+        mkcurl_log_failure(job->res, "curl_multi_init() failed");
+        job->callback(std::move(job->res));
+        continue;
+      }
+      size_t index = next_index++;
+      engine.start(job->req, job->res, index);
+      if (job->res.error != CURLE_OK) {
+        job->callback(std::move(job->res));
+        continue;
+      }
+      running[index] = std::move(job);
+    }
+    jobs.clear();
+    if (engine.active.empty()) {
+      continue;
+    }
+    engine.perform(done);
+    if (!engine.active.empty()) {
+      engine.wait(timeout_ms, done);
+    }
+  }
+  engine.abort(CURLE_ABORTED_BY_CALLBACK, "AsyncClient is shutting down",
+               done);
+  for (auto &job : jobs) {
+    mkcurl_prepare(job->req, job->res);
+    job->res.error = CURLE_ABORTED_BY_CALLBACK;
+    mkcurl_log_failure(job->res, "AsyncClient is shutting down");
+    job->callback(std::move(job->res));
+  }
+}
+
+AsyncClient::AsyncClient() noexcept : AsyncClient{MultiSettings{}} {}
+AsyncClient::AsyncClient(MultiSettings settings) noexcept {
+  impl_.reset(new AsyncClient::Impl);
+  if (settings.share) {
+    impl_->engine.shareh = settings.share->impl_->handle.get();
+  }
+  impl_->engine.settings = std::move(settings);
+  // We create the multi handle here such that it is safe to access it
+  // from other threads for calling curl_multi_wakeup().
+  (void)impl_->engine.init();
+  AsyncClient::Impl *impl = impl_.get();
+  impl_->thread = std::thread{[impl]() { impl->loop(); }};
+}
+AsyncClient::AsyncClient(AsyncClient &&) noexcept = default;
+AsyncClient &AsyncClient::operator=(AsyncClient &&) noexcept = default;
+AsyncClient::~AsyncClient() noexcept = default;
+
+void AsyncClient::perform(
+    Request request, std::function<void(Response)> callback) noexcept {
+  mkcurl_async_job_uptr job{new mkcurl_async_job};
+  job->req = std::move(request);
+  job->callback = std::move(callback);
+  impl_->submit(std::move(job));
+}
+
+std::future<Response> AsyncClient::perform(Request request) noexcept {
+  std::shared_ptr<std::promise<Response>> promise{new std::promise<Response>};
+  std::future<Response> future = promise->get_future();
+  perform(std::move(request), [promise](Response res) {
+    promise->set_value(std::move(res));
+  });
+  return future;
+}
+
+// mkcurl_flight is a request in flight inside a Coalescer.
+struct mkcurl_flight {
+  // response is the response, once the request is complete.
+  std::shared_ptr<const Response> response;
+};
+
+// Coalescer::Impl contains the implementation of a coalescer.
+class Coalescer::Impl {
+ public:
+  std::mutex mutex;
+  std::condition_variable cond;
+  // flights maps the key of each request in flight to its flight.
+  std::map<std::string, std::shared_ptr<mkcurl_flight>> flights;
+  uint64_t coalesced = 0;
+  Impl() noexcept = default;
+  Impl(const Impl &) noexcept = delete;
+  Impl &operator=(const Impl &) noexcept = delete;
+  Impl(Impl &&) noexcept = delete;
+  Impl &operator=(Impl &&) noexcept = delete;
+  ~Impl() noexcept;
+
+  // join joins the flight of @p key, creating it if needed, and stores it
+  // into @p flight. @return whether we created the flight, in which case
+  // the caller MUST perform the request and then call land.
+  bool join(const std::string &key,
+            std::shared_ptr<mkcurl_flight> &flight) noexcept;
+
+  // land publishes @p res as the response of the flight of @p key.
+  void land(const std::string &key,
+            const std::shared_ptr<mkcurl_flight> &flight,
+            std::shared_ptr<const Response> res) noexcept;
+
+  // wait waits for @p flight to land and @return its response.
+  std::shared_ptr<const Response> wait(
+      const std::shared_ptr<mkcurl_flight> &flight) noexcept;
+};
+Coalescer::Impl::~Impl() noexcept = default; // Avoid `-Wweak-vtables`
+
+bool Coalescer::Impl::join(const std::string &key,
+                           std::shared_ptr<mkcurl_flight> &flight) noexcept {
+  std::unique_lock<std::mutex> lock{mutex};
+  auto it = flights.find(key);
+  if (it != flights.end()) {
+    flight = it->second;
+    coalesced += 1;
+    return false;
+  }
+  flight = std::make_shared<mkcurl_flight>();
+  flights[key] = flight;
+  return true;
+}
+
+void Coalescer::Impl::land(const std::string &key,
+                           const std::shared_ptr<mkcurl_flight> &flight,
+                           std::shared_ptr<const Response> res) noexcept {
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    flight->response = std::move(res);
+    flights.erase(key);
+  }
+  cond.notify_all();
+}
+
+std::shared_ptr<const Response> Coalescer::Impl::wait(
+    const std::shared_ptr<mkcurl_flight> &flight) noexcept {
+  std::unique_lock<std::mutex> lock{mutex};
+  cond.wait(lock, [&flight]() { return flight->response != nullptr; });
+  return flight->response;
+}
+
+// mkcurl_coalesce_key stores into @p key the key identifying @p req and
+// @return whether @p req can be coalesced.
+static bool mkcurl_coalesce_key(const Request &req, std::string &key) noexcept {
+  // Note: we cannot share the outcome of a request that may be cancelled,
+  // nor can a waiter notice its own cancellation.
+  if (req.method != "GET" || req.body_sink || req.body_source ||
+      req.sample_sink || req.cancellation) {
+    return false;
+  }
+  // Note: we separate fields with a character that cannot be in headers.
+  // Distinct DNS caches may pin distinct addresses, hence their identity
+  // is part of the key as well.
+  std::stringstream ss;
+  ss << req.method << '\n' << req.url << '\n' << req.proxy_url << '\n'
+     << req.connect_to << '\n' << req.ca_path << '\n' << req.doh_url << '\n'
+     << (const void *)req.dns_cache.get() << '\n'
+     << req.follow_redir << req.enable_compression << req.enable_certinfo
+     << req.accept_encoding << '\n';
+  for (auto &address : req.connect_addresses) {
+    ss << address << '\n';
+  }
+  ss << '\n';
+  for (auto &header : req.headers) {
+    ss << header << '\n';
+  }
+  key = ss.str();
+  return true;
+}
+
+Coalescer::Coalescer() noexcept { impl_.reset(new Coalescer::Impl); }
+Coalescer::~Coalescer() noexcept = default;
+
+std::shared_ptr<const Response> Coalescer::perform(
+    const Request &req,
+    const std::function<Response(const Request &)> &perform) noexcept {
+  std::string key;
+  if (!mkcurl_coalesce_key(req, key)) {
+    return std::make_shared<const Response>(perform(req));
+  }
+  std::shared_ptr<mkcurl_flight> flight;
+  if (!impl_->join(key, flight)) {
+    return impl_->wait(flight);
+  }
+  std::shared_ptr<const Response> res =
+      std::make_shared<const Response>(perform(req));
+  impl_->land(key, flight, res);
+  return res;
+}
+
+std::shared_ptr<const Response> Coalescer::perform(
+    Client &client, const Request &req) noexcept {
+  return perform(req, [&client](const Request &r) {
+    return client.perform(r);
+  });
+}
+
+std::shared_ptr<const Response> Coalescer::perform(
+    ClientPool &pool, const Request &req) noexcept {
+  return perform(req, [&pool](const Request &r) { return pool.perform(r); });
+}
+
+std::vector<std::shared_ptr<const Response>> Coalescer::perform(
+    MultiClient &client, const std::vector<Request> &requests) noexcept {
+  std::vector<std::shared_ptr<const Response>> responses(requests.size());
+  // transfer maps each request to its transfer, unless it is waiting for
+  // a flight started by another thread, which we store into waiting.
+  std::vector<size_t> transfer(requests.size(), SIZE_MAX);
+  std::vector<std::shared_ptr<mkcurl_flight>> waiting(requests.size());
+  std::vector<Request> transfers;
+  std::vector<std::string> keys;
+  std::vector<std::shared_ptr<mkcurl_flight>> flights;
+  std::map<std::string, size_t> batch;
+  for (size_t i = 0; i < requests.size(); ++i) {
+    std::string key;
+    if (!mkcurl_coalesce_key(requests[i], key)) {
+      transfer[i] = transfers.size();
+      transfers.push_back(requests[i]);
+      keys.emplace_back();
+      flights.emplace_back();
+      continue;
+    }
+    auto it = batch.find(key);
+    if (it != batch.end()) {
+      std::unique_lock<std::mutex> lock{impl_->mutex};
+      impl_->coalesced += 1;
+      transfer[i] = it->second;
+      continue;
+    }
+    std::shared_ptr<mkcurl_flight> flight;
+    if (!impl_->join(key, flight)) {
+      waiting[i] = std::move(flight);
+      continue;
+    }
+    batch[key] = transfer[i] = transfers.size();
+    transfers.push_back(requests[i]);
+    keys.push_back(std::move(key));
+    flights.push_back(std::move(flight));
+  }
+  std::vector<Response> results = client.perform(transfers);
+  std::vector<std::shared_ptr<const Response>> shared(results.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    shared[i] = std::make_shared<const Response>(std::move(results[i]));
+    if (flights[i]) {
+      impl_->land(keys[i], flights[i], shared[i]);
+    }
+  }
+  for (size_t i = 0; i < requests.size(); ++i) {
+    responses[i] = waiting[i] ? impl_->wait(waiting[i]) : shared[transfer[i]];
+  }
+  return responses;
+}
+
+uint64_t Coalescer::coalesced() const noexcept {
+  std::unique_lock<std::mutex> lock{impl_->mutex};
+  return impl_->coalesced;
+}
+
+#ifdef MKCURL_ENABLE_METRICS
+// mkcurl_histogram_snapshot copies @p in into @p out.
+static void mkcurl_histogram_snapshot(
+    const mkcurl_histogram &in, Histogram &out) noexcept {
+  for (size_t i = 0; i < mkcurl_histogram_size; ++i) {
+    out.counts[i] = in.counts[i];
+  }
+  out.count = in.count;
+  out.sum = in.sum;
+}
+#endif
+
+Metrics metrics() noexcept {
+  Metrics out;
+  for (auto histogram : {&out.setup_us, &out.transfer_us}) {
+    histogram->bounds.assign(std::begin(mkcurl_histogram_bounds),
+                             std::end(mkcurl_histogram_bounds));
+    histogram->counts.resize(mkcurl_histogram_size);
+  }
+#ifdef MKCURL_ENABLE_METRICS
+  mkcurl_metrics &in = mkcurl_metrics_get();
+  out.transfers = in.transfers;
+  out.failures = in.failures;
+  out.retries = in.retries;
+  out.connects = in.connects;
+  out.reused = in.reused;
+  out.bytes_sent = in.bytes_sent;
+  out.bytes_recv = in.bytes_recv;
+  out.body_callbacks = in.body_callbacks;
+  out.debug_callbacks = in.debug_callbacks;
+  out.live_handles = in.live_handles;
+  mkcurl_histogram_snapshot(in.setup_us, out.setup_us);
+  mkcurl_histogram_snapshot(in.transfer_us, out.transfer_us);
+#endif
+  return out;
+}
+
+// mkcurl_counters returns the name, help and value of the counters.
+static std::vector<std::tuple<const char *, const char *, uint64_t>>
+mkcurl_counters(const Metrics &m) noexcept {
+  return {
+      std::make_tuple("transfers", "Completed transfers.", m.transfers),
+      std::make_tuple("failures", "Failed transfers.", m.failures),
+      std::make_tuple("retries", "Retried transfers.", m.retries),
+      std::make_tuple("connects", "New connections.", m.connects),
+      std::make_tuple("reused", "Transfers reusing a connection.", m.reused),
+      std::make_tuple("bytes_sent", "Bytes sent.", m.bytes_sent),
+      std::make_tuple("bytes_recv", "Bytes received.", m.bytes_recv),
+      std::make_tuple("body_callbacks", "Body callbacks.", m.body_callbacks),
+      std::make_tuple(
+          "debug_callbacks", "Debug callbacks.", m.debug_callbacks),
+  };
+}
+
+std::string metrics_prometheus(const Metrics &m) noexcept {
+  std::stringstream ss;
+  for (auto &counter : mkcurl_counters(m)) {
+    ss << "# HELP mkcurl_" << std::get<0>(counter) << "_total "
+       << std::get<1>(counter) << "\n"
+       << "# TYPE mkcurl_" << std::get<0>(counter) << "_total counter\n"
+       << "mkcurl_" << std::get<0>(counter) << "_total "
+       << std::get<2>(counter) << "\n";
+  }
+  ss << "# HELP mkcurl_live_handles Live cURL easy handles.\n"
+     << "# TYPE mkcurl_live_handles gauge\n"
+     << "mkcurl_live_handles " << m.live_handles << "\n";
+  std::vector<std::tuple<const char *, const char *, const Histogram *>>
+      histograms{
+          std::make_tuple("setup_microseconds", "Time spent configuring.",
+                          &m.setup_us),
+          std::make_tuple("transfer_microseconds",
+                          "Duration of successful transfers.",
+                          &m.transfer_us),
+      };
+  for (auto &histogram : histograms) {
+    const char *name = std::get<0>(histogram);
+    const Histogram &h = *std::get<2>(histogram);
+    ss << "# HELP mkcurl_" << name << " " << std::get<1>(histogram) << "\n"
+       << "# TYPE mkcurl_" << name << " histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < h.counts.size(); ++i) {
+      cumulative += h.counts[i];
+      ss << "mkcurl_" << name << "_bucket{le=\"";
+      if (i < h.bounds.size()) {
+        ss << h.bounds[i];
+      } else {
+        ss << "+Inf";
+      }
+      ss << "\"} " << cumulative << "\n";
+    }
+    ss << "mkcurl_" << name << "_sum " << h.sum << "\n"
+       << "mkcurl_" << name << "_count " << h.count << "\n";
+  }
+  return ss.str();
+}
+
+std::string metrics_statsd(
+    const Metrics &m, const std::string &prefix) noexcept {
+  std::stringstream ss;
+  for (auto &counter : mkcurl_counters(m)) {
+    ss << prefix << std::get<0>(counter) << ":" << std::get<2>(counter)
+       << "|g\n";
+  }
+  ss << prefix << "live_handles:" << m.live_handles << "|g\n"
+     << prefix << "setup_us.count:" << m.setup_us.count << "|g\n"
+     << prefix << "setup_us.sum:" << m.setup_us.sum << "|g\n"
+     << prefix << "transfer_us.count:" << m.transfer_us.count << "|g\n"
+     << prefix << "transfer_us.sum:" << m.transfer_us.sum << "|g\n";
+  return ss.str();
+}
+
 }  // inline namespace MKCURL_INLINE_NAMESPACE
 }  // namespace curl
 }  // namespace mk
@@ -27,6 +27,18 @@ MKMOCK_DEFINE_HOOK(curl_slist_append_headers, curl_slist *);
 
 MKMOCK_DEFINE_HOOK(curl_slist_append_connect_to, curl_slist *);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CONNECT_TO, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_slist_append_resolve, curl_slist *);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_RESOLVE, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_DOH_URL, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_COUNT, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_IP, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_NUM_CONNECTS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_SIZE_DOWNLOAD_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_ACCEPT_ENCODING, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_PRIMARY_PORT, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_IP, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_LOCAL_PORT, CURLcode);
 
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_URL, CURLcode);
 MKMOCK_DEFINE_HOOK(body_size_overflow_inject, bool);
@@ -38,17 +50,40 @@ MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HTTP_VERSION, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_slist_append_Expect_header, curl_slist *);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_POST, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_READFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_READDATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_SEEKFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_SEEKDATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDSIZE_LARGE, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_WRITEFUNCTION, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_WRITEDATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HEADERFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_HEADERDATA, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_TIMEOUT, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_TIMEOUT_MS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CONNECTTIMEOUT_MS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_LOW_SPEED_LIMIT, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_LOW_SPEED_TIME, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_DEBUGFUNCTION, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_DEBUGDATA, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_VERBOSE, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_PROXY, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_FOLLOWLOCATION, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_CERTINFO, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_XFERINFOFUNCTION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_XFERINFODATA, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_NOPROGRESS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAX_RECV_SPEED_LARGE, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAX_SEND_SPEED_LARGE, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_TCP_FASTOPEN, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_SHARE, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_PIPEWAIT, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAXCONNECTS, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_MAXAGE_CONN, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_TCP_KEEPALIVE, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_TCP_KEEPIDLE, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_setopt_CURLOPT_TCP_KEEPINTVL, CURLcode);
 
 MKMOCK_DEFINE_HOOK(curl_easy_perform, CURLcode);
 
@@ -57,12 +92,36 @@ MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_RESPONSE_CODE, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_URL, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_CERTINFO, CURLcode);
 MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_HTTP_VERSION, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_NAMELOOKUP_TIME_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_CONNECT_TIME_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_APPCONNECT_TIME_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_PRETRANSFER_TIME_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_STARTTRANSFER_TIME_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_TOTAL_TIME_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_REDIRECT_TIME_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_SPEED_DOWNLOAD_T, CURLcode);
+MKMOCK_DEFINE_HOOK(curl_easy_getinfo_CURLINFO_SPEED_UPLOAD_T, CURLcode);
+
+MKMOCK_DEFINE_HOOK(curl_multi_init, CURLM *);
+MKMOCK_DEFINE_HOOK(curl_multi_setopt_CURLMOPT_PIPELINING, CURLMcode);
+MKMOCK_DEFINE_HOOK(curl_multi_setopt_CURLMOPT_MAX_HOST_CONNECTIONS, CURLMcode);
+MKMOCK_DEFINE_HOOK(curl_multi_add_handle, CURLMcode);
+MKMOCK_DEFINE_HOOK(curl_multi_perform, CURLMcode);
+MKMOCK_DEFINE_HOOK(curl_multi_wait, CURLMcode);
+MKMOCK_DEFINE_HOOK(curl_multi_poll, CURLMcode);
+
+MKMOCK_DEFINE_HOOK(curl_share_init, CURLSH *);
+MKMOCK_DEFINE_HOOK(curl_share_setopt_CURLSHOPT_LOCKFUNC, CURLSHcode);
+MKMOCK_DEFINE_HOOK(curl_share_setopt_CURLSHOPT_UNLOCKFUNC, CURLSHcode);
+MKMOCK_DEFINE_HOOK(curl_share_setopt_CURLSHOPT_USERDATA, CURLSHcode);
+MKMOCK_DEFINE_HOOK(curl_share_setopt_CURLSHOPT_SHARE, CURLSHcode);
 
 // Include mkcurl implementation
 // -----------------------------
 
 #define MKCURL_INLINE_IMPL  // inline the implementation
 #define MKCURL_MOCK         // enable mocking
+#define MKCURL_ENABLE_METRICS  // enable metrics
 #include "mkcurl.hpp"
 
 // Unit tests
@@ -84,6 +143,341 @@ TEST_CASE("When mkcurl_body_cb_ is passed a NULL userdata") {
   REQUIRE_THROWS(mkcurl_body_cb_((char *)0x123456, 17, 4, nullptr));
 }
 
+TEST_CASE("When mkcurl_body_sink_cb_ is passed zero nmemb") {
+  REQUIRE(mkcurl_body_sink_cb_(nullptr, 17, 0, nullptr) == 0);
+}
+
+TEST_CASE("When mkcurl_body_sink_cb_ would overflow a size_t") {
+  REQUIRE(mkcurl_body_sink_cb_(nullptr, SIZE_MAX / 2, 4, nullptr) == 0);
+}
+
+TEST_CASE("When mkcurl_body_sink_cb_ is passed a NULL ptr") {
+  REQUIRE_THROWS(mkcurl_body_sink_cb_(nullptr, 17, 4, (void *)0x123456));
+}
+
+TEST_CASE("When mkcurl_body_sink_cb_ is passed a NULL userdata") {
+  REQUIRE_THROWS(mkcurl_body_sink_cb_((char *)0x123456, 17, 4, nullptr));
+}
+
+TEST_CASE("mkcurl_body_sink_cb_ passes the data to the sink") {
+  std::string body;
+  mk::curl::Request req;
+  req.body_sink = [&](const char *data, size_t size) {
+    body.append(data, size);
+    return body.size() < 8;
+  };
+  mk::curl::Response res;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &res;
+  xfer.body_sink = &req.body_sink;
+  std::string data = "abcde";
+  REQUIRE(mkcurl_body_sink_cb_((char *)data.c_str(), 1, data.size(),
+                               &xfer) == data.size());
+  REQUIRE(body == "abcde");
+  // The sink returns false to interrupt, which causes a write error
+  REQUIRE(mkcurl_body_sink_cb_((char *)data.c_str(), 1, data.size(),
+                               &xfer) == 0);
+  REQUIRE(body == "abcdeabcde");
+  REQUIRE(res.body_bytes_decoded == 10);
+}
+
+TEST_CASE("When mkcurl_body_sink_cb_ is passed a xfer without sink") {
+  mk::curl::Response res;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &res;
+  std::string data = "abcde";
+  REQUIRE_THROWS(mkcurl_body_sink_cb_((char *)data.c_str(), 1, data.size(),
+                                      &xfer));
+}
+
+TEST_CASE("When mkcurl_body_source_cb_ is passed zero nitems") {
+  REQUIRE(mkcurl_body_source_cb_(nullptr, 17, 0, nullptr) == 0);
+}
+
+TEST_CASE("When mkcurl_body_source_cb_ would overflow a size_t") {
+  REQUIRE(mkcurl_body_source_cb_(nullptr, SIZE_MAX / 2, 4, nullptr) ==
+          CURL_READFUNC_ABORT);
+}
+
+TEST_CASE("When mkcurl_body_source_cb_ is passed a NULL ptr") {
+  REQUIRE_THROWS(mkcurl_body_source_cb_(nullptr, 17, 4, (void *)0x123456));
+}
+
+TEST_CASE("When mkcurl_body_source_cb_ is passed a NULL userdata") {
+  REQUIRE_THROWS(mkcurl_body_source_cb_((char *)0x123456, 17, 4, nullptr));
+}
+
+TEST_CASE("mkcurl_body_source_cb_ reads the data from the source") {
+  std::string body = "0123456789";
+  mk::curl::Request req;
+  req.body_source = [&](char *buffer, size_t size) {
+    if (body == "abort") {
+      return size + 1;
+    }
+    size_t count = (std::min)(size, body.size());
+    memcpy(buffer, body.data(), count);
+    body = body.substr(count);
+    return count;
+  };
+  char buffer[4];
+  REQUIRE(mkcurl_body_source_cb_(buffer, 1, sizeof(buffer),
+                                 &req.body_source) == 4);
+  REQUIRE(std::string(buffer, 4) == "0123");
+  REQUIRE(mkcurl_body_source_cb_(buffer, 1, sizeof(buffer),
+                                 &req.body_source) == 4);
+  REQUIRE(mkcurl_body_source_cb_(buffer, 1, sizeof(buffer),
+                                 &req.body_source) == 2);
+  REQUIRE(std::string(buffer, 2) == "89");
+  REQUIRE(mkcurl_body_source_cb_(buffer, 1, sizeof(buffer),
+                                 &req.body_source) == 0);
+  body = "abort";
+  REQUIRE(mkcurl_body_source_cb_(buffer, 1, sizeof(buffer),
+                                 &req.body_source) == CURL_READFUNC_ABORT);
+}
+
+TEST_CASE("When mkcurl_body_source_seek_cb_ is passed a NULL userdata") {
+  REQUIRE_THROWS(mkcurl_body_source_seek_cb_(nullptr, 0, SEEK_SET));
+}
+
+TEST_CASE("mkcurl_body_source_seek_cb_ rewinds the source") {
+  mk::curl::Request req;
+  std::vector<int64_t> offsets;
+  req.body_source_rewind = [&](int64_t offset) {
+    offsets.push_back(offset);
+    return offset < 10;
+  };
+  REQUIRE(mkcurl_body_source_seek_cb_(&req.body_source_rewind, 0,
+                                      SEEK_SET) == CURL_SEEKFUNC_OK);
+  REQUIRE(mkcurl_body_source_seek_cb_(&req.body_source_rewind, 17,
+                                      SEEK_SET) == CURL_SEEKFUNC_CANTSEEK);
+  REQUIRE(mkcurl_body_source_seek_cb_(&req.body_source_rewind, 0,
+                                      SEEK_END) == CURL_SEEKFUNC_CANTSEEK);
+  REQUIRE(offsets == std::vector<int64_t>{0, 17});
+}
+
+TEST_CASE("When mkcurl_xferinfo_cb_ is passed a NULL clientp") {
+  REQUIRE_THROWS(mkcurl_xferinfo_cb_(nullptr, 0, 0, 0, 0));
+}
+
+TEST_CASE("mkcurl_xferinfo_cb_ takes samples") {
+  mk::curl::Response res;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &res;
+  xfer.sample_interval_us = 1000000;
+
+  SECTION("unless it cannot know the elapsed time") {
+    REQUIRE(mkcurl_xferinfo_cb_(&xfer, 0, 0, 0, 0) == 0);
+    REQUIRE(res.samples.empty());
+  }
+
+  mk::curl::mkcurl_uptr handle{curl_easy_init()};
+  REQUIRE(handle);
+  xfer.handle = handle.get();
+
+  SECTION("at most once per interval") {
+    REQUIRE(mkcurl_xferinfo_cb_(&xfer, 100, 10, 200, 20) == 0);
+    REQUIRE(mkcurl_xferinfo_cb_(&xfer, 100, 11, 200, 21) == 0);
+    REQUIRE(res.samples.size() == 1);
+    REQUIRE(res.samples[0].bytes_recv == 10);
+    REQUIRE(res.samples[0].bytes_sent == 20);
+  }
+
+  SECTION("passing them to the sink, if any") {
+    std::vector<mk::curl::Sample> samples;
+    std::function<void(const mk::curl::Sample &)> sink =
+        [&](const mk::curl::Sample &sample) { samples.push_back(sample); };
+    xfer.sample_sink = &sink;
+    REQUIRE(mkcurl_xferinfo_cb_(&xfer, 100, 10, 200, 20) == 0);
+    REQUIRE(res.samples.empty());
+    REQUIRE(samples.size() == 1);
+  }
+
+  SECTION("restarting with each attempt") {
+    xfer.sample_next = 5000000;
+    REQUIRE(mkcurl_xferinfo_cb_(&xfer, 100, 10, 200, 20) == 0);
+    REQUIRE(res.samples.size() == 1);
+  }
+}
+
+TEST_CASE("mkcurl_xferinfo_cb_ checks the cancellation") {
+  mk::curl::Cancellation cancellation;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.cancellation = &cancellation;
+  REQUIRE(mkcurl_xferinfo_cb_(&xfer, 0, 0, 0, 0) == 0);
+  cancellation.cancel();
+  REQUIRE(cancellation.cancelled());
+  REQUIRE(mkcurl_xferinfo_cb_(&xfer, 0, 0, 0, 0) != 0);
+}
+
+TEST_CASE("We do not retry cancelled requests") {
+  mk::curl::Request req;
+  req.url = "http://www.example.com/";
+  req.retry_policy.initial_backoff_ms = 1;
+  req.cancellation = std::make_shared<mk::curl::Cancellation>();
+  req.cancellation->cancel();
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+    mk::curl::Response resp = mk::curl::perform(req);
+    REQUIRE(resp.error == CURLE_COULDNT_CONNECT);
+    REQUIRE(resp.attempts.size() == 1);
+  });
+}
+
+TEST_CASE("We stop waiting to retry when cancelled") {
+  mk::curl::Request req;
+  req.url = "http://www.example.com/";
+  req.retry_policy.initial_backoff_ms = 60000;
+  req.retry_policy.max_backoff_ms = 60000;
+  req.retry_policy.jitter = 0.0;
+  req.cancellation = std::make_shared<mk::curl::Cancellation>();
+  std::thread canceller{[&req]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    req.cancellation->cancel();
+  }};
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+    auto begin = std::chrono::steady_clock::now();
+    mk::curl::Response resp = mk::curl::perform(req);
+    REQUIRE(std::chrono::steady_clock::now() - begin <
+            std::chrono::seconds(10));
+    REQUIRE(resp.error == CURLE_ABORTED_BY_CALLBACK);
+    REQUIRE(resp.attempts.size() == 1);
+  });
+  canceller.join();
+}
+
+TEST_CASE("When mkcurl_header_cb_ is passed zero nmemb") {
+  REQUIRE(mkcurl_header_cb_(nullptr, 17, 0, nullptr) == 0);
+}
+
+TEST_CASE("When mkcurl_header_cb_ would overflow a size_t") {
+  REQUIRE(mkcurl_header_cb_(nullptr, SIZE_MAX / 2, 4, nullptr) == 0);
+}
+
+TEST_CASE("When mkcurl_header_cb_ is passed a NULL ptr") {
+  REQUIRE_THROWS(mkcurl_header_cb_(nullptr, 17, 4, (void *)0x123456));
+}
+
+TEST_CASE("When mkcurl_header_cb_ is passed a NULL userdata") {
+  REQUIRE_THROWS(mkcurl_header_cb_((char *)0x123456, 17, 4, nullptr));
+}
+
+TEST_CASE("mkcurl_header_cb_ reserves the body using the Content-Length") {
+  mk::curl::Response res;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &res;
+  xfer.body_reserve_max = 4096;
+  auto header = [&](std::string s) {
+    return mkcurl_header_cb_((char *)s.c_str(), 1, s.size(), &xfer);
+  };
+  REQUIRE(header("HTTP/1.1 200 Ok\r\n") == 17);
+  REQUIRE(res.body.capacity() < 1024);
+  REQUIRE(header("content-LENGTH:  1024\r\n") == 23);
+  REQUIRE(res.body.capacity() >= 1024);
+  REQUIRE(header("Content-Length: 1048576\r\n") == 25);
+  REQUIRE(res.body.capacity() >= 4096);
+  REQUIRE(res.body.capacity() < 1048576);
+}
+
+TEST_CASE("mkcurl_header_cb_ does not reserve with a body sink") {
+  mk::curl::Response res;
+  mk::curl::mkcurl_xfer xfer;
+  std::function<bool(const char *, size_t)> sink = [](const char *, size_t) {
+    return true;
+  };
+  xfer.res = &res;
+  xfer.body_reserve_max = 4096;
+  xfer.body_sink = &sink;
+  auto header = [&](std::string s) {
+    return mkcurl_header_cb_((char *)s.c_str(), 1, s.size(), &xfer);
+  };
+  REQUIRE(header("HTTP/1.1 200 Ok\r\n") == 17);
+  REQUIRE(header("Content-Length: 1024\r\n") == 22);
+  REQUIRE(res.body.capacity() < 1024);
+  std::string value;
+  REQUIRE(mk::curl::find_header(res, "content-length", value));
+  REQUIRE(value == "1024");
+}
+
+TEST_CASE("mkcurl_header_cb_ parses the headers of each response") {
+  mk::curl::Response res;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &res;
+  auto header = [&](std::string s) {
+    return mkcurl_header_cb_((char *)s.c_str(), 1, s.size(), &xfer);
+  };
+  std::string value;
+  REQUIRE(!mk::curl::find_header(res, "location", value));
+  header("Ignored: before the status line\r\n");
+  header("HTTP/1.1 302 Found\r\n");
+  header("Location: /next\r\n");
+  header("X-Multi: first\r\n");
+  header("\r\n");
+  REQUIRE(res.header_hops == 1);
+  REQUIRE(mk::curl::find_header(res, "LOCATION", value));
+  REQUIRE(value == "/next");
+  header("HTTP/2 200 \r\n");
+  header("content-type:text/plain \r\n");
+  header("X-Multi:  second\r\n");
+  header("  continued\t\r\n");
+  header("X-Multi: third\r\n");
+  header("Not a header\r\n");
+  header(": no name\r\n");
+  header("X-Empty:\r\n");
+  header("\r\n");
+  REQUIRE(res.header_hops == 2);
+  REQUIRE(res.header_entries.size() == 6);
+  auto &entry = res.header_entries[2];
+  REQUIRE(entry.hop == 1);
+  REQUIRE(res.header_arena.substr(entry.name_offset, entry.name_size) ==
+          "content-type");
+  REQUIRE(res.header_arena.substr(entry.value_offset, entry.value_size) ==
+          "text/plain");
+  REQUIRE(!mk::curl::find_header(res, "location", value));
+  REQUIRE(mk::curl::find_header(res, "x-multi", value));
+  REQUIRE(value == "second continued");
+  REQUIRE(mk::curl::find_header(res, "x-empty", value));
+  REQUIRE(value == "");
+  REQUIRE(!mk::curl::find_header(res, "x-multi-not", value));
+}
+
+TEST_CASE("mkcurl_parse_decimal works as intended") {
+  auto parse = [](std::string s, int64_t &value) {
+    return mk::curl::mkcurl_parse_decimal(s.data(), s.size(), value);
+  };
+  int64_t value = 0;
+  REQUIRE(parse("1234", value));
+  REQUIRE(value == 1234);
+  REQUIRE(parse("0", value));
+  REQUIRE(value == 0);
+  REQUIRE(parse("9223372036854775807", value));
+  REQUIRE(value == INT64_MAX);
+  value = 0;
+  REQUIRE(!parse("", value));
+  REQUIRE(!parse("12a", value));
+  REQUIRE(!parse("-1", value));
+  REQUIRE(!parse("9223372036854775808", value));
+  REQUIRE(value == 0);
+}
+
+TEST_CASE("mkcurl_content_length works as intended") {
+  mk::curl::Response res;
+  auto parse = [&](std::string s, int64_t &length) {
+    return mk::curl::mkcurl_parse_header(res, s.data(), s.size()) &&
+           mk::curl::mkcurl_content_length(res, res.header_entries.back(),
+                                           length);
+  };
+  int64_t length = 0;
+  REQUIRE(!parse("HTTP/1.1 200 Ok\r\n", length));
+  REQUIRE(parse("Content-Length: 1234\r\n", length));
+  REQUIRE(length == 1234);
+  REQUIRE(parse("content-length:0", length));
+  REQUIRE(length == 0);
+  REQUIRE(!parse("Content-Type: text/plain\r\n", length));
+  REQUIRE(!parse("Content-Length:\r\n", length));
+  REQUIRE(!parse("Content-Length: 12a\r\n", length));
+  REQUIRE(!parse("Content-Length: 18446744073709551616\r\n", length));
+  REQUIRE(length == 0);
+}
+
 TEST_CASE("When mkcurl_debug_cb_ is passed a NULL data") {
   REQUIRE_THROWS(mkcurl_debug_cb_(nullptr, CURLINFO_TEXT, nullptr, 0,
                                  (void *)0x123456));
@@ -98,9 +492,107 @@ TEST_CASE("When mkcurl_debug_cb_ is passed a unexpected curl_infotype") {
   // Implementation note: here the return value doesn't matter much; what
   // really matters is that the code does not misbehave.
   mk::curl::Response resp;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &resp;
   std::string data;
   REQUIRE(mkcurl_debug_cb_(nullptr, CURLINFO_END, (char *)data.c_str(),
-                          data.size(), &resp) == 0);
+                          data.size(), &xfer) == 0);
+}
+
+// feed_debug_cb passes to mkcurl_debug_cb_ a typical sequence of events.
+static void feed_debug_cb(mk::curl::mkcurl_xfer &xfer) {
+  std::string text = "Connected to 127.0.0.1\n";
+  std::string hdrs = "HTTP/1.1 200 Ok\r\nContent-Length: 6\r\n";
+  std::string data = "abc";
+  REQUIRE(mkcurl_debug_cb_(nullptr, CURLINFO_TEXT, (char *)text.c_str(),
+                          text.size(), &xfer) == 0);
+  REQUIRE(mkcurl_debug_cb_(nullptr, CURLINFO_HEADER_IN, (char *)hdrs.c_str(),
+                          hdrs.size(), &xfer) == 0);
+  REQUIRE(mkcurl_debug_cb_(nullptr, CURLINFO_DATA_IN, (char *)data.c_str(),
+                          data.size(), &xfer) == 0);
+  REQUIRE(mkcurl_debug_cb_(nullptr, CURLINFO_DATA_IN, (char *)data.c_str(),
+                          data.size(), &xfer) == 0);
+  mk::curl::mkcurl_flush_data_log(xfer);
+}
+
+TEST_CASE("mkcurl_debug_cb_ honours the log level") {
+  mk::curl::Response resp;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &resp;
+
+  SECTION("With LogLevel::none") {
+    xfer.log_level = mk::curl::LogLevel::none;
+    feed_debug_cb(xfer);
+    REQUIRE(resp.logs.empty());
+  }
+
+  SECTION("With LogLevel::summary") {
+    xfer.log_level = mk::curl::LogLevel::summary;
+    feed_debug_cb(xfer);
+    REQUIRE(resp.logs.size() == 3);
+    REQUIRE(resp.logs[0].line == "Connected to 127.0.0.1");
+    REQUIRE(resp.logs[1].line == "< HTTP/1.1 200 Ok\r");
+    REQUIRE(resp.logs[2].line == "< Content-Length: 6\r");
+  }
+
+  SECTION("With LogLevel::full") {
+    xfer.log_level = mk::curl::LogLevel::full;
+    feed_debug_cb(xfer);
+    REQUIRE(resp.logs.size() == 4);
+    REQUIRE(resp.logs[3].line == "<data: 6");
+  }
+
+  // Headers and byte counters must not depend on the log level.
+  REQUIRE(resp.response_headers == "HTTP/1.1 200 Ok\r\nContent-Length: 6\r\n");
+  REQUIRE(resp.bytes_recv == 42);
+}
+
+TEST_CASE("mkcurl_debug_cb_ detects TLS session resumption") {
+  mk::curl::Response resp;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &resp;
+  std::string text;
+  SECTION("With the cURL 7.x message") {
+    text = "SSL re-using session ID\n";
+  }
+  SECTION("With the cURL 8.x message") {
+    text = "SSL reusing session ID\n";
+  }
+  REQUIRE(mkcurl_debug_cb_(nullptr, CURLINFO_TEXT, (char *)text.c_str(),
+                           text.size(), &xfer) == 0);
+  REQUIRE(resp.tls_session_resumed);
+}
+
+TEST_CASE("mkcurl_debug_cb_ works with compact logs") {
+  mk::curl::Response resp;
+  resp.compact_logs = true;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &resp;
+  feed_debug_cb(xfer);
+  REQUIRE(resp.logs.empty());
+  REQUIRE(resp.log_entries.size() == 4);
+  std::vector<std::string> lines;
+  for (auto &entry : resp.log_entries) {
+    lines.push_back(resp.log_arena.substr(entry.offset, entry.size));
+  }
+  REQUIRE(lines[0] == "Connected to 127.0.0.1");
+  REQUIRE(lines[1] == "< HTTP/1.1 200 Ok\r");
+  REQUIRE(lines[2] == "< Content-Length: 6\r");
+  REQUIRE(lines[3] == "<data: 6");
+}
+
+TEST_CASE("Request::compact_logs also applies to errors") {
+  mk::curl::Request req;
+  req.compact_logs = true;
+  mk::curl::Response resp = mk::curl::perform(req);
+  REQUIRE(resp.error == CURLE_URL_MALFORMAT);
+  REQUIRE(resp.compact_logs);
+  REQUIRE(resp.logs.empty());
+  REQUIRE(!resp.log_entries.empty());
+  auto &last = resp.log_entries.back();
+  REQUIRE(last.offset + last.size == resp.log_arena.size());
+  REQUIRE(resp.log_arena.substr(last.offset, last.size).find(
+              "curl_easy_perform: ") == 0);
 }
 
 TEST_CASE("When curl_easy_init fails") {
@@ -129,6 +621,501 @@ TEST_CASE("When curl_slist_append fails for connect_to") {
   });
 }
 
+TEST_CASE("When curl_slist_append fails for connect_addresses") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_slist_append_resolve, nullptr, {
+    mk::curl::Request req;
+    req.url = "https://www.example.com/";
+    req.connect_addresses = {"127.0.0.1"};
+    mk::curl::Response resp = mk::curl::perform(req);
+    REQUIRE(resp.error == CURLE_OUT_OF_MEMORY);
+  });
+}
+
+TEST_CASE("mkcurl_origin works as intended") {
+  REQUIRE(mk::curl::mkcurl_origin("http://www.example.com") ==
+          "www.example.com:80");
+  REQUIRE(mk::curl::mkcurl_origin("HTTPS://www.Example.com/") ==
+          "www.example.com:443");
+  REQUIRE(mk::curl::mkcurl_origin("http://x:y@www.example.com:8080/") ==
+          "www.example.com:8080");
+  REQUIRE(mk::curl::mkcurl_origin("https://[::1]/a:b") == "[::1]:443");
+  REQUIRE(mk::curl::mkcurl_origin("https://[::1]:8443?x=y:1") ==
+          "[::1]:8443");
+  REQUIRE(mk::curl::mkcurl_origin("ftp://www.example.com/").empty());
+  REQUIRE(mk::curl::mkcurl_origin("http://www.example.com:65536/").empty());
+  REQUIRE(mk::curl::mkcurl_origin("http://www.example.com:8a/").empty());
+  REQUIRE(mk::curl::mkcurl_origin("www.example.com").empty());
+}
+
+TEST_CASE("mkcurl_pin_addresses only redirects the URL origin") {
+  std::string connect_to, resolve;
+  REQUIRE(mk::curl::mkcurl_pin_addresses(
+      "https://www.example.com/", {"127.0.0.1", "::1"}, connect_to, resolve));
+  std::string prefix = "www.example.com:443:mkcurl-";
+  REQUIRE(connect_to.compare(0, prefix.size(), prefix) == 0);
+  size_t host = connect_to.find("mkcurl-");
+  std::string fake = connect_to.substr(host, connect_to.size() - host - 4);
+  REQUIRE(connect_to == prefix.substr(0, host) + fake + ":443");
+#if LIBCURL_VERSION_NUM >= 0x074b00
+  REQUIRE(resolve == "+" + fake + ":443:127.0.0.1,[::1]");
+#else
+  REQUIRE(resolve == fake + ":443:127.0.0.1,[::1]");
+#endif
+  REQUIRE(!mk::curl::mkcurl_pin_addresses(
+      "ftp://www.example.com/", {"127.0.0.1"}, connect_to, resolve));
+}
+
+TEST_CASE("We connect to the connect_addresses") {
+  mk::curl::Request req;
+  req.retries = 0;
+  req.connect_addresses = {"127.0.0.1", "127.0.0.2"};
+
+  SECTION("without resolving the host") {
+    req.url = "http://www.example.com:1/";
+    mk::curl::Response resp = mk::curl::perform(req);
+    REQUIRE(resp.error == CURLE_COULDNT_CONNECT);
+    size_t trying = 0;
+    for (auto &log : resp.logs) {
+      if (log.line.find("Trying 127.0.0.") != std::string::npos) {
+        trying += 1;
+      }
+    }
+    REQUIRE(trying == 2);
+  }
+
+  SECTION("unless we cannot determine the origin") {
+    req.url = "ftp://www.example.com/";
+    mk::curl::Response resp = mk::curl::perform(req);
+    REQUIRE(resp.error == CURLE_URL_MALFORMAT);
+  }
+}
+
+TEST_CASE("DNSCache works as intended") {
+  mk::curl::DNSCache cache;
+  REQUIRE(cache.learn_ttl_ms() == 0);
+  cache.add("www.Example.com", 443, {"127.0.0.1", "::1"}, 0);
+  cache.add("www.example.com", 80, {"127.0.0.2"}, 10);
+  cache.add("www.example.org", 80, {"127.0.0.3"}, 1);
+  REQUIRE(cache.lookup("WWW.EXAMPLE.COM", 443) ==
+          std::vector<std::string>{"127.0.0.1", "::1"});
+  REQUIRE(cache.lookup("www.example.com", 80) ==
+          std::vector<std::string>{"127.0.0.2"});
+  REQUIRE(cache.lookup("www.example.com", 8080).empty());
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  REQUIRE(cache.lookup("www.example.com", 80).empty());
+  REQUIRE(cache.size() == 1);
+  cache.add("www.example.com", 443, {}, 0);
+  REQUIRE(cache.size() == 0);
+  cache.add("www.example.com", 443, {"127.0.0.1"}, 0);
+  cache.remove("www.example.com", 443);
+  REQUIRE(cache.size() == 0);
+  cache.add("www.example.com", 443, {"127.0.0.1"}, 0);
+  cache.clear();
+  REQUIRE(cache.size() == 0);
+}
+
+TEST_CASE("We connect to the addresses in the DNSCache") {
+  mk::curl::Request req;
+  req.retries = 0;
+  req.url = "http://www.example.com:1/";
+  req.dns_cache = std::make_shared<mk::curl::DNSCache>(60000);
+  req.dns_cache->add("www.example.com", 1, {"127.0.0.1"}, 0);
+  mk::curl::Response resp = mk::curl::perform(req);
+  REQUIRE(resp.error == CURLE_COULDNT_CONNECT);
+  bool found = false;
+  for (auto &log : resp.logs) {
+    found = found || log.line.find("Trying 127.0.0.1:1") != std::string::npos;
+  }
+  REQUIRE(found);
+}
+
+TEST_CASE("DNSCache does not learn when cURL cannot tell the address") {
+  mk::curl::Request req;
+  req.url = "http://www.example.com/";
+  req.dns_cache = std::make_shared<mk::curl::DNSCache>(60000);
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    SECTION("when curl_easy_getinfo fails for CURLINFO_REDIRECT_COUNT") {
+      MKMOCK_WITH_ENABLED_HOOK(
+          curl_easy_getinfo_CURLINFO_REDIRECT_COUNT, CURL_LAST, {
+            REQUIRE(mk::curl::perform(req).error == CURLE_OK);
+          });
+    }
+    SECTION("when curl_easy_getinfo fails for CURLINFO_PRIMARY_IP") {
+      // This also fails the transfer since we fill Response::primary_ip.
+      MKMOCK_WITH_ENABLED_HOOK(
+          curl_easy_getinfo_CURLINFO_PRIMARY_IP, CURL_LAST, {
+            REQUIRE(mk::curl::perform(req).error == CURL_LAST);
+          });
+    }
+    SECTION("when there is no address") {
+      REQUIRE(mk::curl::perform(req).error == CURLE_OK);
+    }
+  });
+  REQUIRE(req.dns_cache->size() == 0);
+}
+
+// mkcurl_cacheable returns a response with @p status and @p headers.
+static mk::curl::Response mkcurl_cacheable(
+    int64_t status, std::vector<std::string> headers, std::string body) {
+  mk::curl::Response res;
+  mk::curl::mkcurl_xfer xfer;
+  xfer.res = &res;
+  headers.insert(headers.begin(), "HTTP/1.1 " + std::to_string(status) +
+                                      " Whatever");
+  headers.push_back("");
+  for (auto &header : headers) {
+    header += "\r\n";
+    mkcurl_header_cb_((char *)header.c_str(), 1, header.size(), &xfer);
+  }
+  res.status_code = status;
+  res.body = std::move(body);
+  return res;
+}
+
+TEST_CASE("ResponseCache works as intended") {
+  mk::curl::ResponseCache cache{16};
+  mk::curl::Request req;
+  req.url = "http://www.example.com/";
+  mk::curl::Response res;
+  bool fresh = false;
+  REQUIRE(!cache.get(req, res, fresh));
+
+  SECTION("when the response has a max-age") {
+    cache.put(req, mkcurl_cacheable(200, {"Cache-Control: max-age=60"}, "a"));
+    REQUIRE(cache.get(req, res, fresh));
+    REQUIRE(fresh);
+    REQUIRE(res.body == "a");
+    REQUIRE(cache.bytes() == 1);
+  }
+
+  SECTION("when the response only has validators") {
+    cache.put(req, mkcurl_cacheable(200, {"ETag: \"x\""}, "a"));
+    REQUIRE(cache.get(req, res, fresh));
+    REQUIRE(!fresh);
+    cache.put(req, mkcurl_cacheable(304, {"Cache-Control: max-age=60"}, ""));
+    REQUIRE(cache.get(req, res, fresh));
+    REQUIRE(fresh);
+    REQUIRE(res.body == "a");
+  }
+
+  SECTION("when a 304 does not have a max-age") {
+    cache.put(req, mkcurl_cacheable(
+                       200, {"Cache-Control: max-age=60", "ETag: \"x\""}, "a"));
+    cache.put(req, mkcurl_cacheable(304, {}, ""));
+    REQUIRE(cache.get(req, res, fresh));
+    REQUIRE(fresh);
+    cache.put(req, mkcurl_cacheable(304, {"Cache-Control: no-cache"}, ""));
+    REQUIRE(cache.get(req, res, fresh));
+    REQUIRE(!fresh);
+  }
+
+  SECTION("when the response was transferred") {
+    auto transferred = mkcurl_cacheable(
+        200, {"Cache-Control: max-age=60"}, "a");
+    transferred.timings.total = 17;
+    transferred.primary_ip = "127.0.0.1";
+    transferred.primary_port = 80;
+    transferred.local_ip = "127.0.0.1";
+    transferred.local_port = 54321;
+    cache.put(req, transferred);
+    REQUIRE(cache.get(req, res, fresh));
+    REQUIRE(res.timings.total == 0);
+    REQUIRE(res.primary_ip.empty());
+    REQUIRE(res.primary_port == 0);
+    REQUIRE(res.local_ip.empty());
+    REQUIRE(res.local_port == 0);
+  }
+
+  SECTION("when the response is not cacheable") {
+    cache.put(req, mkcurl_cacheable(200, {}, "a"));
+    cache.put(req, mkcurl_cacheable(
+                       200, {"Cache-Control: no-store, max-age=60"}, "a"));
+    cache.put(req, mkcurl_cacheable(
+                       200, {"Cache-Control: max-age=60", "Vary: *"}, "a"));
+    cache.put(req, mkcurl_cacheable(404, {"Cache-Control: max-age=60"}, "a"));
+    cache.put(req, mkcurl_cacheable(
+                       200, {"Cache-Control: max-age=60"}, std::string(17, 'a')));
+    req.method = "POST";
+    cache.put(req, mkcurl_cacheable(200, {"Cache-Control: max-age=60"}, "a"));
+    REQUIRE(cache.size() == 0);
+  }
+
+  SECTION("when the response varies") {
+    auto vary = mkcurl_cacheable(
+        200, {"Cache-Control: max-age=60", "Vary: Accept-Language"}, "en");
+    req.headers = {"accept-language:  en"};
+    cache.put(req, vary);
+    req.headers = {"Accept-Language: it"};
+    REQUIRE(!cache.get(req, res, fresh));
+    vary.body = "it";
+    cache.put(req, vary);
+    REQUIRE(cache.size() == 2);
+    req.headers = {"Accept-Language: en"};
+    REQUIRE(cache.get(req, res, fresh));
+    REQUIRE(res.body == "en");
+  }
+
+  SECTION("when we exceed the maximum size") {
+    auto more = req;
+    more.url += "more";
+    cache.put(req, mkcurl_cacheable(
+                       200, {"Cache-Control: max-age=60"}, std::string(8, 'a')));
+    cache.put(more, mkcurl_cacheable(
+                        200, {"Cache-Control: max-age=60"}, std::string(8, 'b')));
+    REQUIRE(cache.get(req, res, fresh));
+    cache.put(more, mkcurl_cacheable(
+                        200, {"Cache-Control: max-age=60"}, std::string(9, 'c')));
+    REQUIRE(cache.size() == 1);
+    REQUIRE(cache.bytes() == 9);
+    REQUIRE(!cache.get(req, res, fresh));
+  }
+
+  cache.clear();
+  REQUIRE(cache.size() == 0);
+  REQUIRE(cache.bytes() == 0);
+}
+
+TEST_CASE("Client uses the fresh responses in the ResponseCache") {
+  mk::curl::Request req;
+  req.url = "http://www.example.com/";
+  req.response_cache = std::make_shared<mk::curl::ResponseCache>();
+  req.response_cache->put(
+      req, mkcurl_cacheable(200, {"Cache-Control: max-age=60"}, "cached"));
+  mk::curl::Client client;
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURL_LAST, {
+    mk::curl::Response resp = client.perform(req);
+    REQUIRE(resp.error == CURLE_OK);
+    REQUIRE(resp.from_cache);
+    REQUIRE(!resp.revalidated);
+    REQUIRE(resp.body == "cached");
+    req.method = "HEAD";
+    REQUIRE(!client.perform(req).from_cache);
+  });
+  REQUIRE(client.stats().connects == 0);
+}
+
+TEST_CASE("Client recycles the Response it is passed") {
+  mk::curl::Client client;
+  mk::curl::Request req;
+  mk::curl::Response res;
+  res.body.assign(4096, 'x');
+  res.header_arena.assign(1024, 'x');
+  res.status_code = 500;
+  res.from_cache = true;
+  res.logs.resize(16);
+  size_t capacity = res.body.capacity();
+  client.perform(req, res);
+  REQUIRE(res.error == CURLE_URL_MALFORMAT);
+  REQUIRE(res.body.empty());
+  REQUIRE(res.body.capacity() == capacity);
+  REQUIRE(res.header_arena.empty());
+  REQUIRE(res.status_code == 0);
+  REQUIRE(!res.from_cache);
+  REQUIRE(res.logs.size() < 16);
+  REQUIRE(client.stats().requests == 1);
+}
+
+TEST_CASE("Coalescer works as intended") {
+  mk::curl::Coalescer coalescer;
+  mk::curl::Request req;
+  req.url = "http://www.example.com/";
+  std::atomic<int> transfers{0};
+  auto perform = [&](const mk::curl::Request &) {
+    transfers += 1;
+    while (coalescer.coalesced() < 3) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    mk::curl::Response res;
+    res.body = "shared";
+    return res;
+  };
+  std::vector<std::shared_ptr<const mk::curl::Response>> responses(4);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < responses.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      responses[i] = coalescer.perform(req, perform);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  REQUIRE(transfers == 1);
+  for (auto &res : responses) {
+    REQUIRE(res.get() == responses[0].get());
+  }
+  REQUIRE(responses[0]->body == "shared");
+  req.method = "POST";
+  auto res = coalescer.perform(req, [&](const mk::curl::Request &) {
+    transfers += 1;
+    return mk::curl::Response{};
+  });
+  REQUIRE(res != responses[0]);
+  REQUIRE(transfers == 2);
+  REQUIRE(coalescer.coalesced() == 3);
+  req.method = "GET";
+  res = coalescer.perform(req, [&](const mk::curl::Request &) {
+    mk::curl::Request other = req;
+    other.connect_addresses = {"127.0.0.1"};
+    coalescer.perform(other, [&](const mk::curl::Request &) {
+      transfers += 1;
+      return mk::curl::Response{};
+    });
+    transfers += 1;
+    return mk::curl::Response{};
+  });
+  REQUIRE(transfers == 4);
+  REQUIRE(coalescer.coalesced() == 3);
+  res = coalescer.perform(req, [&](const mk::curl::Request &) {
+    mk::curl::Request other = req;
+    other.dns_cache = std::make_shared<mk::curl::DNSCache>();
+    coalescer.perform(other, [&](const mk::curl::Request &) {
+      transfers += 1;
+      return mk::curl::Response{};
+    });
+    transfers += 1;
+    return mk::curl::Response{};
+  });
+  REQUIRE(transfers == 6);
+  REQUIRE(coalescer.coalesced() == 3);
+  req.connect_addresses.clear();
+  req.cancellation = std::make_shared<mk::curl::Cancellation>();
+  res = coalescer.perform(req, [&](const mk::curl::Request &) {
+    coalescer.perform(req, [&](const mk::curl::Request &) {
+      transfers += 1;
+      return mk::curl::Response{};
+    });
+    transfers += 1;
+    return mk::curl::Response{};
+  });
+  REQUIRE(transfers == 8);
+  REQUIRE(coalescer.coalesced() == 3);
+}
+
+TEST_CASE("We collect metrics") {
+  mk::curl::Metrics before = mk::curl::metrics();
+  {
+    mk::curl::Client client;
+    mk::curl::Request req;
+    req.url = "http://www.example.com/";
+    req.retries = 1;
+    req.retry_policy.initial_backoff_ms = 1;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+      REQUIRE(client.perform(req).error == CURLE_COULDNT_CONNECT);
+    });
+    REQUIRE(mk::curl::metrics().live_handles == before.live_handles + 1);
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+      REQUIRE(client.perform(req).error == CURLE_OK);
+    });
+  }
+  mk::curl::Metrics after = mk::curl::metrics();
+  REQUIRE(after.transfers == before.transfers + 2);
+  REQUIRE(after.failures == before.failures + 1);
+  REQUIRE(after.retries == before.retries + 1);
+  REQUIRE(after.live_handles == before.live_handles);
+  REQUIRE(after.setup_us.count == before.setup_us.count + 2);
+  REQUIRE(after.transfer_us.count == before.transfer_us.count + 1);
+  REQUIRE(after.setup_us.counts.size() == after.setup_us.bounds.size() + 1);
+}
+
+TEST_CASE("We can export metrics") {
+  mk::curl::Metrics m = mk::curl::metrics();
+  m.transfers = 17;
+  m.live_handles = 3;
+  m.setup_us.counts.assign(m.setup_us.counts.size(), 0);
+  m.setup_us.counts[0] = 1;
+  m.setup_us.counts.back() = 2;
+  m.setup_us.count = 3;
+  m.setup_us.sum = 100000000;
+  SECTION("using the Prometheus text format") {
+    std::string out = mk::curl::metrics_prometheus(m);
+    REQUIRE(out.find("# TYPE mkcurl_transfers_total counter\n"
+                     "mkcurl_transfers_total 17\n") != std::string::npos);
+    REQUIRE(out.find("mkcurl_live_handles 3\n") != std::string::npos);
+    REQUIRE(out.find("mkcurl_setup_microseconds_bucket{le=\"10\"} 1\n"
+                     "mkcurl_setup_microseconds_bucket{le=\"25\"} 1\n") !=
+            std::string::npos);
+    REQUIRE(out.find("mkcurl_setup_microseconds_bucket{le=\"+Inf\"} 3\n"
+                     "mkcurl_setup_microseconds_sum 100000000\n"
+                     "mkcurl_setup_microseconds_count 3\n") !=
+            std::string::npos);
+  }
+  SECTION("using StatsD gauges") {
+    std::string out = mk::curl::metrics_statsd(m, "app.mkcurl.");
+    REQUIRE(out.find("app.mkcurl.transfers:17|g\n") == 0);
+    REQUIRE(out.find("app.mkcurl.live_handles:3|g\n") != std::string::npos);
+    REQUIRE(out.find("app.mkcurl.setup_us.count:3|g\n") != std::string::npos);
+  }
+}
+
+TEST_CASE("Client applies its ConnectionPolicy") {
+  mk::curl::ConnectionPolicy policy;
+  policy.max_connections = 4;
+  policy.idle_timeout = 60;
+  policy.keepalive_interval = 30;
+  mk::curl::Request req;
+  req.url = "http://www.example.com/";
+  auto check = [&](CURLcode expect) {
+    mk::curl::Client client{nullptr, policy};
+    mk::curl::Response resp = client.perform(req);
+    REQUIRE(resp.error == expect);
+    mk::curl::PreparedRequest prepared{req};
+    REQUIRE(client.perform(prepared).error == expect);
+  };
+  SECTION("when all goes well") {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+      check(CURLE_OK);
+    });
+  }
+  SECTION("when curl_easy_setopt fails for CURLOPT_MAXCONNECTS") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_setopt_CURLOPT_MAXCONNECTS, CURL_LAST,
+        { check(CURL_LAST); });
+  }
+#if LIBCURL_VERSION_NUM >= 0x074100
+  SECTION("when curl_easy_setopt fails for CURLOPT_MAXAGE_CONN") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_setopt_CURLOPT_MAXAGE_CONN, CURL_LAST,
+        { check(CURL_LAST); });
+  }
+#endif
+  SECTION("when curl_easy_setopt fails for CURLOPT_TCP_KEEPALIVE") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_setopt_CURLOPT_TCP_KEEPALIVE, CURL_LAST,
+        { check(CURL_LAST); });
+  }
+  SECTION("when curl_easy_setopt fails for CURLOPT_TCP_KEEPIDLE") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_setopt_CURLOPT_TCP_KEEPIDLE, CURL_LAST,
+        { check(CURL_LAST); });
+  }
+  SECTION("when curl_easy_setopt fails for CURLOPT_TCP_KEEPINTVL") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_setopt_CURLOPT_TCP_KEEPINTVL, CURL_LAST,
+        { check(CURL_LAST); });
+  }
+  SECTION("when max_connections is too large") {
+    policy.max_connections = SIZE_MAX;
+    check(CURLE_BAD_FUNCTION_ARGUMENT);
+  }
+}
+
+TEST_CASE("Client can prewarm and close its connections") {
+  mk::curl::Client client;
+  std::vector<std::string> urls{"http://a.example.com/",
+                                 "http://b.example.com/"};
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    REQUIRE(client.prewarm(mk::curl::Request{}, urls) == 2);
+  });
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+    REQUIRE(client.prewarm(mk::curl::Request{}, urls) == 0);
+  });
+  REQUIRE(client.stats().requests == 4);
+  client.close_connections();
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    REQUIRE(client.perform(mk::curl::Request{}).error == CURLE_OK);
+  });
+}
+
 TEST_CASE("When curl_slist_append fails for the Expect header") {
   MKMOCK_WITH_ENABLED_HOOK(curl_slist_append_Expect_header, nullptr, {
     mk::curl::Request req;
@@ -154,6 +1141,25 @@ CURL_EASY_SETOPT_FAILURE_TEST(
       r.connect_to = "::127.0.0.1:";
     })
 
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_RESOLVE,
+    [](mk::curl::Request &r) {
+      r.url = "https://www.example.com/";
+      r.connect_addresses = {"127.0.0.1"};
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_DOH_URL,
+    [](mk::curl::Request &r) {
+      r.doh_url = "https://dns.google/dns-query";
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS,
+    [](mk::curl::Request &r) {
+      r.happy_eyeballs_timeout_ms = 100;
+    })
+
 CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_TCP_FASTOPEN,
     [](mk::curl::Request &r) {
@@ -192,6 +1198,44 @@ CURL_EASY_SETOPT_FAILURE_TEST(
       r.body = "12345 54321";
     })
 
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_READFUNCTION,
+    [](mk::curl::Request &r) {
+      r.method = "POST";
+      r.body_source = [](char *, size_t) -> size_t { return 0; };
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_READDATA,
+    [](mk::curl::Request &r) {
+      r.method = "PUT";
+      r.body_source = [](char *, size_t) -> size_t { return 0; };
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_SEEKFUNCTION,
+    [](mk::curl::Request &r) {
+      r.method = "POST";
+      r.body_source = [](char *, size_t) -> size_t { return 0; };
+      r.body_source_rewind = [](int64_t) { return true; };
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_SEEKDATA,
+    [](mk::curl::Request &r) {
+      r.method = "POST";
+      r.body_source = [](char *, size_t) -> size_t { return 0; };
+      r.body_source_rewind = [](int64_t) { return true; };
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_POSTFIELDSIZE_LARGE,
+    [](mk::curl::Request &r) {
+      r.method = "POST";
+      r.body_source = [](char *, size_t) -> size_t { return 0; };
+      r.body_source_size = 0;
+    })
+
 TEST_CASE("When the body size would overflow a long integer") {
   MKMOCK_WITH_ENABLED_HOOK(body_size_overflow_inject, true, {
     mk::curl::Request req;
@@ -227,6 +1271,30 @@ CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_WRITEDATA,
     [](mk::curl::Request &) {})
 
+TEST_CASE("When setting the write callback fails with a body sink") {
+  mk::curl::Request req;
+  req.body_sink = [](const char *, size_t) { return true; };
+  SECTION("for curl_easy_setopt_CURLOPT_WRITEFUNCTION") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_setopt_CURLOPT_WRITEFUNCTION, CURL_LAST, {
+          REQUIRE(mk::curl::perform(req).error == CURL_LAST);
+        });
+  }
+  SECTION("for curl_easy_setopt_CURLOPT_WRITEDATA") {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_WRITEDATA, CURL_LAST, {
+      REQUIRE(mk::curl::perform(req).error == CURL_LAST);
+    });
+  }
+}
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_HEADERFUNCTION,
+    [](mk::curl::Request &) {})
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_HEADERDATA,
+    [](mk::curl::Request &) {})
+
 CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_NOSIGNAL,
     [](mk::curl::Request &) {})
@@ -235,6 +1303,32 @@ CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_TIMEOUT,
     [](mk::curl::Request &) {})
 
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_TIMEOUT_MS,
+    [](mk::curl::Request &r) {
+      r.timeout_ms = 1500;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_CONNECTTIMEOUT_MS,
+    [](mk::curl::Request &r) {
+      r.connect_timeout_ms = 500;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_LOW_SPEED_LIMIT,
+    [](mk::curl::Request &r) {
+      r.low_speed_limit = 1000;
+      r.low_speed_time = 5;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_LOW_SPEED_TIME,
+    [](mk::curl::Request &r) {
+      r.low_speed_limit = 1000;
+      r.low_speed_time = 5;
+    })
+
 CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_DEBUGFUNCTION,
     [](mk::curl::Request &) {})
@@ -259,9 +1353,61 @@ CURL_EASY_SETOPT_FAILURE_TEST(
       r.follow_redir = true;
     })
 
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_ACCEPT_ENCODING,
+    [](mk::curl::Request &r) {
+      r.enable_compression = true;
+    })
+
 CURL_EASY_SETOPT_FAILURE_TEST(
     curl_easy_setopt_CURLOPT_CERTINFO,
-    [](mk::curl::Request &) {})
+    [](mk::curl::Request &r) {
+      r.enable_certinfo = true;
+    })
+
+TEST_CASE("We don't ask for the certificate chain by default") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_CERTINFO, CURL_LAST, {
+      MKMOCK_WITH_ENABLED_HOOK(
+          curl_easy_getinfo_CURLINFO_CERTINFO, CURL_LAST, {
+        mk::curl::Request req;
+        mk::curl::Response resp = mk::curl::perform(req);
+        REQUIRE(resp.error == CURLE_OK);
+        REQUIRE(resp.certs.empty());
+      });
+    });
+  });
+}
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_XFERINFOFUNCTION,
+    [](mk::curl::Request &r) {
+      r.sample_interval_us = 1000;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_XFERINFODATA,
+    [](mk::curl::Request &r) {
+      r.sample_interval_us = 1000;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_NOPROGRESS,
+    [](mk::curl::Request &r) {
+      r.sample_interval_us = 1000;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_MAX_RECV_SPEED_LARGE,
+    [](mk::curl::Request &r) {
+      r.max_recv_speed = 1 << 20;
+    })
+
+CURL_EASY_SETOPT_FAILURE_TEST(
+    curl_easy_setopt_CURLOPT_MAX_SEND_SPEED_LARGE,
+    [](mk::curl::Request &r) {
+      r.max_send_speed = 1 << 20;
+    })
 
 TEST_CASE("When curl_easy_perform() fails") {
   MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURL_LAST, {
@@ -272,6 +1418,124 @@ TEST_CASE("When curl_easy_perform() fails") {
   });
 }
 
+TEST_CASE("mkcurl_backoff works as intended") {
+  mk::curl::RetryPolicy policy;
+  policy.initial_backoff_ms = 100;
+  policy.max_backoff_ms = 1000;
+
+  SECTION("without jitter") {
+    policy.jitter = 0.0;
+    REQUIRE(mk::curl::mkcurl_backoff(policy, 0) == 100);
+    REQUIRE(mk::curl::mkcurl_backoff(policy, 1) == 200);
+    REQUIRE(mk::curl::mkcurl_backoff(policy, 3) == 800);
+    REQUIRE(mk::curl::mkcurl_backoff(policy, 4) == 1000);
+    REQUIRE(mk::curl::mkcurl_backoff(policy, 1000) == 1000);
+  }
+
+  SECTION("with jitter") {
+    policy.jitter = 0.5;
+    for (size_t i = 0; i < 100; ++i) {
+      int64_t delay = mk::curl::mkcurl_backoff(policy, 2);
+      REQUIRE(delay >= 200);
+      REQUIRE(delay <= 400);
+    }
+  }
+}
+
+TEST_CASE("We retry according to the RetryPolicy") {
+  mk::curl::Request req;
+  req.retry_policy.initial_backoff_ms = 1;
+  req.retry_policy.jitter = 0.0;
+
+  SECTION("for a retriable error") {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_RECV_ERROR, {
+      mk::curl::Response resp = mk::curl::perform(req);
+      REQUIRE(resp.error == CURLE_RECV_ERROR);
+      REQUIRE(resp.attempts.size() == 3);
+      REQUIRE(resp.attempts[0].error == CURLE_RECV_ERROR);
+      REQUIRE(resp.attempts[0].delay_ms == 1);
+      REQUIRE(resp.attempts[1].delay_ms == 2);
+      REQUIRE(resp.attempts[2].delay_ms == 0);
+    });
+  }
+
+  SECTION("but not for an error that is not retriable") {
+    req.retry_policy.retriable_errors = {CURLE_COULDNT_CONNECT};
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_RECV_ERROR, {
+      mk::curl::Response resp = mk::curl::perform(req);
+      REQUIRE(resp.attempts.size() == 1);
+    });
+  }
+
+  SECTION("but only for connect errors with POST") {
+    req.method = "POST";
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_RECV_ERROR, {
+      REQUIRE(mk::curl::perform(req).attempts.size() == 1);
+      req.retry_policy.retry_non_idempotent = true;
+      REQUIRE(mk::curl::perform(req).attempts.size() == 3);
+    });
+    req.retry_policy.retry_non_idempotent = false;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+      REQUIRE(mk::curl::perform(req).attempts.size() == 3);
+    });
+  }
+
+  SECTION("but only rewinding the body_source if needed") {
+    req.method = "POST";
+    req.body_source = [](char *, size_t) -> size_t { return 0; };
+    req.retry_policy.retry_non_idempotent = true;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_RECV_ERROR, {
+      REQUIRE(mk::curl::perform(req).attempts.size() == 1);
+      size_t rewinds = 0;
+      req.body_source_rewind = [&](int64_t offset) {
+        REQUIRE(offset == 0);
+        return ++rewinds < 2;
+      };
+      REQUIRE(mk::curl::perform(req).attempts.size() == 2);
+      REQUIRE(rewinds == 2);
+    });
+    req.body_source_rewind = nullptr;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+      REQUIRE(mk::curl::perform(req).attempts.size() == 3);
+    });
+  }
+
+  SECTION("for a retriable status code") {
+    // Since there is no response, the status code is zero.
+    req.retry_policy.retriable_statuses = {0};
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+      mk::curl::Response resp = mk::curl::perform(req);
+      REQUIRE(resp.attempts.size() == 3);
+      REQUIRE(resp.attempts[2].status_code == 0);
+    });
+  }
+
+  SECTION("but not when exceeding max_elapsed_ms") {
+    req.retry_policy.initial_backoff_ms = 1000;
+    req.retry_policy.max_elapsed_ms = 10;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+      REQUIRE(mk::curl::perform(req).attempts.size() == 1);
+    });
+  }
+
+  SECTION("but not past the timeout without max_elapsed_ms") {
+    req.retry_policy.initial_backoff_ms = 1000;
+    req.timeout_ms = 10;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OPERATION_TIMEDOUT, {
+      mk::curl::Response resp = mk::curl::perform(req);
+      REQUIRE(resp.error == CURLE_OPERATION_TIMEDOUT);
+      REQUIRE(resp.attempts.size() == 1);
+    });
+  }
+
+  SECTION("but not more than the number of retries") {
+    req.retries = 0;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+      REQUIRE(mk::curl::perform(req).attempts.size() == 1);
+    });
+  }
+}
+
 #define CURL_EASY_GETINFO_FAILURE_TEST(Tag)                 \
   TEST_CASE("When " #Tag " fails") {                        \
     MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, { \
@@ -283,14 +1547,36 @@ TEST_CASE("When curl_easy_perform() fails") {
     });                                                     \
   }
 
+TEST_CASE("When the transfer fails we still fill the timings") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_COULDNT_CONNECT, {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_getinfo_CURLINFO_TOTAL_TIME_T, CURL_LAST, {
+          mk::curl::Request req;
+          req.retries = 0;
+          mk::curl::Response resp = mk::curl::perform(req);
+          REQUIRE(resp.error == CURLE_COULDNT_CONNECT);
+          REQUIRE(resp.logs.back().line.find("TOTAL_TIME_T") !=
+                  std::string::npos);
+        });
+  });
+}
+
 CURL_EASY_GETINFO_FAILURE_TEST(
     curl_easy_getinfo_CURLINFO_RESPONSE_CODE)
 
 CURL_EASY_GETINFO_FAILURE_TEST(
     curl_easy_getinfo_CURLINFO_REDIRECT_URL)
 
-CURL_EASY_GETINFO_FAILURE_TEST(
-    curl_easy_getinfo_CURLINFO_CERTINFO)
+TEST_CASE("When curl_easy_getinfo_CURLINFO_CERTINFO fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_getinfo_CURLINFO_CERTINFO, CURL_LAST, {
+      mk::curl::Request req;
+      req.enable_certinfo = true;
+      mk::curl::Response resp = mk::curl::perform(req);
+      REQUIRE(resp.error == CURL_LAST);
+    });
+  });
+}
 
 CURL_EASY_GETINFO_FAILURE_TEST(
     curl_easy_getinfo_CURLINFO_CONTENT_TYPE)
@@ -298,6 +1584,51 @@ CURL_EASY_GETINFO_FAILURE_TEST(
 CURL_EASY_GETINFO_FAILURE_TEST(
     curl_easy_getinfo_CURLINFO_HTTP_VERSION)
 
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_SIZE_DOWNLOAD_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_NUM_CONNECTS)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_PRIMARY_IP)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_PRIMARY_PORT)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_LOCAL_IP)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_LOCAL_PORT)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_NAMELOOKUP_TIME_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_CONNECT_TIME_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_APPCONNECT_TIME_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_PRETRANSFER_TIME_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_STARTTRANSFER_TIME_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_TOTAL_TIME_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_REDIRECT_TIME_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_SPEED_DOWNLOAD_T)
+
+CURL_EASY_GETINFO_FAILURE_TEST(
+    curl_easy_getinfo_CURLINFO_SPEED_UPLOAD_T)
+
 TEST_CASE("When we don't support the request method") {
   mk::curl::Request req;
   req.method = "HEAD";
@@ -313,3 +1644,409 @@ TEST_CASE("HTTPVersionString works correctly") {
                      CURL_HTTP_VERSION_LAST),
                  "") == 0);
 }
+
+TEST_CASE("Client reuses the options of a PreparedRequest") {
+  mk::curl::Client client;
+  mk::curl::PreparedRequest prepared{mk::curl::Request{}};
+  REQUIRE(client.perform(prepared).error == CURLE_URL_MALFORMAT);
+
+  SECTION("when performing it again") {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURLE_URL_MALFORMAT);
+    });
+  }
+
+  SECTION("but not after performing another request") {
+    REQUIRE(client.perform(mk::curl::Request{}).error == CURLE_URL_MALFORMAT);
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURL_LAST);
+    });
+  }
+
+  SECTION("but not when using another client") {
+    mk::curl::Client other;
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURL_LAST, {
+      REQUIRE(other.perform(prepared).error == CURL_LAST);
+    });
+  }
+
+  SECTION("but not after another client performed it") {
+    mk::curl::Client other;
+    REQUIRE(other.perform(prepared).error == CURLE_URL_MALFORMAT);
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURL_LAST);
+    });
+  }
+
+  SECTION("but not when the URL moves to another origin") {
+    prepared.set_url("http://127.0.0.1:1/");
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURL_LAST);
+    });
+  }
+
+  SECTION("and only patches the changed URL") {
+    prepared.set_url("");
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_URL, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURL_LAST);
+    });
+    // After a failure, we must configure everything again.
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURL_LAST);
+    });
+  }
+}
+
+TEST_CASE("Client does not reuse the options of a PreparedRequest") {
+  mk::curl::Client client;
+  mk::curl::Request req;
+  SECTION("when using a DNSCache") {
+    req.dns_cache = std::make_shared<mk::curl::DNSCache>();
+  }
+  SECTION("when changing the URL with connect_addresses") {
+    req.connect_addresses = {"127.0.0.1"};
+  }
+  req.url = "http://127.0.0.1:1/";
+  mk::curl::PreparedRequest prepared{req};
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    REQUIRE(client.perform(prepared).error == CURLE_OK);
+  });
+  prepared.set_url("http://127.0.0.1:1/robots.txt");
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_NOSIGNAL, CURL_LAST, {
+    REQUIRE(client.perform(prepared).error == CURL_LAST);
+  });
+}
+
+TEST_CASE("Client accounts for the requests it performs") {
+  mk::curl::Client client;
+  REQUIRE(client.perform(mk::curl::Request{}).error == CURLE_URL_MALFORMAT);
+  mk::curl::PreparedRequest prepared{mk::curl::Request{}};
+  REQUIRE(client.perform(prepared).error == CURLE_URL_MALFORMAT);
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_perform, CURLE_OK, {
+    mk::curl::Request req;
+    req.url = "http://127.0.0.1/";
+    mk::curl::Response res = client.perform(req);
+    REQUIRE(res.error == CURLE_OK);
+    // Since nothing was transferred, cURL did not open any connection.
+    REQUIRE(res.num_connects == 0);
+    REQUIRE(res.connection_reused);
+  });
+  mk::curl::ClientStats stats = client.stats();
+  REQUIRE(stats.requests == 3);
+  REQUIRE(stats.failures == 2);
+  REQUIRE(stats.connects == 0);
+  REQUIRE(stats.reused == 1);
+  REQUIRE(stats.tls_resumed == 0);
+}
+
+TEST_CASE("PreparedRequest patches the body") {
+  mk::curl::Request req;
+  req.method = "POST";
+  mk::curl::Client client;
+  mk::curl::PreparedRequest prepared{req};
+  REQUIRE(client.perform(prepared).error == CURLE_URL_MALFORMAT);
+  prepared.set_body("abc");
+  REQUIRE(prepared.request().body == "abc");
+
+  SECTION("when CURLOPT_POSTFIELDS fails") {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_POSTFIELDS, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURL_LAST);
+    });
+  }
+
+  SECTION("when CURLOPT_POSTFIELDSIZE fails") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_easy_setopt_CURLOPT_POSTFIELDSIZE, CURL_LAST, {
+          REQUIRE(client.perform(prepared).error == CURL_LAST);
+        });
+  }
+
+  SECTION("when CURLOPT_WRITEDATA fails") {
+    MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_WRITEDATA, CURL_LAST, {
+      REQUIRE(client.perform(prepared).error == CURL_LAST);
+    });
+  }
+}
+
+TEST_CASE("When curl_easy_init fails with a PreparedRequest") {
+  mk::curl::Client client;
+  mk::curl::PreparedRequest prepared{mk::curl::Request{}};
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_init, nullptr, {
+    REQUIRE(client.perform(prepared).error == CURLE_OUT_OF_MEMORY);
+  });
+}
+
+TEST_CASE("When curl_multi_init fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_multi_init, nullptr, {
+    mk::curl::MultiClient client;
+    std::vector<mk::curl::Response> resps = client.perform(
+        std::vector<mk::curl::Request>(3));
+    REQUIRE(resps.size() == 3);
+    for (auto &resp : resps) {
+      REQUIRE(resp.error == CURLE_OUT_OF_MEMORY);
+    }
+  });
+}
+
+TEST_CASE("When curl_multi_setopt fails") {
+  mk::curl::MultiSettings settings;
+  settings.max_host_connections = 2;
+
+  SECTION("for CURLMOPT_PIPELINING") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_multi_setopt_CURLMOPT_PIPELINING, CURLM_UNKNOWN_OPTION, {
+          mk::curl::MultiClient client{settings};
+          std::vector<mk::curl::Response> resps = client.perform(
+              std::vector<mk::curl::Request>(1));
+          REQUIRE(resps.size() == 1);
+          REQUIRE(resps[0].error == CURLE_OUT_OF_MEMORY);
+        });
+  }
+
+  SECTION("for CURLMOPT_MAX_HOST_CONNECTIONS") {
+    MKMOCK_WITH_ENABLED_HOOK(
+        curl_multi_setopt_CURLMOPT_MAX_HOST_CONNECTIONS,
+        CURLM_UNKNOWN_OPTION, {
+          mk::curl::MultiClient client{settings};
+          std::vector<mk::curl::Response> resps = client.perform(
+              std::vector<mk::curl::Request>(1));
+          REQUIRE(resps.size() == 1);
+          REQUIRE(resps[0].error == CURLE_OUT_OF_MEMORY);
+        });
+  }
+}
+
+TEST_CASE("When curl_easy_setopt fails for CURLOPT_PIPEWAIT") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_PIPEWAIT, CURL_LAST, {
+    mk::curl::MultiClient client;
+    mk::curl::Request req;
+    req.enable_http2 = true;
+    std::vector<mk::curl::Response> resps = client.perform({req});
+    REQUIRE(resps.size() == 1);
+    REQUIRE(resps[0].error == CURL_LAST);
+  });
+}
+
+TEST_CASE("When curl_easy_init fails for a MultiClient") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_init, nullptr, {
+    mk::curl::MultiClient client;
+    std::vector<mk::curl::Response> resps = client.perform(
+        std::vector<mk::curl::Request>(3));
+    REQUIRE(resps.size() == 3);
+    for (auto &resp : resps) {
+      REQUIRE(resp.error == CURLE_OUT_OF_MEMORY);
+    }
+  });
+}
+
+TEST_CASE("When curl_multi_add_handle fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_multi_add_handle, CURLM_INTERNAL_ERROR, {
+    mk::curl::MultiClient client;
+    std::vector<mk::curl::Response> resps = client.perform(
+        std::vector<mk::curl::Request>(3));
+    REQUIRE(resps.size() == 3);
+    for (auto &resp : resps) {
+      REQUIRE(resp.error == CURLE_FAILED_INIT);
+    }
+  });
+}
+
+TEST_CASE("When curl_multi_perform fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_multi_perform, CURLM_INTERNAL_ERROR, {
+    mk::curl::MultiClient client;
+    std::vector<mk::curl::Response> resps = client.perform(
+        std::vector<mk::curl::Request>(3));
+    REQUIRE(resps.size() == 3);
+    for (auto &resp : resps) {
+      REQUIRE(resp.error == CURLE_FAILED_INIT);
+    }
+  });
+}
+
+TEST_CASE("When curl_multi_wait or curl_multi_poll fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_multi_wait, CURLM_INTERNAL_ERROR, {
+    MKMOCK_WITH_ENABLED_HOOK(curl_multi_poll, CURLM_INTERNAL_ERROR, {
+      mk::curl::MultiClient client;
+      mk::curl::Request req;
+      req.url = "http://127.0.0.1:0/";  // Never completes immediately
+      std::vector<mk::curl::Response> resps = client.perform({req});
+      REQUIRE(resps.size() == 1);
+      REQUIRE(resps[0].error == CURLE_FAILED_INIT);
+    });
+  });
+}
+
+TEST_CASE("MultiClient retries after a delay") {
+  mk::curl::MultiClient client;
+  mk::curl::Request req;
+  req.url = "http://127.0.0.1:0/";  // Fails with CURLE_COULDNT_CONNECT
+  req.retry_policy.initial_backoff_ms = 20;
+  req.retry_policy.jitter = 0.0;
+  std::vector<mk::curl::Response> resps = client.perform({req, req});
+  REQUIRE(resps.size() == 2);
+  for (auto &resp : resps) {
+    REQUIRE(resp.error == CURLE_COULDNT_CONNECT);
+    REQUIRE(resp.attempts.size() == 3);
+    REQUIRE(resp.attempts[0].delay_ms == 20);
+    REQUIRE(resp.attempts[1].delay_ms == 40);
+  }
+}
+
+TEST_CASE("MultiClient returns the Responses in the Requests order") {
+  mk::curl::MultiSettings settings;
+  settings.concurrency = 0;  // Should be treated like one
+  mk::curl::MultiClient client{settings};
+  std::vector<mk::curl::Request> reqs(4);
+  reqs[0].method = "HEAD";
+  reqs[2].method = "HEAD";
+  std::vector<mk::curl::Response> resps = client.perform(reqs);
+  REQUIRE(resps.size() == 4);
+  REQUIRE(resps[0].error == CURLE_BAD_FUNCTION_ARGUMENT);
+  REQUIRE(resps[1].error == CURLE_URL_MALFORMAT);
+  REQUIRE(resps[2].error == CURLE_BAD_FUNCTION_ARGUMENT);
+  REQUIRE(resps[3].error == CURLE_URL_MALFORMAT);
+}
+
+TEST_CASE("When curl_multi_init fails for an AsyncClient") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_multi_init, nullptr, {
+    mk::curl::AsyncClient client;
+    mk::curl::Response resp = client.perform(mk::curl::Request{}).get();
+    REQUIRE(resp.error == CURLE_OUT_OF_MEMORY);
+  });
+}
+
+TEST_CASE("AsyncClient returns a future Response") {
+  mk::curl::AsyncClient client;
+  mk::curl::Request req;
+  req.method = "HEAD";
+  std::future<mk::curl::Response> bad_method = client.perform(req);
+  std::future<mk::curl::Response> bad_url = client.perform(
+      mk::curl::Request{});
+  REQUIRE(bad_method.get().error == CURLE_BAD_FUNCTION_ARGUMENT);
+  REQUIRE(bad_url.get().error == CURLE_URL_MALFORMAT);
+}
+
+TEST_CASE("AsyncClient calls the callback") {
+  std::promise<int64_t> promise;
+  mk::curl::AsyncClient client;
+  client.perform(mk::curl::Request{}, [&](mk::curl::Response resp) {
+    promise.set_value(resp.error);
+  });
+  REQUIRE(promise.get_future().get() == CURLE_URL_MALFORMAT);
+}
+
+TEST_CASE("AsyncClient completes all the requests when destroyed") {
+  std::vector<std::future<mk::curl::Response>> futures;
+  {
+    mk::curl::AsyncClient client;
+    for (size_t i = 0; i < 16; ++i) {
+      futures.push_back(client.perform(mk::curl::Request{}));
+    }
+  }
+  for (auto &future : futures) {
+    int64_t error = future.get().error;
+    REQUIRE((error == CURLE_URL_MALFORMAT ||
+             error == CURLE_ABORTED_BY_CALLBACK));
+  }
+}
+
+TEST_CASE("When mkcurl_share_lock_cb_ is passed a NULL userptr") {
+  REQUIRE_THROWS(mkcurl_share_lock_cb_(
+      nullptr, CURL_LOCK_DATA_DNS, CURL_LOCK_ACCESS_SINGLE, nullptr));
+}
+
+TEST_CASE("When mkcurl_share_lock_cb_ is passed an invalid curl_lock_data") {
+  REQUIRE_THROWS(mkcurl_share_lock_cb_(nullptr, CURL_LOCK_DATA_LAST,
+                                       CURL_LOCK_ACCESS_SINGLE,
+                                       (void *)0x123456));
+}
+
+TEST_CASE("When mkcurl_share_unlock_cb_ is passed a NULL userptr") {
+  REQUIRE_THROWS(mkcurl_share_unlock_cb_(nullptr, CURL_LOCK_DATA_DNS,
+                                         nullptr));
+}
+
+TEST_CASE("When mkcurl_share_unlock_cb_ is passed an invalid curl_lock_data") {
+  REQUIRE_THROWS(mkcurl_share_unlock_cb_(nullptr, CURL_LOCK_DATA_LAST,
+                                         (void *)0x123456));
+}
+
+TEST_CASE("When curl_easy_setopt_CURLOPT_SHARE fails") {
+  MKMOCK_WITH_ENABLED_HOOK(curl_easy_setopt_CURLOPT_SHARE, CURL_LAST, {
+    std::shared_ptr<mk::curl::Share> share{new mk::curl::Share};
+    mk::curl::Client client{share};
+    mk::curl::Response resp = client.perform(mk::curl::Request{});
+    REQUIRE(resp.error == CURL_LAST);
+  });
+}
+
+// When creating a share fails, clients should work without sharing.
+#define CURL_SHARE_FAILURE_TEST(Tag, Value)                                  \
+  TEST_CASE("When " #Tag " fails") {                                         \
+    MKMOCK_WITH_ENABLED_HOOK(Tag, Value, {                                   \
+      std::shared_ptr<mk::curl::Share> share{new mk::curl::Share{true}};    \
+      mk::curl::Client client{share};                                        \
+      mk::curl::Response resp = client.perform(mk::curl::Request{});         \
+      REQUIRE(resp.error == CURLE_URL_MALFORMAT);                            \
+    });                                                                      \
+  }
+
+CURL_SHARE_FAILURE_TEST(curl_share_init, nullptr)
+
+CURL_SHARE_FAILURE_TEST(
+    curl_share_setopt_CURLSHOPT_LOCKFUNC, CURLSHE_BAD_OPTION)
+
+CURL_SHARE_FAILURE_TEST(
+    curl_share_setopt_CURLSHOPT_UNLOCKFUNC, CURLSHE_BAD_OPTION)
+
+CURL_SHARE_FAILURE_TEST(
+    curl_share_setopt_CURLSHOPT_USERDATA, CURLSHE_BAD_OPTION)
+
+CURL_SHARE_FAILURE_TEST(
+    curl_share_setopt_CURLSHOPT_SHARE, CURLSHE_BAD_OPTION)
+
+TEST_CASE("Clients on different threads can use the same Share") {
+  std::shared_ptr<mk::curl::Share> share{new mk::curl::Share};
+  mk::curl::MultiSettings settings;
+  settings.share = share;
+  mk::curl::AsyncClient async_client{settings};
+  std::future<mk::curl::Response> future = async_client.perform(
+      mk::curl::Request{});
+  mk::curl::Client client{share};
+  REQUIRE(client.perform(mk::curl::Request{}).error == CURLE_URL_MALFORMAT);
+  REQUIRE(future.get().error == CURLE_URL_MALFORMAT);
+}
+
+TEST_CASE("ClientPool blocks checkout until a Client is returned") {
+  mk::curl::ClientPool pool{0};  // Should be treated like one
+  std::promise<void> checked_out;
+  std::thread thread;
+  {
+    mk::curl::ClientPool::Lease lease = pool.checkout();
+    thread = std::thread{[&]() {
+      mk::curl::ClientPool::Lease other = pool.checkout();
+      checked_out.set_value();
+    }};
+    std::future<void> future = checked_out.get_future();
+    REQUIRE(future.wait_for(std::chrono::milliseconds(100)) ==
+            std::future_status::timeout);
+    mk::curl::ClientPool::Lease moved = std::move(lease);
+    REQUIRE(moved.client().perform(mk::curl::Request{}).error ==
+            CURLE_URL_MALFORMAT);
+  }
+  thread.join();
+}
+
+TEST_CASE("ClientPool can be used by several threads") {
+  std::shared_ptr<mk::curl::Share> share{new mk::curl::Share};
+  mk::curl::ClientPool pool{2, share};
+  std::vector<std::future<mk::curl::Response>> futures;
+  for (size_t i = 0; i < 8; ++i) {
+    futures.push_back(std::async(std::launch::async, [&]() {
+      return pool.perform(mk::curl::Request{});
+    }));
+  }
+  for (auto &future : futures) {
+    REQUIRE(future.get().error == CURLE_URL_MALFORMAT);
+  }
+}